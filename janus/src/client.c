@@ -39,12 +39,19 @@
 #include "rtp.h"
 
 
+// The keyframe may take hundreds of packets, the low memory rings are for the usual KVM sizes
+#define _VIDEO_RING_SIZE			2048
+#define _VIDEO_RING_SIZE_LOW_MEMORY	256
+#define _AUDIO_RING_SIZE			64
+#define _AUDIO_RING_SIZE_LOW_MEMORY	16
+
+
 static void *_video_thread(void *v_client);
 static void *_audio_thread(void *v_client);
 static void *_common_thread(void *v_client, bool video);
 
 
-us_janus_client_s *us_janus_client_init(janus_callbacks *gw, janus_plugin_session *session) {
+us_janus_client_s *us_janus_client_init(janus_callbacks *gw, janus_plugin_session *session, bool low_memory) {
 	us_janus_client_s *client;
 	US_CALLOC(client, 1);
 	client->gw = gw;
@@ -55,10 +62,12 @@ us_janus_client_s *us_janus_client_init(janus_callbacks *gw, janus_plugin_sessio
 
 	atomic_init(&client->stop, false);
 
-	US_RING_INIT_WITH_ITEMS(client->video_ring, 2048, us_rtp_init);
+	US_RING_INIT_WITH_ITEMS(client->video_ring,
+		(low_memory ? _VIDEO_RING_SIZE_LOW_MEMORY : _VIDEO_RING_SIZE), us_rtp_init);
 	US_THREAD_CREATE(client->video_tid, _video_thread, client);
 
-	US_RING_INIT_WITH_ITEMS(client->audio_ring, 64, us_rtp_init);
+	US_RING_INIT_WITH_ITEMS(client->audio_ring,
+		(low_memory ? _AUDIO_RING_SIZE_LOW_MEMORY : _AUDIO_RING_SIZE), us_rtp_init);
 	US_THREAD_CREATE(client->audio_tid, _audio_thread, client);
 
 	return client;
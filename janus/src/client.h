@@ -52,7 +52,7 @@ typedef struct {
 } us_janus_client_s;
 
 
-us_janus_client_s *us_janus_client_init(janus_callbacks *gw, janus_plugin_session *session);
+us_janus_client_s *us_janus_client_init(janus_callbacks *gw, janus_plugin_session *session, bool low_memory);
 void us_janus_client_destroy(us_janus_client_s *client);
 
 void us_janus_client_send(us_janus_client_s *client, const us_rtp_s *rtp);
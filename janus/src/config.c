@@ -24,6 +24,7 @@
 
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 
 #include <janus/config.h>
 #include <janus/plugins/plugin.h>
@@ -35,7 +36,7 @@
 
 
 static char *_get_value(janus_config *jcfg, const char *section, const char *option);
-// static bool _get_bool(janus_config *jcfg, const char *section, const char *option, bool def);
+static bool _get_bool(janus_config *jcfg, const char *section, const char *option, bool def);
 
 
 us_config_s *us_config_init(const char *config_dir_path) {
@@ -69,6 +70,8 @@ us_config_s *us_config_init(const char *config_dir_path) {
 		}
 	}
 
+	config->low_memory = _get_bool(jcfg, "memory", "low", false);
+
 	goto ok;
 
 error:
@@ -96,7 +99,7 @@ static char *_get_value(janus_config *jcfg, const char *section, const char *opt
 	return us_strdup(option_obj->value);
 }
 
-/*static bool _get_bool(janus_config *jcfg, const char *section, const char *option, bool def) {
+static bool _get_bool(janus_config *jcfg, const char *section, const char *option, bool def) {
 	char *const tmp = _get_value(jcfg, section, option);
 	bool value = def;
 	if (tmp != NULL) {
@@ -104,4 +107,4 @@ static char *_get_value(janus_config *jcfg, const char *section, const char *opt
 		free(tmp);
 	}
 	return value;
-}*/
+}
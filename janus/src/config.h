@@ -22,12 +22,16 @@
 
 #pragma once
 
+#include <stdbool.h>
+
 
 typedef struct {
 	char	*video_sink_name;
 
 	char	*audio_dev_name;
 	char	*tc358743_dev_path;
+
+	bool	low_memory;
 } us_config_s;
 
 
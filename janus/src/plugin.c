@@ -42,6 +42,7 @@
 #include "uslibs/threading.h"
 #include "uslibs/list.h"
 #include "uslibs/ring.h"
+#include "uslibs/frame.h"
 #include "uslibs/memsinksh.h"
 #include "uslibs/tc358743.h"
 
@@ -59,6 +60,10 @@
 static us_config_s		*_g_config = NULL;
 static const useconds_t	_g_watchers_polling = 100000;
 
+// The frame data is allocated on demand with the low memory
+#define _VIDEO_RING_SIZE			64
+#define _VIDEO_RING_SIZE_LOW_MEMORY	8
+
 static us_janus_client_s	*_g_clients = NULL;
 static janus_callbacks		*_g_gw = NULL;
 static us_ring_s			*_g_video_ring = NULL;
@@ -290,7 +295,12 @@ static int _plugin_init(janus_callbacks *gw, const char *config_dir_path) {
 	}
 	_g_gw = gw;
 
-	US_RING_INIT_WITH_ITEMS(_g_video_ring, 64, us_frame_init);
+	if (_g_config->low_memory) {
+		US_JLOG_INFO("main", "Using the low memory mode");
+		us_frame_set_low_memory(true);
+	}
+	US_RING_INIT_WITH_ITEMS(_g_video_ring,
+		(_g_config->low_memory ? _VIDEO_RING_SIZE_LOW_MEMORY : _VIDEO_RING_SIZE), us_frame_init);
 	_g_rtpv = us_rtpv_init(_relay_rtp_clients);
 	if (_g_config->audio_dev_name != NULL && us_audio_probe(_g_config->audio_dev_name)) {
 		_g_rtpa = us_rtpa_init(_relay_rtp_clients);
@@ -331,7 +341,7 @@ static void _plugin_create_session(janus_plugin_session *session, int *err) {
 	_IF_DISABLED({ *err = -1; return; });
 	_LOCK_ALL;
 	US_JLOG_INFO("main", "Creating session %p ...", session);
-	us_janus_client_s *const client = us_janus_client_init(_g_gw, session);
+	us_janus_client_s *const client = us_janus_client_init(_g_gw, session, _g_config->low_memory);
 	US_LIST_APPEND(_g_clients, client);
 	atomic_store(&_g_has_watchers, true);
 	_UNLOCK_ALL;
@@ -530,7 +540,27 @@ static struct janus_plugin_result *_plugin_handle_message(
 		}
 
 	} else if (!strcmp(request_str, "features")) {
-		json_t *const features = json_pack("{sb}", "audio", (_g_rtpa != NULL));
+		us_frame_stats_s frames;
+		us_frame_get_stats(&frames);
+		uint n_clients = 0;
+		uz rtp_size = 0;
+		_LOCK_ALL;
+		US_LIST_ITERATE(_g_clients, client, {
+			++n_clients;
+			rtp_size += (client->video_ring->capacity + client->audio_ring->capacity) * sizeof(us_rtp_s);
+		});
+		_UNLOCK_ALL;
+		json_t *const features = json_pack(
+			"{sb s{sb s{sIsI} s{sIsI} s{sIsI}}}",
+			"audio", (_g_rtpa != NULL),
+			"memory",
+				"low_memory", _g_config->low_memory,
+				"frames", "allocated", (json_int_t)frames.allocated, "used", (json_int_t)frames.used,
+				"video_ring",
+					"capacity", (json_int_t)_g_video_ring->capacity,
+					"queued", (json_int_t)us_ring_get_queued(_g_video_ring),
+				"rtp_rings", "clients", (json_int_t)n_clients, "size", (json_int_t)rtp_size
+		);
 		PUSH_STATUS("features", features, NULL);
 		json_decref(features);
 
@@ -0,0 +1 @@
+../../../src/libs/futex.h
\ No newline at end of file
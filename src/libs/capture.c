@@ -31,8 +31,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
+#include <poll.h>
 
 #include <sys/select.h>
+#include <sys/eventfd.h>
 #include <sys/mman.h>
 #include <sys/time.h>
 
@@ -47,6 +49,7 @@
 #include "logging.h"
 #include "threading.h"
 #include "frame.h"
+#include "tracer.h"
 #include "xioctl.h"
 
 
@@ -123,6 +126,8 @@ us_capture_s *us_capture_init(void) {
 	us_capture_runtime_s *run;
 	US_CALLOC(run, 1);
 	run->fd = -1;
+	assert((run->release_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0);
+	atomic_init(&run->release_seq, 0);
 
 	us_capture_s *cap;
 	US_CALLOC(cap, 1);
@@ -141,6 +146,7 @@ us_capture_s *us_capture_init(void) {
 }
 
 void us_capture_destroy(us_capture_s *cap) {
+	US_CLOSE_FD(cap->run->release_fd);
 	free(cap->run);
 	free(cap);
 }
@@ -426,6 +432,8 @@ int us_capture_hwbuf_grab(us_capture_s *cap, us_capture_hwbuf_s **hw) {
 
 	// 更新捕获的缓冲区指针
 	*hw = &run->bufs[buf.index];
+	(*hw)->run = run;
+	atomic_store(&(*hw)->releasable, false);
 	atomic_store(&(*hw)->refs, 0);
 	(*hw)->raw.dma_fd = (*hw)->dma_fd;
 	(*hw)->raw.used = buf.bytesused;
@@ -436,6 +444,8 @@ int us_capture_hwbuf_grab(us_capture_s *cap, us_capture_hwbuf_s **hw) {
 	(*hw)->raw.online = true;
 	_v4l2_buffer_copy(&buf, &(*hw)->buf);
 	(*hw)->raw.grab_ts = (ldf)((buf.timestamp.tv_sec * (u64)1000) + (buf.timestamp.tv_usec / 1000)) / 1000;
+	(*hw)->dequeue_ts = us_get_now_monotonic();
+	us_tracer_span("grab", us_tracer_get_id((*hw)->raw.grab_ts), (*hw)->raw.grab_ts, (*hw)->dequeue_ts);
 
 	_LOG_DEBUG("Grabbed HW buffer=%u: bytesused=%u, grab_ts=%.3Lf, latency=%.3Lf, skipped=%u",
 		buf.index, buf.bytesused, (*hw)->raw.grab_ts, us_get_now_monotonic() - (*hw)->raw.grab_ts, skipped);
@@ -460,7 +470,52 @@ void us_capture_hwbuf_incref(us_capture_hwbuf_s *hw) {
 }
 
 void us_capture_hwbuf_decref(us_capture_hwbuf_s *hw) {
-	atomic_fetch_sub(&hw->refs, 1);
+	const int refs = atomic_fetch_sub(&hw->refs, 1);
+	assert(refs > 0);
+	if (refs == 1) {
+		// The last reference: wakes up us_capture_hwbuf_release_ready()
+		us_capture_runtime_s *const run = hw->run;
+		hw->release_seq = atomic_fetch_add(&run->release_seq, 1);
+		atomic_store(&hw->releasable, true);
+		assert(!eventfd_write(run->release_fd, 1));
+	}
+}
+
+int us_capture_hwbuf_release_ready(const us_capture_s *cap, ldf timeout) {
+	us_capture_runtime_s *const run = cap->run;
+
+	struct pollfd pfd = {.fd = run->release_fd, .events = POLLIN};
+	const int retval = poll(&pfd, 1, timeout * 1000);
+	if (retval < 0 && errno != EINTR) {
+		_LOG_PERROR("Can't wait for the releasable HW buffers");
+		return -1;
+	} else if (retval <= 0) {
+		return 0; // Timed out
+	}
+	eventfd_t value;
+	(void)eventfd_read(run->release_fd, &value);
+
+	// The buffers are queued back in the order in which they have become free
+	us_capture_hwbuf_s *ready[VIDEO_MAX_FRAME];
+	uint n_ready = 0;
+	for (uint index = 0; index < run->n_bufs && n_ready < VIDEO_MAX_FRAME; ++index) {
+		us_capture_hwbuf_s *const hw = &run->bufs[index];
+		if (!atomic_load(&hw->releasable)) {
+			continue;
+		}
+		uint place = n_ready++;
+		for (; place > 0 && ready[place - 1]->release_seq > hw->release_seq; --place) {
+			ready[place] = ready[place - 1];
+		}
+		ready[place] = hw;
+	}
+	for (uint index = 0; index < n_ready; ++index) {
+		atomic_store(&ready[index]->releasable, false);
+		if (us_capture_hwbuf_release(cap, ready[index]) < 0) {
+			return -1;
+		}
+	}
+	return 0;
 }
 // 添加注释以解释_capture_wait_buffer函数的功能
 int _capture_wait_buffer(us_capture_s *cap) {
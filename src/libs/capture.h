@@ -49,9 +49,15 @@ typedef struct {
 	int					dma_fd;
 	bool				grabbed;
 	atomic_int			refs;
+	ldf					dequeue_ts; // For the tracer
+
+	// Set by the last us_capture_hwbuf_decref(), see us_capture_hwbuf_release_ready()
+	struct us_capture_runtime_sx	*run;
+	atomic_bool						releasable;
+	u64								release_seq;
 } us_capture_hwbuf_s;
 
-typedef struct {
+typedef struct us_capture_runtime_sx {
 	int					fd;
 	uint				width;
 	uint				height;
@@ -68,6 +74,9 @@ typedef struct {
 	bool				capture_mplane;
 	bool				streamon;
 	int					open_error_once;
+
+	int					release_fd; // Eventfd, signaled when a buffer becomes releasable
+	atomic_ullong		release_seq; // Keeps the order in which the buffers become free
 } us_capture_runtime_s;
 
 typedef enum {
@@ -134,6 +143,7 @@ void us_capture_close(us_capture_s *cap);
 
 int us_capture_hwbuf_grab(us_capture_s *cap, us_capture_hwbuf_s **hw);
 int us_capture_hwbuf_release(const us_capture_s *cap, us_capture_hwbuf_s *hw);
+int us_capture_hwbuf_release_ready(const us_capture_s *cap, ldf timeout);
 
 void us_capture_hwbuf_incref(us_capture_hwbuf_s *hw);
 void us_capture_hwbuf_decref(us_capture_hwbuf_s *hw);
@@ -24,32 +24,164 @@
 
 #include <stddef.h>
 #include <stdlib.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <assert.h>
 
+#include <sys/mman.h>
+
+#include <pthread.h>
+#ifdef __GLIBC__
+#	include <malloc.h>
+#endif
 #include <linux/videodev2.h>
 
 #include "types.h"
 #include "tools.h"
+#include "threading.h"
+
+
+// The frame data is allocated in the power-of-two size classes.
+// The released buffers are cached per thread and then globally,
+// so the steady-state streaming doesn't touch malloc() at all.
+#define _MIN_CLASS_SHIFT	12 // 4 KiB
+#define _MAX_CLASS_SHIFT	26 // 64 MiB, the larger buffers are not cached
+#define _N_CLASSES			(_MAX_CLASS_SHIFT - _MIN_CLASS_SHIFT + 1)
+#define _MAP_CLASS_SHIFT	21 // 2 MiB, the huge page size: the buffers from it are mmap()ed
+#define _THREAD_CACHE_SIZE	2
+#define _GLOBAL_CACHE_BYTES	(4 * 1024 * 1024) // Per class, but at least one buffer
+
+
+typedef struct {
+	u8		*bufs[_N_CLASSES][_THREAD_CACHE_SIZE];
+	uint	n_bufs[_N_CLASSES];
+} _thread_cache_s;
+
+
+static atomic_bool		_g_huge_pages = false;
+static atomic_bool		_g_low_memory = false;
+
+static pthread_once_t	_g_once = PTHREAD_ONCE_INIT;
+static pthread_key_t	_g_key;
+
+static pthread_mutex_t	_g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static u8				*_g_free[_N_CLASSES]; // Linked through the first bytes of the buffers
+static uint				_g_n_free[_N_CLASSES];
+
+static atomic_ullong	_g_allocated = 0;
+static atomic_ullong	_g_allocated_peak = 0;
+static atomic_ullong	_g_used = 0;
+static atomic_ullong	_g_used_peak = 0;
+static atomic_ullong	_g_sys_allocs = 0;
+static atomic_ullong	_g_cache_hits = 0;
+
+
+static u8 *_buf_alloc(uz size, uz *allocated);
+static void _buf_free(u8 *buf, uz size);
+static void _buf_release(u8 *buf, uint shift);
+static u8 *_sys_alloc(uz size);
+static void _sys_free(u8 *buf, uz size);
+static _thread_cache_s *_get_thread_cache(void);
+static void _init_key(void);
+static void _release_thread_cache(void *v_cache);
+static uint _get_class_shift(uz size);
+static uint _get_global_cache_size(uint shift);
+static void _update_peak(atomic_ullong *peak, ull value);
+static uint _get_bytes_per_pixel(uint format);
 
 
+void us_frame_set_huge_pages(bool enabled) {
+	atomic_store(&_g_huge_pages, enabled);
+}
+
+void us_frame_set_low_memory(bool enabled) {
+	atomic_store(&_g_low_memory, enabled);
+}
+
+void us_frame_trim(void) {
+	// Returns the cached buffers of the calling thread and the global ones to the system.
+	// The caches of the other threads are small and are kept as is.
+	_thread_cache_s *const cache = _get_thread_cache();
+	for (uint cls = 0; cls < _N_CLASSES; ++cls) {
+		while (cache->n_bufs[cls] > 0) {
+			--cache->n_bufs[cls];
+			_sys_free(cache->bufs[cls][cache->n_bufs[cls]], (uz)1 << (cls + _MIN_CLASS_SHIFT));
+		}
+		US_MUTEX_LOCK(_g_mutex);
+		u8 *buf = _g_free[cls];
+		_g_free[cls] = NULL;
+		_g_n_free[cls] = 0;
+		US_MUTEX_UNLOCK(_g_mutex);
+		while (buf != NULL) {
+			u8 *next;
+			memcpy(&next, buf, sizeof(u8*));
+			_sys_free(buf, (uz)1 << (cls + _MIN_CLASS_SHIFT));
+			buf = next;
+		}
+	}
+#	ifdef __GLIBC__
+	malloc_trim(0);
+#	endif
+}
+
+void us_frame_get_stats(us_frame_stats_s *stats) {
+	stats->allocated = atomic_load(&_g_allocated);
+	stats->allocated_peak = atomic_load(&_g_allocated_peak);
+	stats->used = atomic_load(&_g_used);
+	stats->used_peak = atomic_load(&_g_used_peak);
+	stats->sys_allocs = atomic_load(&_g_sys_allocs);
+	stats->cache_hits = atomic_load(&_g_cache_hits);
+}
+
 us_frame_s *us_frame_init(void) {
 	us_frame_s *frame;
 	US_CALLOC(frame, 1);
-	us_frame_realloc_data(frame, 512 * 1024);
+	if (!atomic_load(&_g_low_memory)) {
+		// In the low memory mode the data grows to the observed peak on demand
+		us_frame_realloc_data(frame, 512 * 1024);
+	}
 	frame->dma_fd = -1;
 	return frame;
 }
 
 void us_frame_destroy(us_frame_s *frame) {
-	US_DELETE(frame->data, free);
+	if (frame->data != NULL) {
+		_buf_free(frame->data, frame->allocated);
+	}
 	free(frame);
 }
 
 void us_frame_realloc_data(us_frame_s *frame, uz size) {
 	if (frame->allocated < size) {
-		US_REALLOC(frame->data, size);
-		frame->allocated = size;
+		uz allocated;
+		u8 *const data = _buf_alloc(size, &allocated);
+		if (frame->data != NULL) {
+			// Like realloc(), the whole old buffer is kept: the callers may have
+			// written past the used size before growing it.
+			memcpy(data, frame->data, frame->allocated);
+			_buf_free(frame->data, frame->allocated);
+		}
+		frame->data = data;
+		frame->allocated = allocated;
+	}
+}
+
+void us_frame_shrink_data(us_frame_s *frame) {
+	// Moves the data to the smallest class that fits it
+	if (frame->data == NULL) {
+		return;
+	}
+	if (frame->used == 0) {
+		_buf_free(frame->data, frame->allocated);
+		frame->data = NULL;
+		frame->allocated = 0;
+	} else if (((uz)1 << _get_class_shift(frame->used)) < frame->allocated) {
+		uz allocated;
+		u8 *const data = _buf_alloc(frame->used, &allocated);
+		memcpy(data, frame->data, frame->used);
+		_buf_free(frame->data, frame->allocated);
+		frame->data = data;
+		frame->allocated = allocated;
 	}
 }
 
@@ -80,25 +212,18 @@ bool us_frame_compare(const us_frame_s *a, const us_frame_s *b) {
 }
 
 uint us_frame_get_padding(const us_frame_s *frame) {
-	uint bytes_per_pixel = 0;
-	switch (frame->format) {
-		case V4L2_PIX_FMT_YUYV:
-		case V4L2_PIX_FMT_YVYU:
-		case V4L2_PIX_FMT_UYVY:
-		case V4L2_PIX_FMT_RGB565: bytes_per_pixel = 2; break;
-		case V4L2_PIX_FMT_BGR24:
-		case V4L2_PIX_FMT_RGB24: bytes_per_pixel = 3; break;
-		// case V4L2_PIX_FMT_H264:
-		case V4L2_PIX_FMT_MJPEG:
-		case V4L2_PIX_FMT_JPEG: bytes_per_pixel = 0; break;
-		default: assert(0 && "Unknown format");
-	}
+	const uint bytes_per_pixel = _get_bytes_per_pixel(frame->format);
 	if (bytes_per_pixel > 0 && frame->stride > frame->width) {
 		return (frame->stride - frame->width * bytes_per_pixel);
 	}
 	return 0;
 }
 
+uz us_frame_get_line_size(const us_frame_s *frame) {
+	// Including the padding, i.e. the distance between the lines
+	return (uz)frame->width * _get_bytes_per_pixel(frame->format) + us_frame_get_padding(frame);
+}
+
 bool us_is_jpeg(uint format) {
 	return (format == V4L2_PIX_FMT_JPEG || format == V4L2_PIX_FMT_MJPEG);
 }
@@ -119,3 +244,171 @@ const char *us_fourcc_to_string(uint format, char *buf, uz size) {
 	}
 	return buf;
 }
+
+static u8 *_buf_alloc(uz size, uz *allocated) {
+	const uint shift = _get_class_shift(size);
+	*allocated = (uz)1 << shift;
+
+	u8 *buf = NULL;
+	if (shift <= _MAX_CLASS_SHIFT) {
+		const uint cls = shift - _MIN_CLASS_SHIFT;
+		_thread_cache_s *const cache = _get_thread_cache();
+		if (cache->n_bufs[cls] > 0) {
+			--cache->n_bufs[cls];
+			buf = cache->bufs[cls][cache->n_bufs[cls]];
+		} else {
+			US_MUTEX_LOCK(_g_mutex);
+			if (_g_free[cls] != NULL) {
+				buf = _g_free[cls];
+				memcpy(&_g_free[cls], buf, sizeof(u8*));
+				--_g_n_free[cls];
+			}
+			US_MUTEX_UNLOCK(_g_mutex);
+		}
+	}
+
+	if (buf != NULL) {
+		atomic_fetch_add(&_g_cache_hits, 1);
+	} else {
+		buf = _sys_alloc(*allocated);
+	}
+	_update_peak(&_g_used_peak, atomic_fetch_add(&_g_used, *allocated) + *allocated);
+	return buf;
+}
+
+static void _buf_free(u8 *buf, uz size) {
+	const uint shift = _get_class_shift(size);
+	assert(size == (uz)1 << shift);
+	atomic_fetch_sub(&_g_used, size);
+
+	if (shift <= _MAX_CLASS_SHIFT) {
+		const uint cls = shift - _MIN_CLASS_SHIFT;
+		_thread_cache_s *const cache = _get_thread_cache();
+		if (cache->n_bufs[cls] < (atomic_load(&_g_low_memory) ? 1 : _THREAD_CACHE_SIZE)) {
+			cache->bufs[cls][cache->n_bufs[cls]] = buf;
+			++cache->n_bufs[cls];
+			return;
+		}
+	}
+	_buf_release(buf, shift);
+}
+
+static void _buf_release(u8 *buf, uint shift) {
+	// Moves the buffer to the global cache or back to the system
+	if (shift <= _MAX_CLASS_SHIFT) {
+		const uint cls = shift - _MIN_CLASS_SHIFT;
+		bool cached = false;
+		US_MUTEX_LOCK(_g_mutex);
+		if (_g_n_free[cls] < _get_global_cache_size(shift)) {
+			memcpy(buf, &_g_free[cls], sizeof(u8*));
+			_g_free[cls] = buf;
+			++_g_n_free[cls];
+			cached = true;
+		}
+		US_MUTEX_UNLOCK(_g_mutex);
+		if (cached) {
+			return;
+		}
+	}
+	_sys_free(buf, (uz)1 << shift);
+}
+
+static u8 *_sys_alloc(uz size) {
+	void *buf;
+	if (size < ((uz)1 << _MAP_CLASS_SHIFT)) {
+		assert((buf = malloc(size)) != NULL);
+	} else {
+		const bool huge = atomic_load(&_g_huge_pages);
+		buf = MAP_FAILED;
+#		ifdef MAP_HUGETLB
+		if (huge) {
+			// Requires the reserved pages in /proc/sys/vm/nr_hugepages
+			buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		}
+#		endif
+		if (buf == MAP_FAILED) {
+			assert((buf = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) != MAP_FAILED);
+#			ifdef MADV_HUGEPAGE
+			if (huge) {
+				// Fallback to the transparent huge pages, it's just a hint
+				madvise(buf, size, MADV_HUGEPAGE);
+			}
+#			endif
+		}
+	}
+	atomic_fetch_add(&_g_sys_allocs, 1);
+	_update_peak(&_g_allocated_peak, atomic_fetch_add(&_g_allocated, size) + size);
+	return buf;
+}
+
+static void _sys_free(u8 *buf, uz size) {
+	if (size < ((uz)1 << _MAP_CLASS_SHIFT)) {
+		free(buf);
+	} else {
+		assert(!munmap(buf, size));
+	}
+	atomic_fetch_sub(&_g_allocated, size);
+}
+
+static _thread_cache_s *_get_thread_cache(void) {
+	assert(!pthread_once(&_g_once, _init_key));
+	_thread_cache_s *cache = pthread_getspecific(_g_key);
+	if (cache == NULL) {
+		US_CALLOC(cache, 1);
+		assert(!pthread_setspecific(_g_key, cache));
+	}
+	return cache;
+}
+
+static void _init_key(void) {
+	assert(!pthread_key_create(&_g_key, _release_thread_cache));
+}
+
+static void _release_thread_cache(void *v_cache) {
+	// Called on the thread exit
+	_thread_cache_s *const cache = v_cache;
+	for (uint cls = 0; cls < _N_CLASSES; ++cls) {
+		while (cache->n_bufs[cls] > 0) {
+			--cache->n_bufs[cls];
+			_buf_release(cache->bufs[cls][cache->n_bufs[cls]], cls + _MIN_CLASS_SHIFT);
+		}
+	}
+	free(cache);
+}
+
+static uint _get_class_shift(uz size) {
+	uint shift = _MIN_CLASS_SHIFT;
+	while (((uz)1 << shift) < size) {
+		++shift;
+	}
+	return shift;
+}
+
+static uint _get_global_cache_size(uint shift) {
+	if (atomic_load(&_g_low_memory)) {
+		return 1;
+	}
+	return US_MAX((uint)(_GLOBAL_CACHE_BYTES >> shift), (uint)1);
+}
+
+static void _update_peak(atomic_ullong *peak, ull value) {
+	ull prev = atomic_load(peak);
+	while (prev < value && !atomic_compare_exchange_weak(peak, &prev, value));
+}
+
+static uint _get_bytes_per_pixel(uint format) {
+	uint bytes_per_pixel = 0;
+	switch (format) {
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		case V4L2_PIX_FMT_UYVY:
+		case V4L2_PIX_FMT_RGB565: bytes_per_pixel = 2; break;
+		case V4L2_PIX_FMT_BGR24:
+		case V4L2_PIX_FMT_RGB24: bytes_per_pixel = 3; break;
+		// case V4L2_PIX_FMT_H264:
+		case V4L2_PIX_FMT_MJPEG:
+		case V4L2_PIX_FMT_JPEG: bytes_per_pixel = 0; break;
+		default: assert(0 && "Unknown format");
+	}
+	return bytes_per_pixel;
+}
@@ -22,6 +22,8 @@
 
 #pragma once
 
+#include <stdatomic.h>
+
 #include "types.h"
 #include "tools.h"
 
@@ -49,9 +51,22 @@ typedef struct {
 	uz		allocated;
 	int		dma_fd;
 
+	// For the shared frames only, see framepool.h
+	struct us_frame_pool_sx	*pool;
+	atomic_uint				refs;
+
 	US_FRAME_META_DECLARE;
 } us_frame_s;
 
+typedef struct {
+	uz	allocated; // The data taken from the system, including the cached buffers
+	uz	allocated_peak;
+	uz	used; // The data held by the frames
+	uz	used_peak;
+	u64	sys_allocs;
+	u64	cache_hits;
+} us_frame_stats_s;
+
 
 #define US_FRAME_COPY_META(x_src, x_dest) { \
 		(x_dest)->width = (x_src)->width; \
@@ -96,10 +111,16 @@ static inline void us_frame_encoding_end(us_frame_s *dest) {
 }
 
 
+void us_frame_set_huge_pages(bool enabled);
+void us_frame_set_low_memory(bool enabled);
+void us_frame_trim(void);
+void us_frame_get_stats(us_frame_stats_s *stats);
+
 us_frame_s *us_frame_init(void);
 void us_frame_destroy(us_frame_s *frame);
 
 void us_frame_realloc_data(us_frame_s *frame, uz size);
+void us_frame_shrink_data(us_frame_s *frame);
 void us_frame_set_data(us_frame_s *frame, const u8 *data, uz size);
 void us_frame_append_data(us_frame_s *frame, const u8 *data, uz size);
 
@@ -107,6 +128,7 @@ void us_frame_copy(const us_frame_s *src, us_frame_s *dest);
 bool us_frame_compare(const us_frame_s *a, const us_frame_s *b);
 
 uint us_frame_get_padding(const us_frame_s *frame);
+uz us_frame_get_line_size(const us_frame_s *frame);
 
 bool us_is_jpeg(uint format);
 const char *us_fourcc_to_string(uint format, char *buf, uz size);
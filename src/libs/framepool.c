@@ -0,0 +1,129 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "framepool.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include "types.h"
+#include "tools.h"
+#include "threading.h"
+#include "frame.h"
+
+
+static void _pool_unref(us_frame_pool_s *pool);
+
+
+us_frame_pool_s *us_frame_pool_init(uint capacity) {
+	us_frame_pool_s *pool;
+	US_CALLOC(pool, 1);
+	US_MUTEX_INIT(pool->mutex);
+	US_CALLOC(pool->free, capacity);
+	pool->capacity = capacity;
+	atomic_init(&pool->refs, 1);
+	return pool;
+}
+
+void us_frame_pool_destroy(us_frame_pool_s *pool) {
+	// The pool is freed after the last frame in use is returned
+	_pool_unref(pool);
+}
+
+void us_frame_pool_trim(us_frame_pool_s *pool) {
+	// Destroys the free frames, the frames in use are kept
+	US_MUTEX_LOCK(pool->mutex);
+	for (uint index = 0; index < pool->n_free; ++index) {
+		us_frame_destroy(pool->free[index]);
+	}
+	pool->n_free = 0;
+	US_MUTEX_UNLOCK(pool->mutex);
+}
+
+void us_frame_pool_get_stats(us_frame_pool_s *pool, uint *in_use, uint *n_free) {
+	US_MUTEX_LOCK(pool->mutex);
+	*n_free = pool->n_free;
+	US_MUTEX_UNLOCK(pool->mutex);
+	*in_use = atomic_load(&pool->refs) - 1; // Minus the owner
+}
+
+us_frame_s *us_frame_pool_get(us_frame_pool_s *pool) {
+	us_frame_s *frame = NULL;
+	US_MUTEX_LOCK(pool->mutex);
+	if (pool->n_free > 0) {
+		--pool->n_free;
+		frame = pool->free[pool->n_free];
+	}
+	US_MUTEX_UNLOCK(pool->mutex);
+
+	if (frame == NULL) {
+		frame = us_frame_init();
+		frame->pool = pool;
+	}
+	frame->used = 0;
+	atomic_store(&frame->refs, 1);
+	atomic_fetch_add(&pool->refs, 1);
+	return frame;
+}
+
+us_frame_s *us_frame_ref(us_frame_s *frame) {
+	assert(frame->pool != NULL);
+	atomic_fetch_add(&frame->refs, 1);
+	return frame;
+}
+
+void us_frame_unref(us_frame_s *frame) {
+	assert(frame->pool != NULL);
+	if (atomic_fetch_sub(&frame->refs, 1) != 1) {
+		return;
+	}
+
+	us_frame_pool_s *const pool = frame->pool;
+	bool recycled = false;
+	US_MUTEX_LOCK(pool->mutex);
+	if (pool->n_free < pool->capacity) {
+		pool->free[pool->n_free] = frame;
+		++pool->n_free;
+		recycled = true;
+	}
+	US_MUTEX_UNLOCK(pool->mutex);
+	if (!recycled) {
+		us_frame_destroy(frame);
+	}
+	_pool_unref(pool);
+}
+
+static void _pool_unref(us_frame_pool_s *pool) {
+	if (atomic_fetch_sub(&pool->refs, 1) != 1) {
+		return;
+	}
+	for (uint index = 0; index < pool->n_free; ++index) {
+		us_frame_destroy(pool->free[index]);
+	}
+	free(pool->free);
+	US_MUTEX_DESTROY(pool->mutex);
+	free(pool);
+}
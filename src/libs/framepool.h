@@ -0,0 +1,54 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include <stdatomic.h>
+
+#include <pthread.h>
+
+#include "types.h"
+#include "frame.h"
+
+
+// The frames from the pool are shared by reference between the stream,
+// the HTTP server and the sinks instead of being copied on every handoff.
+// The last us_frame_unref() returns the frame to the pool.
+typedef struct us_frame_pool_sx {
+	pthread_mutex_t	mutex;
+	us_frame_s		**free;
+	uint			n_free;
+	uint			capacity; // The maximum number of the free frames to keep
+	atomic_uint		refs; // One for the owner and one for each frame in use
+} us_frame_pool_s;
+
+
+us_frame_pool_s *us_frame_pool_init(uint capacity);
+void us_frame_pool_destroy(us_frame_pool_s *pool);
+void us_frame_pool_trim(us_frame_pool_s *pool);
+void us_frame_pool_get_stats(us_frame_pool_s *pool, uint *in_use, uint *n_free);
+
+us_frame_s *us_frame_pool_get(us_frame_pool_s *pool);
+
+us_frame_s *us_frame_ref(us_frame_s *frame);
+void us_frame_unref(us_frame_s *frame);
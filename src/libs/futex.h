@@ -0,0 +1,52 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include <stdatomic.h>
+#include <limits.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "types.h"
+#include "tools.h"
+
+
+INLINE int us_futex_wait(atomic_uint *addr, uint value, ldf timeout) {
+	// Returns 0 on wakeup or value mismatch and -1 on timeout,
+	// the caller should check its condition in any case.
+	struct timespec ts;
+	us_ld_to_timespec(timeout, &ts);
+	if (syscall(SYS_futex, (uint*)addr, FUTEX_WAIT_PRIVATE, value, &ts, NULL, 0) < 0) {
+		return (errno == ETIMEDOUT ? -1 : 0);
+	}
+	return 0;
+}
+
+INLINE void us_futex_wake(atomic_uint *addr) {
+	syscall(SYS_futex, (uint*)addr, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
@@ -20,15 +20,299 @@
 *****************************************************************************/
 
 
+
 #include "logging.h"
 
+#include <stdarg.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <signal.h>
+
+#include <sys/eventfd.h>
 
 #include <pthread.h>
 
+#include "array.h"
+
+
+#define _RING_SIZE		64 // Records per thread
+#define _RECORD_SIZE	512 // Longer messages are truncated
+
+enum {
+	_RING_BUSY = 0, // Owned by a living thread
+	_RING_ORPHAN, // The thread has finished, the writer drains the rest
+	_RING_FREE, // Can be reused by a new thread
+};
+
+typedef struct _ring_sx {
+	char			records[_RING_SIZE][_RECORD_SIZE];
+	u64				seqs[_RING_SIZE]; // For the global order of the records
+	atomic_uint		head; // Changed by the owner thread only
+	atomic_uint		tail; // Changed under the logging lock only
+	atomic_ullong	dropped;
+	atomic_int		state;
+	struct _ring_sx	*next;
+} _ring_s;
+
 
 enum us_log_level_t us_g_log_level;
 
 bool us_g_log_colored;
 
 pthread_mutex_t us_g_log_mutex;
+
+atomic_bool us_g_log_async = false;
+
+static pthread_once_t	_g_once = PTHREAD_ONCE_INIT;
+static pthread_key_t	_g_key;
+static _Atomic(_ring_s*)	_g_rings = NULL; // Never freed, the list is only prepended
+static atomic_ullong	_g_seq = 0;
+static atomic_bool		_g_pending = false; // The writer has been woken up
+static atomic_bool		_g_stop = false;
+static int				_g_fd = -1;
+static pthread_t		_g_tid;
+
+static const int _FATAL_SIGNALS[] = {SIGABRT, SIGSEGV, SIGBUS, SIGFPE, SIGILL};
+static struct sigaction _g_fatal_prev[US_ARRAY_LEN(_FATAL_SIGNALS)];
+
+
+static void *_writer_thread(void *arg);
+static bool _drain(void);
+static bool _drain_nolock(void);
+static void _release_orphans(void);
+static void _wakeup(void);
+
+static void _install_fatal_handler(void);
+static void _restore_fatal_handler(void);
+static void _fatal_handler(int signum);
+static void _exit_handler(void);
+
+static void _init_key(void);
+static void _release_ring(void *v_ring);
+static _ring_s *_get_ring(void);
+
+
+void us_log_async_start(void) {
+	assert(!atomic_load(&us_g_log_async));
+	assert((_g_fd = eventfd(0, EFD_CLOEXEC)) >= 0);
+	atomic_store(&_g_stop, false);
+	US_THREAD_CREATE(_g_tid, _writer_thread, NULL);
+	atomic_store(&us_g_log_async, true);
+
+	// The queued records are written on the abnormal termination as well
+	_install_fatal_handler();
+	static atomic_bool exit_handler_registered = false;
+	if (!atomic_exchange(&exit_handler_registered, true)) {
+		assert(!atexit(_exit_handler));
+	}
+}
+
+void us_log_async_stop(void) {
+	if (!atomic_load(&us_g_log_async)) {
+		return;
+	}
+	// All the other threads should be stopped at this point,
+	// the writer drains the rings before exiting.
+	_restore_fatal_handler();
+	atomic_store(&us_g_log_async, false);
+	atomic_store(&_g_stop, true);
+	assert(!eventfd_write(_g_fd, 1));
+	US_THREAD_JOIN(_g_tid);
+	US_CLOSE_FD(_g_fd);
+}
+
+bool us_log_async_printf(const char *fmt, ...) {
+	if (!atomic_load_explicit(&us_g_log_async, memory_order_relaxed)) {
+		return false;
+	}
+	_ring_s *const ring = _get_ring();
+	const uint head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= _RING_SIZE) {
+		// The writer is late, so the message is dropped instead of blocking the thread
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		_wakeup();
+		return true;
+	}
+
+	const uint index = head % _RING_SIZE;
+	va_list args;
+	va_start(args, fmt);
+	if (vsnprintf(ring->records[index], _RECORD_SIZE, fmt, args) >= _RECORD_SIZE) {
+		strcpy(ring->records[index] + _RECORD_SIZE - 4, "...");
+	}
+	va_end(args);
+	ring->seqs[index] = atomic_fetch_add_explicit(&_g_seq, 1, memory_order_relaxed);
+	atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+	_wakeup();
+	return true;
+}
+
+static void *_writer_thread(void *arg) {
+	(void)arg;
+	US_THREAD_SETTLE("log");
+	while (true) {
+		eventfd_t value;
+		if (eventfd_read(_g_fd, &value) < 0 && errno != EINTR) {
+			break;
+		}
+		atomic_store(&_g_pending, false);
+		while (_drain());
+		if (atomic_load(&_g_stop)) {
+			break;
+		}
+	}
+	// The last records which may be written after the wakeup
+	while (_drain());
+	return NULL;
+}
+
+void us_log_async_flush_nolock(void) {
+	// Any thread can write out the queued records under the logging lock,
+	// the tails are changed only under it.
+	if (atomic_load_explicit(&us_g_log_async, memory_order_relaxed)) {
+		while (_drain_nolock());
+		_release_orphans();
+	}
+}
+
+static bool _drain(void) {
+	US_LOGGING_LOCK;
+	const bool written = _drain_nolock();
+	US_LOGGING_UNLOCK;
+	_release_orphans();
+	return written;
+}
+
+static bool _drain_nolock(void) {
+	// Returns true if something has been written
+	bool written = false;
+
+	for (_ring_s *ring = atomic_load(&_g_rings); ring != NULL; ring = ring->next) {
+		const ull dropped = atomic_exchange_explicit(&ring->dropped, 0, memory_order_relaxed);
+		if (dropped > 0) {
+			US_LOG_FORMAT(US_LOG_FPRINTF, US_COLOR_YELLOW, "WARN ", US_COLOR_YELLOW,
+				"Dropped %llu log messages, the writer is too slow", dropped);
+			fputc('\n', stderr);
+			written = true;
+		}
+	}
+
+	while (true) {
+		// The records of the different threads are merged by the global order
+		_ring_s *next = NULL;
+		u64 next_seq = 0;
+		for (_ring_s *ring = atomic_load(&_g_rings); ring != NULL; ring = ring->next) {
+			const uint tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+			if (tail == atomic_load_explicit(&ring->head, memory_order_acquire)) {
+				continue;
+			}
+			const u64 seq = ring->seqs[tail % _RING_SIZE];
+			if (next == NULL || seq < next_seq) {
+				next = ring;
+				next_seq = seq;
+			}
+		}
+		if (next == NULL) {
+			break;
+		}
+		const uint tail = atomic_load_explicit(&next->tail, memory_order_relaxed);
+		fputs(next->records[tail % _RING_SIZE], stderr);
+		fputc('\n', stderr);
+		atomic_store_explicit(&next->tail, tail + 1, memory_order_release);
+		written = true;
+	}
+
+	if (written) {
+		fflush(stderr);
+	}
+	return written;
+}
+
+static void _release_orphans(void) {
+	for (_ring_s *ring = atomic_load(&_g_rings); ring != NULL; ring = ring->next) {
+		int state = _RING_ORPHAN;
+		if (
+			atomic_load(&ring->tail) == atomic_load(&ring->head)
+			&& atomic_load(&ring->dropped) == 0
+		) {
+			atomic_compare_exchange_strong(&ring->state, &state, _RING_FREE);
+		}
+	}
+}
+
+static void _wakeup(void) {
+	if (!atomic_exchange(&_g_pending, true)) {
+		assert(!eventfd_write(_g_fd, 1));
+	}
+}
+
+static void _install_fatal_handler(void) {
+	struct sigaction sig_act = {0};
+	assert(!sigemptyset(&sig_act.sa_mask));
+	sig_act.sa_handler = _fatal_handler;
+	sig_act.sa_flags = SA_RESETHAND | SA_NODEFER;
+	for (uint index = 0; index < US_ARRAY_LEN(_FATAL_SIGNALS); ++index) {
+		assert(!sigaction(_FATAL_SIGNALS[index], &sig_act, &_g_fatal_prev[index]));
+	}
+}
+
+static void _restore_fatal_handler(void) {
+	for (uint index = 0; index < US_ARRAY_LEN(_FATAL_SIGNALS); ++index) {
+		assert(!sigaction(_FATAL_SIGNALS[index], &_g_fatal_prev[index], NULL));
+	}
+}
+
+static void _fatal_handler(int signum) {
+	// Not async-signal-safe, but the process is dying anyway and the records
+	// are the only trace of what has happened. The lock could be held
+	// by the crashed thread, so the rings are drained without it then.
+	const bool locked = !pthread_mutex_trylock(&us_g_log_mutex);
+	us_log_async_flush_nolock();
+	if (locked) {
+		US_LOGGING_UNLOCK;
+	}
+	// SA_RESETHAND has restored the default action, so it's fatal now
+	raise(signum);
+}
+
+static void _exit_handler(void) {
+	// exit() with the running writer, the last records can be still in the rings
+	if (atomic_load(&us_g_log_async)) {
+		US_LOGGING_LOCK;
+		us_log_async_flush_nolock();
+		US_LOGGING_UNLOCK;
+	}
+}
+
+static void _init_key(void) {
+	assert(!pthread_key_create(&_g_key, _release_ring));
+}
+
+static void _release_ring(void *v_ring) {
+	_ring_s *const ring = v_ring;
+	atomic_store(&ring->state, _RING_ORPHAN);
+}
+
+static _ring_s *_get_ring(void) {
+	assert(!pthread_once(&_g_once, _init_key));
+	_ring_s *ring = pthread_getspecific(_g_key);
+	if (ring != NULL) {
+		return ring;
+	}
+
+	for (ring = atomic_load(&_g_rings); ring != NULL; ring = ring->next) {
+		int state = _RING_FREE;
+		if (atomic_compare_exchange_strong(&ring->state, &state, _RING_BUSY)) {
+			break; // Reusing the drained ring of a finished thread
+		}
+	}
+	if (ring == NULL) {
+		US_CALLOC(ring, 1);
+		atomic_init(&ring->state, _RING_BUSY);
+		ring->next = atomic_load(&_g_rings);
+		while (!atomic_compare_exchange_weak(&_g_rings, &ring->next, ring));
+	}
+
+	assert(!pthread_setspecific(_g_key, ring));
+	return ring;
+}
@@ -24,6 +24,8 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
@@ -51,6 +53,9 @@ extern bool us_g_log_colored;
 
 extern pthread_mutex_t us_g_log_mutex;
 
+// Set while the background writer is running, see us_log_async_start()
+extern atomic_bool us_g_log_async;
+
 
 #define US_LOGGING_INIT { \
 		us_g_log_level = US_LOG_LEVEL_INFO; \
@@ -58,7 +63,10 @@ extern pthread_mutex_t us_g_log_mutex;
 		US_MUTEX_INIT(us_g_log_mutex); \
 	}
 
-#define US_LOGGING_DESTROY	US_MUTEX_DESTROY(us_g_log_mutex)
+#define US_LOGGING_DESTROY { \
+		us_log_async_stop(); \
+		US_MUTEX_DESTROY(us_g_log_mutex); \
+	}
 
 #define US_LOGGING_LOCK		US_MUTEX_LOCK(us_g_log_mutex)
 #define US_LOGGING_UNLOCK	US_MUTEX_UNLOCK(us_g_log_mutex)
@@ -74,13 +82,16 @@ extern pthread_mutex_t us_g_log_mutex;
 
 
 #define US_SEP_INFO(x_ch) { \
-		US_LOGGING_LOCK; \
-		for (int m_count = 0; m_count < 80; ++m_count) { \
-			fputc((x_ch), stderr); \
+		char m_sep_buf[81]; \
+		memset(m_sep_buf, (x_ch), 80); \
+		m_sep_buf[80] = '\0'; \
+		if (!us_log_async_printf("%s", m_sep_buf)) { \
+			US_LOGGING_LOCK; \
+			fputs(m_sep_buf, stderr); \
+			fputc('\n', stderr); \
+			fflush(stderr); \
+			US_LOGGING_UNLOCK; \
 		} \
-		fputc('\n', stderr); \
-		fflush(stderr); \
-		US_LOGGING_UNLOCK; \
 	}
 
 #define US_SEP_DEBUG(x_ch) { \
@@ -90,29 +101,44 @@ extern pthread_mutex_t us_g_log_mutex;
 	}
 
 
-#define US_LOG_PRINTF_NOLOCK(x_label_color, x_label, x_msg_color, x_msg, ...) { \
+#define US_LOG_FORMAT(x_print, x_label_color, x_label, x_msg_color, x_msg, ...) { \
 		char m_tname_buf[US_THREAD_NAME_SIZE] = {0}; \
 		us_thread_get_name(m_tname_buf); \
 		if (us_g_log_colored) { \
-			fprintf(stderr, US_COLOR_GRAY "-- " x_label_color x_label US_COLOR_GRAY \
+			x_print(US_COLOR_GRAY "-- " x_label_color x_label US_COLOR_GRAY \
 				" [%.03Lf %9s]" " -- " US_COLOR_RESET x_msg_color x_msg US_COLOR_RESET, \
 				us_get_now_monotonic(), m_tname_buf, ##__VA_ARGS__); \
 		} else { \
-			fprintf(stderr, "-- " x_label " [%.03Lf %9s] -- " x_msg, \
+			x_print("-- " x_label " [%.03Lf %9s] -- " x_msg, \
 				us_get_now_monotonic(), m_tname_buf, ##__VA_ARGS__); \
 		} \
+	}
+
+#define US_LOG_FPRINTF(x_fmt, ...) fprintf(stderr, x_fmt, ##__VA_ARGS__)
+
+#define US_LOG_PRINTF_NOLOCK(x_label_color, x_label, x_msg_color, x_msg, ...) { \
+		US_LOG_FORMAT(US_LOG_FPRINTF, x_label_color, x_label, x_msg_color, x_msg, ##__VA_ARGS__); \
 		fputc('\n', stderr); \
 		fflush(stderr); \
 	}
 
 #define US_LOG_PRINTF(x_label_color, x_label, x_msg_color, x_msg, ...) { \
-		US_LOGGING_LOCK; \
-		US_LOG_PRINTF_NOLOCK(x_label_color, x_label, x_msg_color, x_msg, ##__VA_ARGS__); \
-		US_LOGGING_UNLOCK; \
+		if (atomic_load_explicit(&us_g_log_async, memory_order_relaxed)) { \
+			US_LOG_FORMAT(us_log_async_printf, x_label_color, x_label, x_msg_color, x_msg, ##__VA_ARGS__); \
+		} else { \
+			US_LOGGING_LOCK; \
+			US_LOG_PRINTF_NOLOCK(x_label_color, x_label, x_msg_color, x_msg, ##__VA_ARGS__); \
+			US_LOGGING_UNLOCK; \
+		} \
 	}
 
+// The errors are written synchronously after the queued records,
+// so the last message before a crash or an assert() is never lost.
 #define US_LOG_ERROR(x_msg, ...) { \
-		US_LOG_PRINTF(US_COLOR_RED, "ERROR", US_COLOR_RED, x_msg, ##__VA_ARGS__); \
+		US_LOGGING_LOCK; \
+		us_log_async_flush_nolock(); \
+		US_LOG_PRINTF_NOLOCK(US_COLOR_RED, "ERROR", US_COLOR_RED, x_msg, ##__VA_ARGS__); \
+		US_LOGGING_UNLOCK; \
 	}
 
 #define US_LOG_PERROR(x_msg, ...) { \
@@ -160,3 +186,9 @@ extern pthread_mutex_t us_g_log_mutex;
 			US_LOG_PRINTF(US_COLOR_GRAY, "DEBUG", US_COLOR_GRAY, x_msg, ##__VA_ARGS__); \
 		} \
 	}
+
+
+void us_log_async_start(void);
+void us_log_async_stop(void);
+bool us_log_async_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+void us_log_async_flush_nolock(void);
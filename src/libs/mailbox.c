@@ -0,0 +1,80 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "mailbox.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <assert.h>
+
+#include "types.h"
+#include "tools.h"
+#include "futex.h"
+
+
+us_mailbox_s *us_mailbox_init(void) {
+	us_mailbox_s *mailbox;
+	US_CALLOC(mailbox, 1);
+	atomic_init(&mailbox->item, NULL);
+	atomic_init(&mailbox->generation, 0);
+	atomic_init(&mailbox->waiters, 0);
+	return mailbox;
+}
+
+void us_mailbox_destroy(us_mailbox_s *mailbox) {
+	// The item must be taken before, see US_MAILBOX_DELETE_WITH_ITEM()
+	assert(atomic_load(&mailbox->item) == NULL);
+	free(mailbox);
+}
+
+void *us_mailbox_put(us_mailbox_s *mailbox, void *item) {
+	// Returns the displaced item which was not taken by the consumer, or NULL
+	void *const prev = atomic_exchange(&mailbox->item, item);
+	atomic_fetch_add(&mailbox->generation, 1);
+	if (atomic_load(&mailbox->waiters) > 0) {
+		us_futex_wake(&mailbox->generation);
+	}
+	return prev;
+}
+
+int us_mailbox_get(us_mailbox_s *mailbox, void **item, ldf timeout) {
+	const ldf deadline_ts = us_get_now_monotonic() + timeout;
+	while (true) {
+		if ((*item = atomic_exchange(&mailbox->item, NULL)) != NULL) {
+			return 0;
+		}
+
+		const ldf now_ts = us_get_now_monotonic();
+		if (now_ts >= deadline_ts) {
+			return -1;
+		}
+
+		atomic_fetch_add(&mailbox->waiters, 1);
+		const uint generation = atomic_load(&mailbox->generation);
+		if (atomic_load(&mailbox->item) == NULL) {
+			// The futex returns immediately if the generation has changed after the check
+			us_futex_wait(&mailbox->generation, generation, deadline_ts - now_ts);
+		}
+		atomic_fetch_sub(&mailbox->waiters, 1);
+	}
+}
@@ -0,0 +1,54 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include <stdatomic.h>
+
+#include "types.h"
+#include "tools.h"
+
+
+// A single slot for the latest item: a new one replaces the previous,
+// so a slow consumer never gets stale items.
+typedef struct {
+	_Atomic(void*)	item;
+	atomic_uint		generation; // Futex, incremented on every put
+	atomic_uint		waiters;
+} us_mailbox_s;
+
+
+#define US_MAILBOX_DELETE_WITH_ITEM(x_mailbox, x_destroy_item) { \
+		if (x_mailbox) { \
+			void *m_item = atomic_exchange(&(x_mailbox)->item, NULL); \
+			US_DELETE(m_item, x_destroy_item); \
+			us_mailbox_destroy(x_mailbox); \
+		} \
+	}
+
+
+us_mailbox_s *us_mailbox_init(void);
+void us_mailbox_destroy(us_mailbox_s *mailbox);
+
+void *us_mailbox_put(us_mailbox_s *mailbox, void *item);
+int us_mailbox_get(us_mailbox_s *mailbox, void **item, ldf timeout);
@@ -24,6 +24,7 @@
 
 #include <stdatomic.h>
 #include <string.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <assert.h>
@@ -37,6 +38,7 @@
 #include "tools.h"
 #include "logging.h"
 #include "frame.h"
+#include "tracer.h"
 #include "memsinksh.h"
 
 
@@ -54,6 +56,10 @@ us_memsink_s *us_memsink_init_opened(
 	sink->timeout = timeout;
 	sink->fd = -1;
 	atomic_init(&sink->has_clients, false);
+	atomic_init(&sink->stat_frames, 0);
+	atomic_init(&sink->stat_bytes, 0);
+	atomic_init(&sink->stat_busy, 0);
+	atomic_init(&sink->resident, 0);
 
 	US_LOG_INFO("Using %s-sink: %s", name, obj);
 
@@ -201,9 +207,18 @@ int us_memsink_server_put(us_memsink_s *sink, const us_frame_s *frame, bool *key
 		}
 		US_LOG_VERBOSE("%s-sink: Exposed new frame; full exposition time = %.3Lf",
 			sink->name, us_get_now_monotonic() - now);
+		atomic_fetch_add_explicit(&sink->stat_frames, 1, memory_order_relaxed);
+		atomic_fetch_add_explicit(&sink->stat_bytes, frame->used, memory_order_relaxed);
+		// The shared memory is sparse, only the written pages are resident
+		const ull resident = sizeof(us_memsink_shared_s) + frame->used;
+		if (atomic_load(&sink->resident) < resident) {
+			atomic_store(&sink->resident, resident);
+		}
+		us_tracer_span("memsink_put", us_tracer_get_id(frame->grab_ts), now, us_get_now_monotonic());
 
 	} else if (errno == EWOULDBLOCK) { // 如果内存区域正忙
 		US_LOG_VERBOSE("%s-sink: ===== Shared memory is busy now; frame skipped", sink->name);
+		atomic_fetch_add_explicit(&sink->stat_busy, 1, memory_order_relaxed);
 
 	} else { // 其他锁定错误
 		US_LOG_PERROR("%s-sink: Can't lock memory", sink->name);
@@ -212,6 +227,40 @@ int us_memsink_server_put(us_memsink_s *sink, const us_frame_s *frame, bool *key
 	return 0;
 }
 
+int us_memsink_server_trim(us_memsink_s *sink) {
+	// Returns the pages after the current frame to the system.
+	// The clients never read past the used size, so the hole is invisible for them.
+	assert(sink->server);
+
+	if (us_flock_timedwait_monotonic(sink->fd, 1) < 0) {
+		if (errno == EWOULDBLOCK) {
+			return 0; // Try the next time
+		}
+		US_LOG_PERROR("%s-sink: Can't lock memory", sink->name);
+		return -1;
+	}
+
+	int retval = 0;
+	const uz page_size = sysconf(_SC_PAGESIZE);
+	const uz total = sizeof(us_memsink_shared_s) + sink->data_size;
+	uz keep = sizeof(us_memsink_shared_s) + US_MIN(sink->mem->used, sink->data_size);
+	keep = US_MIN((keep + page_size - 1) / page_size * page_size, total);
+	if (keep < total) {
+		if (fallocate(sink->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, keep, total - keep) < 0) {
+			US_LOG_PERROR("%s-sink: Can't release the unused shared memory", sink->name);
+			retval = -1;
+		} else {
+			atomic_store(&sink->resident, keep);
+		}
+	}
+
+	if (flock(sink->fd, LOCK_UN) < 0) {
+		US_LOG_PERROR("%s-sink: Can't unlock memory", sink->name);
+		return -1;
+	}
+	return retval;
+}
+
 int us_memsink_client_get(us_memsink_s *sink, us_frame_s *frame, bool *key_requested, bool key_required) {
 	assert(!sink->server); // Client only
 
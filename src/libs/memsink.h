@@ -46,6 +46,11 @@ typedef struct {
 	u64			last_readed_id; // Only for client
 
 	atomic_bool	has_clients; // Only for server results
+	// Only for server, for the metrics
+	atomic_ullong	stat_frames;
+	atomic_ullong	stat_bytes;
+	atomic_ullong	stat_busy;
+	atomic_ullong	resident; // Only for server, the touched part of the shared memory
 	ldf			unsafe_last_client_ts; // Only for server
 } us_memsink_s;
 
@@ -58,5 +63,6 @@ void us_memsink_destroy(us_memsink_s *sink);
 
 bool us_memsink_server_check(us_memsink_s *sink, const us_frame_s *frame);
 int us_memsink_server_put(us_memsink_s *sink, const us_frame_s *frame, bool *key_requested);
+int us_memsink_server_trim(us_memsink_s *sink);
 
 int us_memsink_client_get(us_memsink_s *sink, us_frame_s *frame, bool *key_requested, bool key_required);
@@ -20,67 +20,109 @@
 *****************************************************************************/
 
 
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
 #include <assert.h>
 
 #include "ring.h"
 
 #include "types.h"
 #include "tools.h"
-#include "queue.h"
+#include "futex.h"
 
 
-int _acquire(us_ring_s *ring, us_queue_s *queue, ldf timeout);
-void _release(us_ring_s *ring, us_queue_s *queue, uint index);
+static int _acquire(
+	atomic_uint *released, uint *acquired, uint *index, uint ahead,
+	atomic_uint *waiting, uz capacity, ldf timeout);
+static void _release(atomic_uint *released, uint *index, uint expected, atomic_uint *waiting, uz capacity);
 
 
 us_ring_s *us_ring_init(uint capacity) {
+	assert(capacity > 0);
 	us_ring_s *ring;
-	US_CALLOC(ring, 1);
+	const uz size = us_align_size(sizeof(*ring), US_RING_CACHE_LINE);
+	assert((ring = aligned_alloc(US_RING_CACHE_LINE, size)) != NULL);
+	memset(ring, 0, size);
 	US_CALLOC(ring->items, capacity);
-	US_CALLOC(ring->places, capacity);
 	ring->capacity = capacity;
-	ring->producer = us_queue_init(capacity);
-	ring->consumer = us_queue_init(capacity);
-	for (uint index = 0; index < capacity; ++index) {
-		ring->places[index] = index; // XXX: Just to avoid casting between pointer and uint
-		assert(!us_queue_put(ring->producer, (void*)(ring->places + index), 0));
-	}
+	atomic_init(&ring->produced, 0);
+	atomic_init(&ring->producer_waiting, 0);
+	atomic_init(&ring->consumed, 0);
+	atomic_init(&ring->consumer_waiting, 0);
 	return ring;
 }
 
 void us_ring_destroy(us_ring_s *ring) {
-	us_queue_destroy(ring->consumer);
-	us_queue_destroy(ring->producer);
-	free(ring->places);
 	free(ring->items);
 	free(ring);
 }
 
 int us_ring_producer_acquire(us_ring_s *ring, ldf timeout) {
-	return _acquire(ring, ring->producer, timeout);
+	// The producer can be ahead of the consumer by the capacity
+	return _acquire(
+		&ring->consumed, &ring->producer_acquired, &ring->producer_acquire_index, ring->capacity,
+		&ring->producer_waiting, ring->capacity, timeout);
 }
 
 void us_ring_producer_release(us_ring_s *ring, uint index) {
-	_release(ring, ring->consumer, index);
+	_release(&ring->produced, &ring->producer_release_index, index, &ring->consumer_waiting, ring->capacity);
 }
 
 int us_ring_consumer_acquire(us_ring_s *ring, ldf timeout) {
-	return _acquire(ring, ring->consumer, timeout);
+	// The consumer can't be ahead of the producer
+	return _acquire(
+		&ring->produced, &ring->consumer_acquired, &ring->consumer_acquire_index, 0,
+		&ring->consumer_waiting, ring->capacity, timeout);
 }
 
 void us_ring_consumer_release(us_ring_s *ring, uint index) {
-	_release(ring, ring->producer, index);
+	_release(&ring->consumed, &ring->consumer_release_index, index, &ring->producer_waiting, ring->capacity);
+}
+
+uint us_ring_get_queued(us_ring_s *ring) {
+	// Released by the producer but not by the consumer, approximate for the other threads
+	const uint consumed = atomic_load_explicit(&ring->consumed, memory_order_relaxed);
+	return atomic_load_explicit(&ring->produced, memory_order_relaxed) - consumed;
 }
 
-int _acquire(us_ring_s *ring, us_queue_s *queue, ldf timeout) {
-	(void)ring;
-	uint *place;
-	if (us_queue_get(queue, (void**)&place, timeout) < 0) {
-		return -1;
+static int _acquire(
+	atomic_uint *released, uint *acquired, uint *index, uint ahead,
+	atomic_uint *waiting, uz capacity, ldf timeout) {
+
+	// The released counter belongs to the other side.
+	// The unsigned differences are correct after the wraparound.
+	const ldf deadline_ts = (timeout > 0 ? us_get_now_monotonic() + timeout : 0);
+	while (true) {
+		const uint other = atomic_load_explicit(released, memory_order_acquire);
+		if (other + ahead - *acquired > 0) {
+			const uint result = *index;
+			++*acquired;
+			*index = (*index + 1) % capacity;
+			return result;
+		}
+
+		if (timeout <= 0) {
+			return -1;
+		}
+		const ldf now_ts = us_get_now_monotonic();
+		if (now_ts >= deadline_ts) {
+			return -1;
+		}
+
+		atomic_store(waiting, 1);
+		if (atomic_load(released) == other) {
+			us_futex_wait(released, other, deadline_ts - now_ts);
+		}
+		atomic_store(waiting, 0);
 	}
-	return *place;
 }
 
-void _release(us_ring_s *ring, us_queue_s *queue, uint index) {
-	assert(!us_queue_put(queue, (void*)(ring->places + index), 0));
+static void _release(atomic_uint *released, uint *index, uint expected, atomic_uint *waiting, uz capacity) {
+	assert(expected == *index); // Released in the order of acquiring
+	*index = (*index + 1) % capacity;
+	atomic_fetch_add(released, 1); // Ordered with the waiting flag
+	if (atomic_load(waiting)) {
+		us_futex_wake(released);
+	}
 }
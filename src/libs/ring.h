@@ -22,17 +22,35 @@
 
 #pragma once
 
+#include <stdatomic.h>
 
 #include "types.h"
-#include "queue.h"
 
 
+#define US_RING_CACHE_LINE 64
+
+
+// Wait-free for one producer and one consumer at a time.
+// The slots are acquired and released in the same order by each side.
 typedef struct {
-	uz			capacity;
-	void		**items;
-	uint		*places;
-	us_queue_s	*producer;
-	us_queue_s	*consumer;
+	uz		capacity;
+	void	**items;
+
+	// Changed by the producer
+	_Alignas(US_RING_CACHE_LINE)
+	atomic_uint	produced; // Released slots, futex for the consumer
+	atomic_uint	producer_waiting;
+	uint		producer_acquired;
+	uint		producer_acquire_index;
+	uint		producer_release_index;
+
+	// Changed by the consumer
+	_Alignas(US_RING_CACHE_LINE)
+	atomic_uint	consumed; // Released slots, futex for the producer
+	atomic_uint	consumer_waiting;
+	uint		consumer_acquired;
+	uint		consumer_acquire_index;
+	uint		consumer_release_index;
 } us_ring_s;
 
 
@@ -46,7 +64,7 @@ typedef struct {
 #define US_RING_DELETE_WITH_ITEMS(x_ring, x_destroy_item) { \
 		if (x_ring) { \
 			for (uz m_index = 0; m_index < (x_ring)->capacity; ++m_index) { \
-				x_destroy_item((x_ring)->items[m_index]); \
+				US_DELETE((x_ring)->items[m_index], x_destroy_item); \
 			} \
 			us_ring_destroy(x_ring); \
 		} \
@@ -61,3 +79,5 @@ void us_ring_producer_release(us_ring_s *ring, uint index);
 
 int us_ring_consumer_acquire(us_ring_s *ring, ldf timeout);
 void us_ring_consumer_release(us_ring_s *ring, uint index);
+
+uint us_ring_get_queued(us_ring_s *ring);
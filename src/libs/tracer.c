@@ -0,0 +1,185 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "tracer.h"
+
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include "types.h"
+#include "tools.h"
+#include "threading.h"
+
+
+typedef struct {
+	// Seqlock: odd while the owner thread writes the span
+	atomic_ullong	seq;
+	const char		*name;
+	u64				trace_id;
+	ldf				begin_ts;
+	ldf				end_ts;
+} _slot_s;
+
+typedef struct _ring_sx {
+	_slot_s			slots[US_TRACER_RING_SIZE];
+	ull				head; // Changed by the owner thread only
+	atomic_bool		busy; // Owned by a living thread
+	uint			tid;
+	char			thread[US_THREAD_NAME_SIZE];
+	struct _ring_sx	*next;
+} _ring_s;
+
+
+atomic_uint us_g_tracer_sessions = 0;
+
+static pthread_once_t	_g_once = PTHREAD_ONCE_INIT;
+static pthread_key_t	_g_key;
+static pthread_mutex_t	_g_mutex = PTHREAD_MUTEX_INITIALIZER;
+static _ring_s			*_g_rings = NULL; // Never freed, reused by the new threads
+static uint				_g_n_rings = 0;
+
+
+static void _init_key(void);
+static void _release_ring(void *v_ring);
+static _ring_s *_get_ring(void);
+
+
+void us_tracer_start(void) {
+	atomic_fetch_add(&us_g_tracer_sessions, 1);
+}
+
+void us_tracer_stop(void) {
+	assert(atomic_fetch_sub(&us_g_tracer_sessions, 1) > 0);
+}
+
+void us_tracer_span(const char *name, u64 trace_id, ldf begin_ts, ldf end_ts) {
+	if (!us_tracer_is_enabled()) {
+		return;
+	}
+	_ring_s *const ring = _get_ring();
+	_slot_s *const slot = &ring->slots[ring->head % US_TRACER_RING_SIZE];
+	const ull seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+	atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+	atomic_thread_fence(memory_order_release);
+	slot->name = name;
+	slot->trace_id = trace_id;
+	slot->begin_ts = begin_ts;
+	slot->end_ts = end_ts;
+	atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+	++ring->head;
+}
+
+uz us_tracer_collect(ldf since_ts, us_tracer_span_s **spans) {
+	uz count = 0;
+	uz capacity = 0;
+	*spans = NULL;
+
+	US_MUTEX_LOCK(_g_mutex);
+	for (_ring_s *ring = _g_rings; ring != NULL; ring = ring->next) {
+		for (uint index = 0; index < US_TRACER_RING_SIZE; ++index) {
+			_slot_s *const slot = &ring->slots[index];
+			const ull seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+			if (seq == 0 || seq & 1) {
+				continue; // Empty or being written right now
+			}
+			const _slot_s copy = {
+				.name = slot->name,
+				.trace_id = slot->trace_id,
+				.begin_ts = slot->begin_ts,
+				.end_ts = slot->end_ts,
+			};
+			atomic_thread_fence(memory_order_acquire);
+			if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) {
+				continue; // Overwritten during the copying
+			}
+			if (copy.begin_ts < since_ts) {
+				continue;
+			}
+
+			if (count == capacity) {
+				capacity = US_MAX(capacity * 2, (uz)1024);
+				US_REALLOC(*spans, capacity);
+			}
+			us_tracer_span_s *const span = &(*spans)[count];
+			span->name = copy.name;
+			span->trace_id = copy.trace_id;
+			span->begin_ts = copy.begin_ts;
+			span->end_ts = copy.end_ts;
+			span->tid = ring->tid;
+			memcpy(span->thread, ring->thread, US_THREAD_NAME_SIZE);
+			++count;
+		}
+	}
+	US_MUTEX_UNLOCK(_g_mutex);
+	return count;
+}
+
+static void _init_key(void) {
+	assert(!pthread_key_create(&_g_key, _release_ring));
+}
+
+static void _release_ring(void *v_ring) {
+	_ring_s *const ring = v_ring;
+	atomic_store(&ring->busy, false);
+}
+
+static _ring_s *_get_ring(void) {
+	assert(!pthread_once(&_g_once, _init_key));
+	_ring_s *ring = pthread_getspecific(_g_key);
+	if (ring != NULL) {
+		return ring;
+	}
+
+	US_MUTEX_LOCK(_g_mutex);
+	for (ring = _g_rings; ring != NULL; ring = ring->next) {
+		bool busy = false;
+		if (atomic_compare_exchange_strong(&ring->busy, &busy, true)) {
+			// Reusing the ring of a finished thread, the collector is locked out
+			for (uint index = 0; index < US_TRACER_RING_SIZE; ++index) {
+				atomic_store_explicit(&ring->slots[index].seq, 0, memory_order_relaxed);
+			}
+			ring->head = 0;
+			break;
+		}
+	}
+	if (ring == NULL) {
+		US_CALLOC(ring, 1);
+		atomic_init(&ring->busy, true);
+		ring->tid = ++_g_n_rings;
+		ring->next = _g_rings;
+		_g_rings = ring;
+	}
+	us_thread_get_name(ring->thread);
+	if (ring->thread[0] == '\0') {
+		US_SNPRINTF(ring->thread, US_THREAD_NAME_SIZE - 1, "thread-%u", ring->tid);
+	}
+	US_MUTEX_UNLOCK(_g_mutex);
+
+	assert(!pthread_setspecific(_g_key, ring));
+	return ring;
+}
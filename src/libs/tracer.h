@@ -0,0 +1,65 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include "types.h"
+#include "tools.h"
+#include "threading.h"
+
+
+#define US_TRACER_RING_SIZE 4096 // Spans per thread
+
+
+typedef struct {
+	const char	*name; // Static string
+	u64			trace_id;
+	ldf			begin_ts;
+	ldf			end_ts;
+	uint		tid; // Number of the thread ring, not a system TID
+	char		thread[US_THREAD_NAME_SIZE];
+} us_tracer_span_s;
+
+
+// The number of the active trace sessions, see us_tracer_start()
+extern atomic_uint us_g_tracer_sessions;
+
+
+void us_tracer_start(void);
+void us_tracer_stop(void);
+
+void us_tracer_span(const char *name, u64 trace_id, ldf begin_ts, ldf end_ts);
+uz us_tracer_collect(ldf since_ts, us_tracer_span_s **spans);
+
+INLINE bool us_tracer_is_enabled(void) {
+	return (atomic_load_explicit(&us_g_tracer_sessions, memory_order_relaxed) > 0);
+}
+
+INLINE u64 us_tracer_get_id(ldf grab_ts) {
+	// The grab timestamp follows the frame through all the copies and sinks,
+	// so it's used as a trace ID without changing the frame meta.
+	return (u64)(grab_ts * 1000000);
+}
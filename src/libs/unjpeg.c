@@ -41,10 +41,21 @@ typedef struct {
 } _jpeg_error_manager_s;
 
 
+static int _unjpeg(const us_frame_s *src, us_frame_s *dest, bool decode, uint min_width, uint min_height);
 static void _jpeg_error_handler(j_common_ptr jpeg);
 
 
 int us_unjpeg(const us_frame_s *src, us_frame_s *dest, bool decode) {
+	return _unjpeg(src, dest, decode, 0, 0);
+}
+
+int us_unjpeg_scaled(const us_frame_s *src, us_frame_s *dest, uint min_width, uint min_height) {
+	// Decodes the smallest image which is not less than min_width x min_height
+	// using the DCT scaling: it's much faster than the full decoding and resizing.
+	return _unjpeg(src, dest, true, min_width, min_height);
+}
+
+static int _unjpeg(const us_frame_s *src, us_frame_s *dest, bool decode, uint min_width, uint min_height) {
 	assert(us_is_jpeg(src->format));
 
 	volatile int retval = 0;
@@ -66,6 +77,16 @@ int us_unjpeg(const us_frame_s *src, us_frame_s *dest, bool decode) {
 	jpeg_read_header(&jpeg, TRUE);
 	jpeg.out_color_space = JCS_RGB;
 
+	if (min_width > 0 || min_height > 0) {
+		// libjpeg supports scaling by N/8 in the DCT domain
+		for (jpeg.scale_num = 1, jpeg.scale_denom = 8; jpeg.scale_num < 8; ++jpeg.scale_num) {
+			jpeg_calc_output_dimensions(&jpeg);
+			if (jpeg.output_width >= min_width && jpeg.output_height >= min_height) {
+				break;
+			}
+		}
+	}
+
 	jpeg_start_decompress(&jpeg);
 
 	US_FRAME_COPY_META(src, dest); // cppcheck-suppress redundantAssignment
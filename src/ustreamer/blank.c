@@ -42,7 +42,10 @@ us_blank_s *us_blank_init(void) {
 
 void us_blank_draw(us_blank_s *blank, const char *text, uint width, uint height) {
 	us_frametext_draw(blank->ft, text, width, height);
-	us_cpu_encoder_compress(blank->raw, blank->jpeg, 95);
+	// The blank is redrawn rarely, so the compressor isn't kept
+	us_cpu_encoder_s *const enc = us_cpu_encoder_init();
+	us_cpu_encoder_compress(enc, blank->raw, blank->jpeg, 95);
+	us_cpu_encoder_destroy(enc);
 }
 
 void us_blank_destroy(us_blank_s *blank) {
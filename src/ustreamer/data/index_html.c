@@ -41,9 +41,48 @@ const char *const US_HTML_INDEX_PAGE = " \
 				Get JSON structure with the state of the server. \
 			</li> \
 			<br> \
+			<li> \
+				<a href=\"state/events\"><b>/state/events</b></a><br> \
+				Get the source and the stream client changes as Server-Sent Events.<br> \
+				The first event contains all the fields, the next ones contain only the changed fields. \
+			</li> \
+			<br> \
+			<li> \
+				<a href=\"metrics\"><b>/metrics</b></a><br> \
+				Get the latency histograms of the pipeline stages, the dropped frames and the sink counters<br> \
+				in the OpenMetrics format for Prometheus. \
+			</li> \
+			<br> \
+			<li> \
+				<a href=\"trace\"><b>/trace</b></a><br> \
+				Record the pipeline of every frame for a while and get it in the Chrome trace format<br> \
+				for <i>chrome://tracing</i> or Perfetto. Query params:<br> \
+				<br> \
+				<ul> \
+					<li> \
+						<b>seconds=1</b><br> \
+						Duration of the trace, from 1 to 60 seconds. \
+					</li> \
+				</ul> \
+			</li> \
+			<br> \
 			<li> \
 				<a href=\"snapshot\"><b>/snapshot</b></a><br> \
-				Get a current actual image from the server. \
+				Get a current actual image from the server. Query params:<br> \
+				<br> \
+				<ul> \
+					<li> \
+						<b>max_age=500</b><br> \
+						Return the last frame right away if it was captured no more than this number of milliseconds ago.<br> \
+						The responses have an <i>ETag</i>, so the <i>If-None-Match</i> requests for the same frame get <i>304</i>. \
+					</li> \
+					<br> \
+					<li> \
+						<b>width=320</b>, <b>height=180</b>, <b>quality=70</b><br> \
+						Return a scaled JPEG which fits the given size, keeping the aspect ratio (never upscaled).<br> \
+						The quality defaults to the encoder one. The result is cached for every frame, size and quality. \
+					</li> \
+				</ul> \
 			</li> \
 			<br> \
 			<li> \
@@ -83,6 +122,13 @@ const char *const US_HTML_INDEX_PAGE = " \
 				</ul> \
 			</li> \
 			<br> \
+			<li> \
+				<b>/ws</b><br> \
+				Get a live stream over WebSocket, one binary message per frame.<br> \
+				Each message starts with a 28-byte big-endian header: format, width, height, flags,<br> \
+				grab timestamp and frame id (see <i>src/ustreamer/http/ws.h</i>). Query param <b>key</b> is the same as for <a href=\"stream\">/stream</a>. \
+			</li> \
+			<br> \
 			<li> \
 				The mjpg-streamer compatibility layer:<br> \
 				<br> \
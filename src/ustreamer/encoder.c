@@ -34,12 +34,16 @@
 #include "../libs/threading.h"
 #include "../libs/logging.h"
 #include "../libs/frame.h"
+#include "../libs/framepool.h"
 #include "../libs/capture.h"
+#include "../libs/tracer.h"
 
 #include "workers.h"
 #include "m2m.h"
 
 #include "encoders/cpu/encoder.h"
+#include "encoders/cpu/sliced.h"
+#include "encoders/cpu/incremental.h"
 #include "encoders/hw/encoder.h"
 
 
@@ -48,6 +52,7 @@ static const struct {
 	const us_encoder_type_e type; // cppcheck-suppress unusedStructMember
 } _ENCODER_TYPES[] = {
 	{"CPU",			US_ENCODER_TYPE_CPU},
+	{"CPU-SLICED",	US_ENCODER_TYPE_CPU_SLICED},
 	{"HW",			US_ENCODER_TYPE_HW},
 	{"M2M-VIDEO",	US_ENCODER_TYPE_M2M_VIDEO},
 	{"M2M-IMAGE",	US_ENCODER_TYPE_M2M_IMAGE},
@@ -89,6 +94,7 @@ void us_encoder_destroy(us_encoder_s *enc) {
 		}
 		free(run->m2ms);
 	}
+	US_DELETE(run->sliced, us_cpu_sliced_encoder_destroy);
 	US_MUTEX_DESTROY(run->mutex);
 	free(run);
 	free(enc);
@@ -153,6 +159,14 @@ void us_encoder_open(us_encoder_s *enc, us_capture_s *cap) {
 				run->m2ms[run->n_m2ms] = us_m2m_jpeg_encoder_init(name, enc->m2m_path, quality);
 			}
 		}
+	} else if (type == US_ENCODER_TYPE_CPU_SLICED) {
+		// One frame at a time, the workers encode its stripes in parallel
+		if (run->sliced == NULL) {
+			US_LOG_DEBUG("Preparing CPU-SLICED encoder with %u slices ...", enc->n_workers);
+			run->sliced = us_cpu_sliced_encoder_init(enc->n_workers);
+		}
+		n_workers = 1;
+
 	} else if (type == US_ENCODER_TYPE_RV1126_H264 || type == US_ENCODER_TYPE_RV1126_H265 || type == US_ENCODER_TYPE_RV1126_MJPEG) {
 		n_workers = 1; //1126不需要多个编码器
 		// 这里应是在初始化单独编码某一帧的编码工具
@@ -183,6 +197,17 @@ void us_encoder_open(us_encoder_s *enc, us_capture_s *cap) {
 		// }
 	}
 
+	if (enc->cpu_incremental) {
+		if (type == US_ENCODER_TYPE_CPU) {
+			// Each frame is compared with the previous one, so all frames go through
+			// a single worker and a single cache instead of the round-robin.
+			US_LOG_INFO("Using a single JPEG worker for --cpu-incremental");
+			n_workers = 1;
+		} else {
+			US_LOG_INFO("Ignoring --cpu-incremental: the encoder is %s", us_encoder_type_to_string(type));
+		}
+	}
+
 	if (quality == 0) {
 		US_LOG_INFO("Using JPEG quality: encoder default"); // 使用默认JPEG质量
 	} else {
@@ -224,13 +249,15 @@ static void *_worker_job_init(void *v_enc) {
 	us_encoder_job_s *job;
 	US_CALLOC(job, 1);
 	job->enc = (us_encoder_s*)v_enc;
-	job->dest = us_frame_init();
+	// The destination frame is taken from the stream pool on assigning
 	return (void*)job;
 }
 
 static void _worker_job_destroy(void *v_job) {
 	us_encoder_job_s *job = v_job;
-	us_frame_destroy(job->dest);
+	US_DELETE(job->dest, us_frame_unref);
+	US_DELETE(job->cpu, us_cpu_encoder_destroy);
+	US_DELETE(job->cpu_inc, us_cpu_incremental_destroy);
 	free(job);
 }
 
@@ -239,11 +266,29 @@ static bool _worker_run_job(us_worker_s *wr) {
 	us_encoder_runtime_s *const run = job->enc->run;
 	const us_frame_s *const src = &job->hw->raw;
 	us_frame_s *const dest = job->dest;
+	const ldf begin_ts = us_get_now_monotonic();
 
 	if (run->type == US_ENCODER_TYPE_CPU) {
-		US_LOG_VERBOSE("Compressing JPEG using CPU: worker=%s, buffer=%u",
-			wr->name, job->hw->buf.index);
-		us_cpu_encoder_compress(src, dest, run->quality);
+		if (job->enc->cpu_incremental) {
+			if (job->cpu_inc == NULL) {
+				job->cpu_inc = us_cpu_incremental_init();
+			}
+			us_cpu_incremental_compress(job->cpu_inc, src, dest, run->quality);
+			US_LOG_VERBOSE("Compressed JPEG using CPU incrementally: worker=%s, buffer=%u, changed_rows=%u",
+				wr->name, job->hw->buf.index, job->cpu_inc->n_changed);
+		} else {
+			US_LOG_VERBOSE("Compressing JPEG using CPU: worker=%s, buffer=%u",
+				wr->name, job->hw->buf.index);
+			if (job->cpu == NULL) {
+				job->cpu = us_cpu_encoder_init();
+			}
+			us_cpu_encoder_compress(job->cpu, src, dest, run->quality);
+		}
+
+	} else if (run->type == US_ENCODER_TYPE_CPU_SLICED) {
+		US_LOG_VERBOSE("Compressing JPEG using CPU by %u slices: worker=%s, buffer=%u",
+			run->sliced->n_slices, wr->name, job->hw->buf.index);
+		us_cpu_sliced_encoder_compress(run->sliced, src, dest, run->quality);
 
 	} else if (run->type == US_ENCODER_TYPE_HW) {
 		US_LOG_VERBOSE("Compressing JPEG using HW (just copying): worker=%s, buffer=%u",
@@ -273,6 +318,11 @@ static bool _worker_run_job(us_worker_s *wr) {
 		job->dest->encode_end_ts - job->dest->encode_begin_ts,
 		wr->name,
 		job->hw->buf.index);
+	if (us_tracer_is_enabled()) {
+		const u64 trace_id = us_tracer_get_id(src->grab_ts);
+		us_tracer_span("queue_wait", trace_id, job->hw->dequeue_ts, begin_ts);
+		us_tracer_span("encode", trace_id, begin_ts, us_get_now_monotonic());
+	}
 	return true;
 
 error:
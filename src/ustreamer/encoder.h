@@ -32,12 +32,17 @@
 #include "m2m.h"
 #include "rv1126.h"
 
+#include "encoders/cpu/encoder.h"
+#include "encoders/cpu/sliced.h"
+#include "encoders/cpu/incremental.h"
 
-#define ENCODER_TYPES_STR "CPU, HW, M2M-VIDEO, M2M-IMAGE"
+
+#define ENCODER_TYPES_STR "CPU, CPU-SLICED, HW, M2M-VIDEO, M2M-IMAGE"
 
 
 typedef enum {
 	US_ENCODER_TYPE_CPU,
+	US_ENCODER_TYPE_CPU_SLICED,
 	US_ENCODER_TYPE_HW,
 	US_ENCODER_TYPE_M2M_VIDEO,
 	US_ENCODER_TYPE_M2M_IMAGE,
@@ -55,6 +60,7 @@ typedef struct {
 	uint				n_rv1126_encoder;
 	us_m2m_encoder_s	**m2ms;
 	us_rv1126_encoder_s	**rv1126_encoder;
+	us_cpu_sliced_encoder_s *sliced;
 
 	us_workers_pool_s	*pool;
 } us_encoder_runtime_s;
@@ -63,6 +69,7 @@ typedef struct {
 	us_encoder_type_e	type;
 	uint				n_workers;
 	char				*m2m_path;
+	bool				cpu_incremental;
 
 	us_encoder_runtime_s *run;
 } us_encoder_s;
@@ -71,6 +78,8 @@ typedef struct {
 	us_encoder_s		*enc;
 	us_capture_hwbuf_s	*hw;
 	us_frame_s			*dest;
+	us_cpu_encoder_s	*cpu; // Created on the first CPU job and kept for the worker
+	us_cpu_incremental_s *cpu_inc; // The same for --cpu-incremental
 } us_encoder_job_s;
 
 
@@ -27,84 +27,143 @@
 
 #include "encoder.h"
 
+#include "yuv.h"
+
 
 typedef struct {
 	struct jpeg_destination_mgr mgr; // Default manager
-	JOCTET		*buf; // Start of buffer
-	us_frame_s	*frame;
+	us_frame_s	*frame; // The output is written right into it
+	uz			size_hint;
 } _jpeg_dest_manager_s;
 
 
-static void _jpeg_set_dest_frame(j_compress_ptr jpeg, us_frame_s *frame);
+static void _jpeg_configure(us_cpu_encoder_s *enc, uint format, uint quality);
+static void _jpeg_set_dest_frame(us_cpu_encoder_s *enc, us_frame_s *frame);
+
+// libjpeg is fed by the batches of lines instead of one by one
+#define _LINES_BATCH ((uint)16)
 
-static void _jpeg_write_scanlines_yuv(struct jpeg_compress_struct *jpeg, const us_frame_s *frame);
-static void _jpeg_write_scanlines_rgb565(struct jpeg_compress_struct *jpeg, const us_frame_s *frame);
-static void _jpeg_write_scanlines_rgb24(struct jpeg_compress_struct *jpeg, const us_frame_s *frame);
+static void _jpeg_write_raw_yuv(us_cpu_encoder_s *enc, const us_frame_s *frame);
+static void _pad_line(u8 *line, uint width, uint padded);
+static void _jpeg_write_scanlines_rgb565(us_cpu_encoder_s *enc, const us_frame_s *frame);
+static void _jpeg_write_scanlines_rgb24(us_cpu_encoder_s *enc, const us_frame_s *frame);
 #ifndef JCS_EXTENSIONS
 #warning JCS_EXT_BGR is not supported, please use libjpeg-turbo
-static void _jpeg_write_scanlines_bgr24(struct jpeg_compress_struct *jpeg, const us_frame_s *frame);
+static void _jpeg_write_scanlines_bgr24(us_cpu_encoder_s *enc, const us_frame_s *frame);
 #endif
+static void _get_lines(us_cpu_encoder_s *enc, JSAMPROW *lines, uint n_lines, uint line_size);
+static void _jpeg_write_lines(struct jpeg_compress_struct *jpeg, JSAMPARRAY lines, uint n_lines);
 
 static void _jpeg_init_destination(j_compress_ptr jpeg);
 static boolean _jpeg_empty_output_buffer(j_compress_ptr jpeg);
 static void _jpeg_term_destination(j_compress_ptr jpeg);
 
 
-void us_cpu_encoder_compress(const us_frame_s *src, us_frame_s *dest, unsigned quality) {
+us_cpu_encoder_s *us_cpu_encoder_init(void) {
+	us_cpu_encoder_s *enc;
+	US_CALLOC(enc, 1);
+	enc->jpeg.err = jpeg_std_error(&enc->jpeg_error);
+	jpeg_create_compress(&enc->jpeg);
+	return enc;
+}
+
+void us_cpu_encoder_destroy(us_cpu_encoder_s *enc) {
+	jpeg_destroy_compress(&enc->jpeg);
+	US_DELETE(enc->lines, free);
+	free(enc);
+}
+
+void us_cpu_encoder_compress(us_cpu_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, uint quality) {
 	// This function based on compress_image_to_jpeg() from mjpg-streamer
 
 	us_frame_encoding_begin(src, dest, V4L2_PIX_FMT_JPEG);
 
-	struct jpeg_compress_struct jpeg;
-	struct jpeg_error_mgr jpeg_error;
-
-	jpeg.err = jpeg_std_error(&jpeg_error);
-	jpeg_create_compress(&jpeg);
+	struct jpeg_compress_struct *const jpeg = &enc->jpeg;
 
-	_jpeg_set_dest_frame(&jpeg, dest);
+	_jpeg_set_dest_frame(enc, dest);
 
-	jpeg.image_width = src->width;
-	jpeg.image_height = src->height;
-	jpeg.input_components = 3;
-	switch (src->format) {
-		case V4L2_PIX_FMT_YUYV:
-		case V4L2_PIX_FMT_YVYU:
-		case V4L2_PIX_FMT_UYVY: jpeg.in_color_space = JCS_YCbCr; break;
-#		ifdef JCS_EXTENSIONS
-		case V4L2_PIX_FMT_BGR24: jpeg.in_color_space = JCS_EXT_BGR; break;
-#		endif
-		default: jpeg.in_color_space = JCS_RGB; break;
+	if (!enc->configured || enc->format != src->format || enc->quality != quality) {
+		_jpeg_configure(enc, src->format, quality);
 	}
+	// The geometry is applied on every start and doesn't need the defaults
+	jpeg->image_width = src->width;
+	jpeg->image_height = src->height;
+	jpeg->restart_interval = 0; // Otherwise it stays from the previous start
+	jpeg->restart_in_rows = enc->restart_rows;
 
-	jpeg_set_defaults(&jpeg);
-	jpeg_set_quality(&jpeg, quality, TRUE);
-
-	jpeg_start_compress(&jpeg, TRUE);
+	jpeg_start_compress(jpeg, TRUE);
 
 	switch (src->format) {
 		// https://www.fourcc.org/yuv.php
 		case V4L2_PIX_FMT_YUYV:
 		case V4L2_PIX_FMT_YVYU:
-		case V4L2_PIX_FMT_UYVY:		_jpeg_write_scanlines_yuv(&jpeg, src); break;
-		case V4L2_PIX_FMT_RGB565:	_jpeg_write_scanlines_rgb565(&jpeg, src); break;
-		case V4L2_PIX_FMT_RGB24:	_jpeg_write_scanlines_rgb24(&jpeg, src); break;
+		case V4L2_PIX_FMT_UYVY:		_jpeg_write_raw_yuv(enc, src); break;
+		case V4L2_PIX_FMT_RGB565:	_jpeg_write_scanlines_rgb565(enc, src); break;
+		case V4L2_PIX_FMT_RGB24:	_jpeg_write_scanlines_rgb24(enc, src); break;
 		case V4L2_PIX_FMT_BGR24:
 #			ifdef JCS_EXTENSIONS
-			_jpeg_write_scanlines_rgb24(&jpeg, src); // Use native JCS_EXT_BGR
+			_jpeg_write_scanlines_rgb24(enc, src); // Use native JCS_EXT_BGR
 #			else
-			_jpeg_write_scanlines_bgr24(&jpeg, src);
+			_jpeg_write_scanlines_bgr24(enc, src);
 #			endif
 			break;
 		default: assert(0 && "Unsupported input format for CPU encoder"); return;
 	}
 
-	jpeg_finish_compress(&jpeg);
-	jpeg_destroy_compress(&jpeg);
+	jpeg_finish_compress(jpeg);
+	enc->last_size = dest->used;
 
 	us_frame_encoding_end(dest);
 }
 
-static void _jpeg_set_dest_frame(j_compress_ptr jpeg, us_frame_s *frame) {
+int us_cpu_encoder_find_scan(const us_frame_s *frame, uz *sof_height, uz *scan_begin) {
+	// Walks the marker segments written by libjpeg up to the SOS
+	const u8 *const data = frame->data;
+	uz pos = 2; // After SOI
+	while (pos + 4 <= frame->used && data[pos] == 0xFF) {
+		const u8 marker = data[pos + 1];
+		const uz length = ((uz)data[pos + 2] << 8) | data[pos + 3];
+		if (marker == US_JPEG_MARKER_SOF0 && sof_height != NULL) {
+			*sof_height = pos + 5; // After the length and the precision
+		}
+		pos += 2 + length;
+		if (marker == US_JPEG_MARKER_SOS) {
+			*scan_begin = pos;
+			return (pos + 2 <= frame->used ? 0 : -1);
+		}
+	}
+	return -1;
+}
+
+static void _jpeg_configure(us_cpu_encoder_s *enc, uint format, uint quality) {
+	struct jpeg_compress_struct *const jpeg = &enc->jpeg;
+
+	jpeg->input_components = 3;
+	switch (format) {
+		case V4L2_PIX_FMT_YUYV:
+		case V4L2_PIX_FMT_YVYU:
+		case V4L2_PIX_FMT_UYVY: jpeg->in_color_space = JCS_YCbCr; break;
+#		ifdef JCS_EXTENSIONS
+		case V4L2_PIX_FMT_BGR24: jpeg->in_color_space = JCS_EXT_BGR; break;
+#		endif
+		default: jpeg->in_color_space = JCS_RGB; break;
+	}
+
+	jpeg_set_defaults(jpeg);
+	jpeg_set_quality(jpeg, quality, TRUE);
+	if (jpeg->in_color_space == JCS_YCbCr) {
+		// The default sampling is 2x2 for Y and 1x1 for Cb and Cr, i.e. 4:2:0
+		assert(jpeg->comp_info[0].h_samp_factor == 2 && jpeg->comp_info[0].v_samp_factor == 2);
+		jpeg->raw_data_in = TRUE;
+	}
+
+	enc->format = format;
+	enc->quality = quality;
+	enc->configured = true;
+}
+
+static void _jpeg_set_dest_frame(us_cpu_encoder_s *enc, us_frame_s *frame) {
+	struct jpeg_compress_struct *const jpeg = &enc->jpeg;
 	if (jpeg->dest == NULL) {
 		assert((jpeg->dest = (struct jpeg_destination_mgr*)(*jpeg->mem->alloc_small)(
 			(j_common_ptr) jpeg, JPOOL_PERMANENT, sizeof(_jpeg_dest_manager_s)
@@ -116,163 +175,166 @@ static void _jpeg_set_dest_frame(j_compress_ptr jpeg, us_frame_s *frame) {
 	dest->mgr.empty_output_buffer = _jpeg_empty_output_buffer;
 	dest->mgr.term_destination = _jpeg_term_destination;
 	dest->frame = frame;
+	// Some headroom for the next frame, the buffer is doubled if it's not enough
+	dest->size_hint = US_MAX(enc->last_size + (enc->last_size >> 2), (uz)64 * 1024);
 
 	frame->used = 0;
 }
 
-static void _jpeg_write_scanlines_yuv(struct jpeg_compress_struct *jpeg, const us_frame_s *frame) {
-	uint8_t *line_buf;
-	US_CALLOC(line_buf, frame->width * 3);
-
-	const unsigned padding = us_frame_get_padding(frame);
-	const uint8_t *data = frame->data;
+static void _jpeg_write_raw_yuv(us_cpu_encoder_s *enc, const us_frame_s *frame) {
+	// The 4:2:2 frame is split to the 4:2:0 planes which are passed to libjpeg as is,
+	// so there is no color conversion and no chroma upsampling and downsampling.
+	// Every call consumes an iMCU row: 16 lines of Y and 8 lines of Cb and Cr.
+	struct jpeg_compress_struct *const jpeg = &enc->jpeg;
+	const us_yuv_split_f split = us_yuv_get_splitter(frame->format);
+	const uint stride = (frame->width << 1) + us_frame_get_padding(frame);
+	const uint c_width = (frame->width + 1) >> 1;
+
+	// Including the padding to the full blocks
+	const uint y_padded = jpeg->comp_info[0].width_in_blocks * DCTSIZE;
+	const uint c_padded = jpeg->comp_info[1].width_in_blocks * DCTSIZE;
+	JSAMPROW lines[4 * DCTSIZE];
+	_get_lines(enc, lines, 4 * DCTSIZE, y_padded);
+	JSAMPARRAY planes[3] = {lines, lines + 2 * DCTSIZE, lines + 3 * DCTSIZE};
+	assert(c_padded <= y_padded);
 
 	while (jpeg->next_scanline < frame->height) {
-		uint8_t *ptr = line_buf;
-
-		for (unsigned x = 0; x < frame->width; ++x) {
-			// See also: https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/pixfmt-uyvy.html
-			const bool is_odd_pixel = x & 1;
-			uint8_t y, u, v;
-			if (frame->format == V4L2_PIX_FMT_YUYV) {
-				y = data[is_odd_pixel ? 2 : 0];
-				u = data[1];
-				v = data[3];
-			} else if (frame->format == V4L2_PIX_FMT_YVYU) {
-				y = data[is_odd_pixel ? 2 : 0];
-				u = data[3];
-				v = data[1];
-			} else if (frame->format == V4L2_PIX_FMT_UYVY) {
-				y = data[is_odd_pixel ? 3 : 1];
-				u = data[0];
-				v = data[2];
-			} else {
-				assert(0 && "Unsupported pixel format");
-				return; // Makes linter happy
-			}
-
-			ptr[0] = y;
-			ptr[1] = u;
-			ptr[2] = v;
-			ptr += 3;
-
-			data += (is_odd_pixel ? 4 : 0);
+		for (uint line = 0; line < 2 * DCTSIZE; line += 2) {
+			// The lines after the bottom repeat the last one
+			const uint y_a = US_MIN(jpeg->next_scanline + line, frame->height - 1);
+			const uint y_b = US_MIN(y_a + 1, frame->height - 1);
+			u8 *const cb = planes[1][line >> 1];
+			u8 *const cr = planes[2][line >> 1];
+			split(
+				frame->data + y_a * stride, frame->data + y_b * stride,
+				planes[0][line], planes[0][line + 1], cb, cr, frame->width
+			);
+			_pad_line(planes[0][line], frame->width, y_padded);
+			_pad_line(planes[0][line + 1], frame->width, y_padded);
+			_pad_line(cb, c_width, c_padded);
+			_pad_line(cr, c_width, c_padded);
 		}
-		data += padding;
-
-		JSAMPROW scanlines[1] = {line_buf};
-		jpeg_write_scanlines(jpeg, scanlines, 1);
+		assert(jpeg_write_raw_data(jpeg, planes, 2 * DCTSIZE) == 2 * DCTSIZE);
 	}
-
-	free(line_buf);
 }
 
-static void _jpeg_write_scanlines_rgb565(struct jpeg_compress_struct *jpeg, const us_frame_s *frame) {
-	uint8_t *line_buf;
-	US_CALLOC(line_buf, frame->width * 3);
-
-	const unsigned padding = us_frame_get_padding(frame);
-	const uint8_t *data = frame->data;
-
-	while (jpeg->next_scanline < frame->height) {
-		uint8_t *ptr = line_buf;
-
-		for (unsigned x = 0; x < frame->width; ++x) {
-			const unsigned int two_byte = (data[1] << 8) + data[0];
-
-			ptr[0] = data[1] & 248; // Red
-			ptr[1] = (uint8_t)((two_byte & 2016) >> 3); // Green
-			ptr[2] = (data[0] & 31) * 8; // Blue
-			ptr += 3;
+static void _pad_line(u8 *line, uint width, uint padded) {
+	// Repeats the right edge instead of the garbage to avoid artifacts in the last block
+	if (padded > width) {
+		memset(line + width, line[width - 1], padded - width);
+	}
+}
 
-			data += 2;
+static void _jpeg_write_scanlines_rgb565(us_cpu_encoder_s *enc, const us_frame_s *frame) {
+	JSAMPROW lines[_LINES_BATCH];
+	_get_lines(enc, lines, _LINES_BATCH, frame->width * 3);
+	const uint padding = us_frame_get_padding(frame);
+	const u8 *data = frame->data;
+
+	while (enc->jpeg.next_scanline < frame->height) {
+		const uint n_lines = US_MIN(_LINES_BATCH, frame->height - enc->jpeg.next_scanline);
+		for (uint line = 0; line < n_lines; ++line) {
+			u8 *ptr = lines[line];
+			for (uint x = 0; x < frame->width; ++x) {
+				const uint two_byte = (data[1] << 8) + data[0];
+
+				ptr[0] = data[1] & 248; // Red
+				ptr[1] = (u8)((two_byte & 2016) >> 3); // Green
+				ptr[2] = (data[0] & 31) * 8; // Blue
+				ptr += 3;
+
+				data += 2;
+			}
+			data += padding;
 		}
-		data += padding;
-
-		JSAMPROW scanlines[1] = {line_buf};
-		jpeg_write_scanlines(jpeg, scanlines, 1);
+		_jpeg_write_lines(&enc->jpeg, lines, n_lines);
 	}
-
-	free(line_buf);
 }
 
-static void _jpeg_write_scanlines_rgb24(struct jpeg_compress_struct *jpeg, const us_frame_s *frame) {
-	const unsigned padding = us_frame_get_padding(frame);
-	uint8_t *data = frame->data;
-
-	while (jpeg->next_scanline < frame->height) {
-		JSAMPROW scanlines[1] = {data};
-		jpeg_write_scanlines(jpeg, scanlines, 1);
-
-		data += (frame->width * 3) + padding;
+static void _jpeg_write_scanlines_rgb24(us_cpu_encoder_s *enc, const us_frame_s *frame) {
+	// The lines are passed as is, without copying
+	const uint padding = us_frame_get_padding(frame);
+	u8 *data = frame->data;
+
+	while (enc->jpeg.next_scanline < frame->height) {
+		const uint n_lines = US_MIN(_LINES_BATCH, frame->height - enc->jpeg.next_scanline);
+		JSAMPROW lines[_LINES_BATCH];
+		for (uint line = 0; line < n_lines; ++line) {
+			lines[line] = data;
+			data += (frame->width * 3) + padding;
+		}
+		_jpeg_write_lines(&enc->jpeg, lines, n_lines);
 	}
 }
 
 #ifndef JCS_EXTENSIONS
-static void _jpeg_write_scanlines_bgr24(struct jpeg_compress_struct *jpeg, const us_frame_s *frame) {
-	uint8_t *line_buf;
-	US_CALLOC(line_buf, frame->width * 3);
-
-	const unsigned padding = us_frame_get_padding(frame);
-	uint8_t *data = frame->data;
+static void _jpeg_write_scanlines_bgr24(us_cpu_encoder_s *enc, const us_frame_s *frame) {
+	JSAMPROW lines[_LINES_BATCH];
+	_get_lines(enc, lines, _LINES_BATCH, frame->width * 3);
+	const uint padding = us_frame_get_padding(frame);
+	const u8 *data = frame->data;
+
+	while (enc->jpeg.next_scanline < frame->height) {
+		const uint n_lines = US_MIN(_LINES_BATCH, frame->height - enc->jpeg.next_scanline);
+		for (uint line = 0; line < n_lines; ++line) {
+			u8 *ptr = lines[line];
+
+			// swap B and R values
+			for (uint x = 0; x < frame->width * 3; x += 3) {
+				ptr[0] = data[x + 2];
+				ptr[1] = data[x + 1];
+				ptr[2] = data[x];
+				ptr += 3;
+			}
 
-	while (jpeg->next_scanline < frame->height) {
-		uint8_t *ptr = line_buf;
-
-		// swap B and R values
-		for (unsigned x = 0; x < frame->width * 3; x += 3) {
-			ptr[0] = data[x + 2];
-			ptr[1] = data[x + 1];
-			ptr[2] = data[x];
-			ptr += 3;
+			data += (frame->width * 3) + padding;
 		}
-		
-		JSAMPROW scanlines[1] = {line_buf};
-		jpeg_write_scanlines(jpeg, scanlines, 1);
-
-		data += (frame->width * 3) + padding;
+		_jpeg_write_lines(&enc->jpeg, lines, n_lines);
 	}
-
-	free(line_buf);
 }
 #endif
 
-#define JPEG_OUTPUT_BUFFER_SIZE ((size_t)4096)
+static void _get_lines(us_cpu_encoder_s *enc, JSAMPROW *lines, uint n_lines, uint line_size) {
+	// The scratch buffer is kept between the frames and grows on the geometry change
+	const uz size = (uz)n_lines * line_size;
+	if (enc->lines_size < size) {
+		US_DELETE(enc->lines, free);
+		US_CALLOC(enc->lines, size);
+		enc->lines_size = size;
+	}
+	for (uint line = 0; line < n_lines; ++line) {
+		lines[line] = enc->lines + line * line_size;
+	}
+}
+
+static void _jpeg_write_lines(struct jpeg_compress_struct *jpeg, JSAMPARRAY lines, uint n_lines) {
+	// Our destination manager never suspends, so all lines are consumed at once
+	assert(jpeg_write_scanlines(jpeg, lines, n_lines) == n_lines);
+}
 
 static void _jpeg_init_destination(j_compress_ptr jpeg) {
+	// The output goes right into the frame which is preallocated for the previous size
 	_jpeg_dest_manager_s *const dest = (_jpeg_dest_manager_s*)jpeg->dest;
-
-	// Allocate the output buffer - it will be released when done with image
-	assert((dest->buf = (JOCTET*)(*jpeg->mem->alloc_small)(
-		(j_common_ptr) jpeg, JPOOL_IMAGE, JPEG_OUTPUT_BUFFER_SIZE * sizeof(JOCTET)
-	)) != NULL);
-
-	dest->mgr.next_output_byte = dest->buf;
-	dest->mgr.free_in_buffer = JPEG_OUTPUT_BUFFER_SIZE;
+	us_frame_realloc_data(dest->frame, dest->size_hint);
+	dest->mgr.next_output_byte = dest->frame->data;
+	dest->mgr.free_in_buffer = dest->frame->allocated;
 }
 
 static boolean _jpeg_empty_output_buffer(j_compress_ptr jpeg) {
-	// Called whenever local jpeg buffer fills up
-
+	// Called whenever the frame fills up, the written data is kept on growing
 	_jpeg_dest_manager_s *const dest = (_jpeg_dest_manager_s*)jpeg->dest;
+	us_frame_s *const frame = dest->frame;
 
-	us_frame_append_data(dest->frame, dest->buf, JPEG_OUTPUT_BUFFER_SIZE);
-
-	dest->mgr.next_output_byte = dest->buf;
-	dest->mgr.free_in_buffer = JPEG_OUTPUT_BUFFER_SIZE;
+	frame->used = frame->allocated;
+	us_frame_realloc_data(frame, frame->allocated << 1);
 
+	dest->mgr.next_output_byte = frame->data + frame->used;
+	dest->mgr.free_in_buffer = frame->allocated - frame->used;
 	return TRUE;
 }
 
 static void _jpeg_term_destination(j_compress_ptr jpeg) {
-	// Called by jpeg_finish_compress after all data has been written.
-	// Usually needs to flush buffer.
-
+	// Called by jpeg_finish_compress after all data has been written
 	_jpeg_dest_manager_s *const dest = (_jpeg_dest_manager_s*)jpeg->dest;
-	const size_t final = JPEG_OUTPUT_BUFFER_SIZE - dest->mgr.free_in_buffer;
-
-	// Write any data remaining in the buffer.
-	us_frame_append_data(dest->frame, dest->buf, final);
+	dest->frame->used = dest->frame->allocated - dest->mgr.free_in_buffer;
 }
-
-#undef JPEG_OUTPUT_BUFFER_SIZE
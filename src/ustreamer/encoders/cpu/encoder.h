@@ -31,8 +31,40 @@
 
 #include <linux/videodev2.h>
 
+#include "../../../libs/types.h"
 #include "../../../libs/tools.h"
 #include "../../../libs/frame.h"
 
 
-void us_cpu_encoder_compress(const us_frame_s *src, us_frame_s *dest, unsigned quality);
+// The defaults are 4:2:0 for all our inputs, so MCU is 16x16
+#define US_CPU_ENCODER_MCU_SIZE	((uint)16)
+
+#define US_JPEG_MARKER_SOF0	0xC0
+#define US_JPEG_MARKER_RST0	0xD0
+#define US_JPEG_MARKER_EOI	0xD9
+#define US_JPEG_MARKER_SOS	0xDA
+
+
+typedef struct {
+	// Reused for all frames, the quantization and Huffman tables are rebuilt
+	// by jpeg_set_defaults() only on the format or quality change.
+	struct jpeg_compress_struct	jpeg;
+	struct jpeg_error_mgr		jpeg_error;
+	bool						configured;
+	uint						format;
+	uint						quality;
+	uint						restart_rows; // MCU rows between the restart markers, 0 to disable
+
+	uz	last_size; // The output frame is preallocated for it
+	u8	*lines; // The scratch lines for the color conversion
+	uz	lines_size;
+} us_cpu_encoder_s;
+
+
+us_cpu_encoder_s *us_cpu_encoder_init(void);
+void us_cpu_encoder_destroy(us_cpu_encoder_s *enc);
+
+void us_cpu_encoder_compress(us_cpu_encoder_s *enc, const us_frame_s *src, us_frame_s *dest, uint quality);
+
+// Finds the position of SOF0 height and the entropy-coded data after SOS
+int us_cpu_encoder_find_scan(const us_frame_s *frame, uz *sof_height, uz *scan_begin);
@@ -0,0 +1,222 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "incremental.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <linux/videodev2.h>
+
+#include "../../../libs/types.h"
+#include "../../../libs/tools.h"
+#include "../../../libs/frame.h"
+
+#include "encoder.h"
+
+
+// Every MCU row of the JPEG is a separate restart interval, so it doesn't depend
+// on the other rows and can be replaced as is. The rows which are the same
+// as in the previous frame are taken from the cached JPEG, the runs of the changed
+// rows are encoded as the standalone images and split to the rows by RST markers.
+// The result is the same as the full encoding with the restart in every row.
+
+
+static bool _is_row_changed(const us_cpu_incremental_s *inc, const us_frame_s *src, uint row);
+static void _encode_rows(us_cpu_incremental_s *inc, const us_frame_s *src, uint begin, uint end);
+static void _append_row(us_cpu_incremental_s *inc, uint row, const u8 *data, uz size);
+static void _get_rows_data(const us_frame_s *frame, uint begin, uint end, uz *offset, uz *size);
+
+
+us_cpu_incremental_s *us_cpu_incremental_init(void) {
+	us_cpu_incremental_s *inc;
+	US_CALLOC(inc, 1);
+	inc->enc = us_cpu_encoder_init();
+	inc->enc->restart_rows = 1;
+	inc->prev = us_frame_init();
+	inc->jpeg = us_frame_init();
+	inc->next = us_frame_init();
+	inc->part = us_frame_init();
+	return inc;
+}
+
+void us_cpu_incremental_destroy(us_cpu_incremental_s *inc) {
+	US_DELETE(inc->next_segs, free);
+	US_DELETE(inc->segs, free);
+	us_frame_destroy(inc->part);
+	us_frame_destroy(inc->next);
+	us_frame_destroy(inc->jpeg);
+	us_frame_destroy(inc->prev);
+	us_cpu_encoder_destroy(inc->enc);
+	free(inc);
+}
+
+void us_cpu_incremental_compress(us_cpu_incremental_s *inc, const us_frame_s *src, us_frame_s *dest, uint quality) {
+	us_frame_encoding_begin(src, dest, V4L2_PIX_FMT_JPEG);
+
+	const uint n_rows = (src->height + US_CPU_ENCODER_MCU_SIZE - 1) / US_CPU_ENCODER_MCU_SIZE;
+	if (
+		!inc->valid
+		|| inc->quality != quality
+		|| inc->prev->width != src->width
+		|| inc->prev->height != src->height
+		|| inc->prev->format != src->format
+		|| inc->prev->stride != src->stride
+	) {
+		if (inc->n_rows < n_rows) {
+			US_DELETE(inc->segs, free);
+			US_DELETE(inc->next_segs, free);
+			US_CALLOC(inc->segs, n_rows * 2);
+			US_CALLOC(inc->next_segs, n_rows * 2);
+			inc->n_rows = n_rows;
+		}
+		inc->valid = false;
+		inc->quality = quality;
+	}
+
+	inc->next->used = 0;
+	if (inc->valid) {
+		// The headers are the same while the geometry and the quality are the same
+		us_frame_append_data(inc->next, inc->jpeg->data, inc->segs[0]);
+	}
+
+	inc->n_changed = 0;
+	for (uint row = 0; row < n_rows;) {
+		if (inc->valid && !_is_row_changed(inc, src, row)) {
+			const uz begin = inc->segs[row * 2];
+			_append_row(inc, row, inc->jpeg->data + begin, inc->segs[row * 2 + 1] - begin);
+			++row;
+			continue;
+		}
+
+		// The neighbouring changed rows are encoded at once
+		uint end = row + 1;
+		while (end < n_rows && (!inc->valid || _is_row_changed(inc, src, end))) {
+			++end;
+		}
+		_encode_rows(inc, src, row, end);
+		if (inc->valid) {
+			// Only the changed rows are copied for the next comparison,
+			// the rows below are still compared with the previous frame.
+			uz offset;
+			uz size;
+			_get_rows_data(src, row, end, &offset, &size);
+			memcpy(inc->prev->data + offset, src->data + offset, size);
+		}
+		inc->n_changed += end - row;
+		row = end;
+	}
+
+	const u8 eoi[2] = {0xFF, US_JPEG_MARKER_EOI};
+	us_frame_append_data(inc->next, eoi, 2);
+
+	if (!inc->valid) {
+		us_frame_copy(src, inc->prev);
+		inc->valid = true;
+	}
+
+	// The assembled JPEG becomes the cache for the next frame
+	us_frame_s *const jpeg = inc->jpeg;
+	inc->jpeg = inc->next;
+	inc->next = jpeg;
+	uz *const segs = inc->segs;
+	inc->segs = inc->next_segs;
+	inc->next_segs = segs;
+
+	us_frame_append_data(dest, inc->jpeg->data, inc->jpeg->used);
+	us_frame_encoding_end(dest);
+}
+
+static bool _is_row_changed(const us_cpu_incremental_s *inc, const us_frame_s *src, uint row) {
+	// memcmp() is vectorized by libc and stops on the first difference
+	const uz line_size = us_frame_get_line_size(src);
+	const uz line_bytes = line_size - us_frame_get_padding(src);
+	const uint y = row * US_CPU_ENCODER_MCU_SIZE;
+	const uint y_end = US_MIN(y + US_CPU_ENCODER_MCU_SIZE, src->height);
+	for (uz offset = y * line_size; offset < y_end * line_size; offset += line_size) {
+		if (memcmp(src->data + offset, inc->prev->data + offset, line_bytes)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void _encode_rows(us_cpu_incremental_s *inc, const us_frame_s *src, uint begin, uint end) {
+	// The rows are a view to the source frame without copying
+	us_frame_s rows = {0};
+	US_FRAME_COPY_META(src, &rows);
+	uz offset;
+	_get_rows_data(src, begin, end, &offset, &rows.used);
+	rows.data = src->data + offset;
+	rows.height = US_MIN(end * US_CPU_ENCODER_MCU_SIZE, src->height) - begin * US_CPU_ENCODER_MCU_SIZE;
+
+	us_cpu_encoder_compress(inc->enc, &rows, inc->part, inc->quality);
+
+	uz scan_begin;
+	assert(!us_cpu_encoder_find_scan(inc->part, NULL, &scan_begin));
+	if (!inc->valid) {
+		// Without the cache all rows are encoded at once, so the headers are for the full frame
+		assert(begin == 0 && end * US_CPU_ENCODER_MCU_SIZE >= src->height);
+		us_frame_append_data(inc->next, inc->part->data, scan_begin);
+	}
+
+	// Splits the entropy-coded data by RSTn, there is one per row
+	const u8 *ptr = inc->part->data + scan_begin;
+	const u8 *const data_end = inc->part->data + inc->part->used - 2; // Before EOI
+	for (uint row = begin; row < end; ++row) {
+		const u8 *marker = data_end;
+		if (row + 1 < end) {
+			for (
+				const u8 *find = ptr;
+				find + 1 < data_end && (find = memchr(find, 0xFF, data_end - find - 1)) != NULL;
+				find += 2
+			) {
+				if ((find[1] & 0xF8) == US_JPEG_MARKER_RST0) {
+					marker = find;
+					break;
+				}
+			}
+			assert(marker < data_end);
+		}
+		_append_row(inc, row, ptr, marker - ptr);
+		ptr = marker + 2;
+	}
+}
+
+static void _append_row(us_cpu_incremental_s *inc, uint row, const u8 *data, uz size) {
+	if (row > 0) {
+		const u8 rst[2] = {0xFF, US_JPEG_MARKER_RST0 + ((row - 1) & 7)};
+		us_frame_append_data(inc->next, rst, 2);
+	}
+	inc->next_segs[row * 2] = inc->next->used;
+	us_frame_append_data(inc->next, data, size);
+	inc->next_segs[row * 2 + 1] = inc->next->used;
+}
+
+static void _get_rows_data(const us_frame_s *frame, uint begin, uint end, uz *offset, uz *size) {
+	const uz line_size = us_frame_get_line_size(frame);
+	*offset = begin * US_CPU_ENCODER_MCU_SIZE * line_size;
+	*size = US_MIN(end * US_CPU_ENCODER_MCU_SIZE, frame->height) * line_size - *offset;
+	*size = US_MIN(*size, frame->used - *offset); // The last line may have no padding
+}
@@ -0,0 +1,53 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include "../../../libs/types.h"
+#include "../../../libs/frame.h"
+
+#include "encoder.h"
+
+
+typedef struct {
+	us_cpu_encoder_s	*enc;
+
+	us_frame_s	*prev; // The raw frame of the cached JPEG
+	us_frame_s	*jpeg; // The cached JPEG with a restart interval per MCU row
+	uz			*segs; // The begin and the end of every row in the cached JPEG
+	bool		valid;
+	uint		quality;
+
+	us_frame_s	*next; // The JPEG being assembled
+	uz			*next_segs;
+	us_frame_s	*part; // The JPEG of the changed rows
+	uint		n_rows; // The capacity of the segments arrays
+
+	uint		n_changed; // The rows which were re-encoded for the last frame
+} us_cpu_incremental_s;
+
+
+us_cpu_incremental_s *us_cpu_incremental_init(void);
+void us_cpu_incremental_destroy(us_cpu_incremental_s *inc);
+
+void us_cpu_incremental_compress(us_cpu_incremental_s *inc, const us_frame_s *src, us_frame_s *dest, uint quality);
@@ -0,0 +1,241 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "sliced.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include <pthread.h>
+#include <linux/videodev2.h>
+
+#include "../../../libs/types.h"
+#include "../../../libs/tools.h"
+#include "../../../libs/threading.h"
+#include "../../../libs/frame.h"
+
+#include "encoder.h"
+
+
+// The frame is split to the stripes by the MCU rows, so every stripe can be encoded
+// by a separate libjpeg instance as a standalone JPEG. All stripes have the same tables
+// and the restart interval is a divisor of the stripe height, so the DC predictors
+// are reset at the stripe boundaries. The entropy-coded segments of the stripes
+// are stitched to one baseline JPEG with the RST markers between them.
+
+#define _MAX_RESTART	((uint)65535) // DRI is 16-bit
+
+
+static void *_slice_thread(void *v_slice);
+static void _slice_encode(us_cpu_slice_s *slice);
+
+static uint _get_restart_rows(uint stripe_rows, uint mcus_per_row);
+static void _renumber_restarts(u8 *data, uz size, uint offset);
+
+
+us_cpu_sliced_encoder_s *us_cpu_sliced_encoder_init(uint n_slices) {
+	assert(n_slices > 0);
+
+	us_cpu_sliced_encoder_s *sliced;
+	US_CALLOC(sliced, 1);
+	sliced->n_slices = n_slices;
+	US_MUTEX_INIT(sliced->mutex);
+	US_COND_INIT(sliced->job_cond);
+	US_COND_INIT(sliced->done_cond);
+
+	US_CALLOC(sliced->slices, n_slices);
+	for (uint number = 0; number < n_slices; ++number) {
+		us_cpu_slice_s *const slice = &sliced->slices[number];
+		slice->sliced = sliced;
+		slice->number = number;
+		slice->enc = us_cpu_encoder_init();
+		slice->dest = us_frame_init();
+		if (number > 0) {
+			US_THREAD_CREATE(slice->tid, _slice_thread, (void*)slice);
+		}
+	}
+	return sliced;
+}
+
+void us_cpu_sliced_encoder_destroy(us_cpu_sliced_encoder_s *sliced) {
+	US_MUTEX_LOCK(sliced->mutex);
+	sliced->stop = true;
+	US_COND_BROADCAST(sliced->job_cond);
+	US_MUTEX_UNLOCK(sliced->mutex);
+
+	for (uint number = 0; number < sliced->n_slices; ++number) {
+		us_cpu_slice_s *const slice = &sliced->slices[number];
+		if (number > 0) {
+			US_THREAD_JOIN(slice->tid);
+		}
+		us_frame_destroy(slice->dest);
+		us_cpu_encoder_destroy(slice->enc);
+	}
+	free(sliced->slices);
+
+	US_COND_DESTROY(sliced->done_cond);
+	US_COND_DESTROY(sliced->job_cond);
+	US_MUTEX_DESTROY(sliced->mutex);
+	free(sliced);
+}
+
+void us_cpu_sliced_encoder_compress(us_cpu_sliced_encoder_s *sliced, const us_frame_s *src, us_frame_s *dest, uint quality) {
+	const uint mcu_rows = US_MAX((src->height + US_CPU_ENCODER_MCU_SIZE - 1) / US_CPU_ENCODER_MCU_SIZE, 1u);
+	const uint mcus_per_row = (src->width + US_CPU_ENCODER_MCU_SIZE - 1) / US_CPU_ENCODER_MCU_SIZE;
+	const uint stripe_rows = (mcu_rows + sliced->n_slices - 1) / sliced->n_slices;
+	const uint n_stripes = (mcu_rows + stripe_rows - 1) / stripe_rows;
+	const uint restart_rows = _get_restart_rows(stripe_rows, mcus_per_row);
+
+	us_frame_encoding_begin(src, dest, V4L2_PIX_FMT_JPEG);
+
+	US_MUTEX_LOCK(sliced->mutex);
+	sliced->src = src;
+	sliced->quality = quality;
+	sliced->n_stripes = n_stripes;
+	sliced->stripe_rows = stripe_rows;
+	for (uint number = 0; number < sliced->n_slices; ++number) {
+		sliced->slices[number].enc->restart_rows = restart_rows;
+	}
+	sliced->n_pending = sliced->n_slices - 1;
+	++sliced->job_id;
+	US_COND_BROADCAST(sliced->job_cond);
+	US_MUTEX_UNLOCK(sliced->mutex);
+
+	_slice_encode(&sliced->slices[0]);
+
+	US_MUTEX_LOCK(sliced->mutex);
+	US_COND_WAIT_FOR(sliced->n_pending == 0, sliced->done_cond, sliced->mutex);
+	US_MUTEX_UNLOCK(sliced->mutex);
+
+	// The headers of the first stripe are used for the whole image
+	const us_frame_s *const first = sliced->slices[0].dest;
+	uz sof_height = 0;
+	uz scan_begin;
+	assert(!us_cpu_encoder_find_scan(first, &sof_height, &scan_begin));
+	assert(sof_height > 0);
+
+	uz size = 0;
+	for (uint number = 0; number < n_stripes; ++number) {
+		size += sliced->slices[number].dest->used;
+	}
+	us_frame_realloc_data(dest, size);
+
+	us_frame_append_data(dest, first->data, scan_begin);
+	dest->data[sof_height] = (src->height >> 8) & 0xFF;
+	dest->data[sof_height + 1] = src->height & 0xFF;
+
+	uint n_restarts = 0; // Before the current stripe
+	for (uint number = 0; number < n_stripes; ++number) {
+		us_cpu_slice_s *const slice = &sliced->slices[number];
+		uz begin;
+		assert(!us_cpu_encoder_find_scan(slice->dest, NULL, &begin));
+		const uz end = slice->dest->used - 2; // Before EOI
+		if (number > 0) {
+			const u8 rst[2] = {0xFF, US_JPEG_MARKER_RST0 + ((n_restarts - 1) & 7)};
+			us_frame_append_data(dest, rst, 2);
+		}
+		if (restart_rows < stripe_rows) {
+			// There are the markers inside the stripe
+			_renumber_restarts(slice->dest->data + begin, end - begin, n_restarts);
+		}
+		us_frame_append_data(dest, slice->dest->data + begin, end - begin);
+
+		const uint rows = US_MIN(stripe_rows, mcu_rows - number * stripe_rows);
+		n_restarts += (rows + restart_rows - 1) / restart_rows;
+	}
+	us_frame_append_data(dest, first->data + first->used - 2, 2); // EOI
+
+	us_frame_encoding_end(dest);
+}
+
+static void *_slice_thread(void *v_slice) {
+	us_cpu_slice_s *const slice = v_slice;
+	us_cpu_sliced_encoder_s *const sliced = slice->sliced;
+
+	US_THREAD_SETTLE("jslice-%u", slice->number);
+
+	while (true) {
+		US_MUTEX_LOCK(sliced->mutex);
+		US_COND_WAIT_FOR(sliced->stop || sliced->job_id != slice->job_id, sliced->job_cond, sliced->mutex);
+		const bool stop = sliced->stop;
+		slice->job_id = sliced->job_id;
+		US_MUTEX_UNLOCK(sliced->mutex);
+		if (stop) {
+			break;
+		}
+
+		_slice_encode(slice);
+
+		US_MUTEX_LOCK(sliced->mutex);
+		if (--sliced->n_pending == 0) {
+			US_COND_SIGNAL(sliced->done_cond);
+		}
+		US_MUTEX_UNLOCK(sliced->mutex);
+	}
+	return NULL;
+}
+
+static void _slice_encode(us_cpu_slice_s *slice) {
+	us_cpu_sliced_encoder_s *const sliced = slice->sliced;
+	const us_frame_s *const src = sliced->src;
+	if (slice->number >= sliced->n_stripes) {
+		return; // The frame is too small for all slices
+	}
+
+	// The stripe is a view to the source frame without copying
+	const uint y = slice->number * sliced->stripe_rows * US_CPU_ENCODER_MCU_SIZE;
+	const uz line_size = us_frame_get_line_size(src);
+	us_frame_s stripe = {0};
+	US_FRAME_COPY_META(src, &stripe);
+	stripe.data = src->data + y * line_size;
+	stripe.height = US_MIN(sliced->stripe_rows * US_CPU_ENCODER_MCU_SIZE, src->height - y);
+	stripe.used = stripe.height * line_size;
+
+	us_cpu_encoder_compress(slice->enc, &stripe, slice->dest, sliced->quality);
+}
+
+static uint _get_restart_rows(uint stripe_rows, uint mcus_per_row) {
+	// The largest divisor of the stripe which fits to DRI, usually the stripe itself
+	for (uint rows = stripe_rows; rows > 1; --rows) {
+		if (stripe_rows % rows == 0 && rows * mcus_per_row <= _MAX_RESTART) {
+			return rows;
+		}
+	}
+	return 1;
+}
+
+static void _renumber_restarts(u8 *data, uz size, uint offset) {
+	// libjpeg numbers RSTn from zero for each stripe
+	if (offset % 8 == 0) {
+		return;
+	}
+	const u8 *const end = data + size;
+	u8 *ptr = data;
+	while (ptr + 1 < end && (ptr = memchr(ptr, 0xFF, end - ptr - 1)) != NULL) {
+		if ((ptr[1] & 0xF8) == US_JPEG_MARKER_RST0) {
+			ptr[1] = US_JPEG_MARKER_RST0 + ((ptr[1] - US_JPEG_MARKER_RST0 + offset) & 7);
+		}
+		ptr += 2; // Skips the stuffed zero or the marker
+	}
+}
@@ -0,0 +1,65 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include <pthread.h>
+
+#include "../../../libs/types.h"
+#include "../../../libs/frame.h"
+
+#include "encoder.h"
+
+
+typedef struct {
+	struct us_cpu_sliced_encoder_sx *sliced;
+	uint				number;
+	pthread_t			tid;
+	uint				job_id; // The last job taken by the thread
+
+	us_cpu_encoder_s	*enc;
+	us_frame_s			*dest; // The stripe as a standalone JPEG
+} us_cpu_slice_s;
+
+typedef struct us_cpu_sliced_encoder_sx {
+	uint			n_slices;
+	us_cpu_slice_s	*slices; // The first one is encoded by the caller
+
+	pthread_mutex_t	mutex;
+	pthread_cond_t	job_cond;
+	pthread_cond_t	done_cond;
+	uint			job_id;
+	uint			n_pending;
+	bool			stop;
+
+	const us_frame_s	*src;
+	uint				quality;
+	uint				n_stripes;
+	uint				stripe_rows; // MCU rows per stripe, the last one may be shorter
+} us_cpu_sliced_encoder_s;
+
+
+us_cpu_sliced_encoder_s *us_cpu_sliced_encoder_init(uint n_slices);
+void us_cpu_sliced_encoder_destroy(us_cpu_sliced_encoder_s *sliced);
+
+void us_cpu_sliced_encoder_compress(us_cpu_sliced_encoder_s *sliced, const us_frame_s *src, us_frame_s *dest, uint quality);
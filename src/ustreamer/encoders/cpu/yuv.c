@@ -0,0 +1,220 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "yuv.h"
+
+#include <assert.h>
+
+#include <linux/videodev2.h>
+
+#if defined(__SSE2__)
+#	include <immintrin.h>
+#elif defined(__ARM_NEON)
+#	include <arm_neon.h>
+#endif
+
+#include "../../../libs/types.h"
+
+
+// Every splitter is specialized for the byte offsets of Y0, U, Y1 and V
+// in the 4-byte macropixel, so there are no per-pixel format checks.
+// See also: https://www.kernel.org/doc/html/v4.8/media/uapi/v4l/pixfmt-uyvy.html
+
+#define _INLINE inline __attribute__((always_inline))
+
+
+static _INLINE void _split_scalar(
+	const u8 *src_a, const u8 *src_b,
+	u8 *y_a, u8 *y_b, u8 *cb, u8 *cr, uint width,
+	uint y0, uint u, uint y1, uint v) {
+
+	for (uint x = 0; x < width; x += 2) {
+		y_a[x] = src_a[y0];
+		y_b[x] = src_b[y0];
+		if (x + 1 < width) {
+			y_a[x + 1] = src_a[y1];
+			y_b[x + 1] = src_b[y1];
+		}
+		*cb++ = (src_a[u] + src_b[u] + 1) >> 1;
+		*cr++ = (src_a[v] + src_b[v] + 1) >> 1;
+		src_a += 4;
+		src_b += 4;
+	}
+}
+
+#if defined(__SSE2__)
+static _INLINE void _split_sse2(
+	const u8 *src_a, const u8 *src_b,
+	u8 *y_a, u8 *y_b, u8 *cb, u8 *cr, uint width,
+	uint y0, uint u, uint y1, uint v) {
+
+	// The luma is in the even bytes for YUYV/YVYU and in the odd ones for UYVY,
+	// the first chroma byte is U for YUYV/UYVY and V for YVYU.
+	const bool y_odd = (y0 & 1);
+	const bool u_first = (u < v);
+	const __m128i low = _mm_set1_epi16(0x00FF);
+	const __m128i zero = _mm_setzero_si128();
+
+#	define LUMA(x_v)	(y_odd ? _mm_srli_epi16((x_v), 8) : _mm_and_si128((x_v), low))
+#	define CHROMA(x_v)	(y_odd ? _mm_and_si128((x_v), low) : _mm_srli_epi16((x_v), 8))
+
+	uint x = 0;
+	for (; x + 16 <= width; x += 16) {
+		const __m128i a0 = _mm_loadu_si128((const __m128i*)src_a);
+		const __m128i a1 = _mm_loadu_si128((const __m128i*)(src_a + 16));
+		const __m128i b0 = _mm_loadu_si128((const __m128i*)src_b);
+		const __m128i b1 = _mm_loadu_si128((const __m128i*)(src_b + 16));
+
+		_mm_storeu_si128((__m128i*)(y_a + x), _mm_packus_epi16(LUMA(a0), LUMA(a1)));
+		_mm_storeu_si128((__m128i*)(y_b + x), _mm_packus_epi16(LUMA(b0), LUMA(b1)));
+
+		// 8 chroma pairs of both rows, averaged with rounding up like (a + b + 1) >> 1
+		const __m128i c = _mm_avg_epu8(
+			_mm_packus_epi16(CHROMA(a0), CHROMA(a1)),
+			_mm_packus_epi16(CHROMA(b0), CHROMA(b1))
+		);
+		const __m128i first = _mm_packus_epi16(_mm_and_si128(c, low), zero);
+		const __m128i second = _mm_packus_epi16(_mm_srli_epi16(c, 8), zero);
+		_mm_storel_epi64((__m128i*)(cb + x / 2), (u_first ? first : second));
+		_mm_storel_epi64((__m128i*)(cr + x / 2), (u_first ? second : first));
+
+		src_a += 32;
+		src_b += 32;
+	}
+
+#	undef CHROMA
+#	undef LUMA
+
+	_split_scalar(src_a, src_b, y_a + x, y_b + x, cb + x / 2, cr + x / 2, width - x, y0, u, y1, v);
+}
+
+__attribute__((target("avx2")))
+static _INLINE void _split_avx2(
+	const u8 *src_a, const u8 *src_b,
+	u8 *y_a, u8 *y_b, u8 *cb, u8 *cr, uint width,
+	uint y0, uint u, uint y1, uint v) {
+
+	const bool y_odd = (y0 & 1);
+	const bool u_first = (u < v);
+	const __m256i low = _mm256_set1_epi16(0x00FF);
+	const __m256i zero = _mm256_setzero_si256();
+
+	// The packing works within the 128-bit lanes, so the qwords are reordered after it
+#	define PACK(x_a, x_b)	_mm256_permute4x64_epi64(_mm256_packus_epi16((x_a), (x_b)), 0xD8)
+#	define LUMA(x_v)		(y_odd ? _mm256_srli_epi16((x_v), 8) : _mm256_and_si256((x_v), low))
+#	define CHROMA(x_v)		(y_odd ? _mm256_and_si256((x_v), low) : _mm256_srli_epi16((x_v), 8))
+
+	uint x = 0;
+	for (; x + 32 <= width; x += 32) {
+		const __m256i a0 = _mm256_loadu_si256((const __m256i*)src_a);
+		const __m256i a1 = _mm256_loadu_si256((const __m256i*)(src_a + 32));
+		const __m256i b0 = _mm256_loadu_si256((const __m256i*)src_b);
+		const __m256i b1 = _mm256_loadu_si256((const __m256i*)(src_b + 32));
+
+		_mm256_storeu_si256((__m256i*)(y_a + x), PACK(LUMA(a0), LUMA(a1)));
+		_mm256_storeu_si256((__m256i*)(y_b + x), PACK(LUMA(b0), LUMA(b1)));
+
+		const __m256i c = _mm256_avg_epu8(PACK(CHROMA(a0), CHROMA(a1)), PACK(CHROMA(b0), CHROMA(b1)));
+		const __m128i first = _mm256_castsi256_si128(PACK(_mm256_and_si256(c, low), zero));
+		const __m128i second = _mm256_castsi256_si128(PACK(_mm256_srli_epi16(c, 8), zero));
+		_mm_storeu_si128((__m128i*)(cb + x / 2), (u_first ? first : second));
+		_mm_storeu_si128((__m128i*)(cr + x / 2), (u_first ? second : first));
+
+		src_a += 64;
+		src_b += 64;
+	}
+
+#	undef CHROMA
+#	undef LUMA
+#	undef PACK
+
+	_split_sse2(src_a, src_b, y_a + x, y_b + x, cb + x / 2, cr + x / 2, width - x, y0, u, y1, v);
+}
+
+#elif defined(__ARM_NEON)
+static _INLINE void _split_neon(
+	const u8 *src_a, const u8 *src_b,
+	u8 *y_a, u8 *y_b, u8 *cb, u8 *cr, uint width,
+	uint y0, uint u, uint y1, uint v) {
+
+	uint x = 0;
+	for (; x + 16 <= width; x += 16) {
+		// Deinterleaves 8 macropixels of each row to Y0, U, Y1 and V in the format order
+		const uint8x8x4_t a = vld4_u8(src_a);
+		const uint8x8x4_t b = vld4_u8(src_b);
+		const uint8x8x2_t ys_a = {{a.val[y0], a.val[y1]}};
+		const uint8x8x2_t ys_b = {{b.val[y0], b.val[y1]}};
+		vst2_u8(y_a + x, ys_a);
+		vst2_u8(y_b + x, ys_b);
+		vst1_u8(cb + x / 2, vrhadd_u8(a.val[u], b.val[u]));
+		vst1_u8(cr + x / 2, vrhadd_u8(a.val[v], b.val[v]));
+		src_a += 32;
+		src_b += 32;
+	}
+	_split_scalar(src_a, src_b, y_a + x, y_b + x, cb + x / 2, cr + x / 2, width - x, y0, u, y1, v);
+}
+#endif
+
+#define _DEFINE_SPLITTER_IMPL(x_name, x_impl, x_y0, x_u, x_y1, x_v) \
+	static void _split_##x_name( \
+		const u8 *src_a, const u8 *src_b, \
+		u8 *y_a, u8 *y_b, u8 *cb, u8 *cr, uint width) { \
+		x_impl(src_a, src_b, y_a, y_b, cb, cr, width, x_y0, x_u, x_y1, x_v); \
+	}
+
+#if defined(__SSE2__)
+// SSE2 is always available on x86-64, AVX2 is checked at runtime
+#	define _DEFINE_SPLITTER(x_name, x_y0, x_u, x_y1, x_v) \
+		_DEFINE_SPLITTER_IMPL(x_name, _split_sse2, x_y0, x_u, x_y1, x_v) \
+		__attribute__((target("avx2"))) \
+		_DEFINE_SPLITTER_IMPL(x_name##_avx2, _split_avx2, x_y0, x_u, x_y1, x_v)
+#	define _SELECT_SPLITTER(x_name) (__builtin_cpu_supports("avx2") ? _split_##x_name##_avx2 : _split_##x_name)
+#elif defined(__ARM_NEON)
+#	define _DEFINE_SPLITTER(x_name, x_y0, x_u, x_y1, x_v) \
+		_DEFINE_SPLITTER_IMPL(x_name, _split_neon, x_y0, x_u, x_y1, x_v)
+#	define _SELECT_SPLITTER(x_name) _split_##x_name
+#else
+#	define _DEFINE_SPLITTER(x_name, x_y0, x_u, x_y1, x_v) \
+		_DEFINE_SPLITTER_IMPL(x_name, _split_scalar, x_y0, x_u, x_y1, x_v)
+#	define _SELECT_SPLITTER(x_name) _split_##x_name
+#endif
+
+_DEFINE_SPLITTER(yuyv, 0, 1, 2, 3)
+_DEFINE_SPLITTER(yvyu, 0, 3, 2, 1)
+_DEFINE_SPLITTER(uyvy, 1, 0, 3, 2)
+
+#undef _DEFINE_SPLITTER
+#undef _DEFINE_SPLITTER_IMPL
+
+
+us_yuv_split_f us_yuv_get_splitter(uint format) {
+	switch (format) {
+		case V4L2_PIX_FMT_YUYV: return _SELECT_SPLITTER(yuyv);
+		case V4L2_PIX_FMT_YVYU: return _SELECT_SPLITTER(yvyu);
+		case V4L2_PIX_FMT_UYVY: return _SELECT_SPLITTER(uyvy);
+		default: assert(0 && "Unsupported pixel format");
+	}
+	return NULL; // Makes linter happy
+}
+
+#undef _SELECT_SPLITTER
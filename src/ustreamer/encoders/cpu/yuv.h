@@ -0,0 +1,37 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include "../../../libs/types.h"
+
+
+// Splits two rows of the packed 4:2:2 pixels (YUYV, YVYU or UYVY) to two rows
+// of the Y plane and one row of the Cb and Cr planes, vertically decimated to 4:2:0.
+// The planes are fed to libjpeg as raw data without any color conversion.
+typedef void (*us_yuv_split_f)(
+	const u8 *src_a, const u8 *src_b,
+	u8 *y_a, u8 *y_b, u8 *cb, u8 *cr, uint width);
+
+
+us_yuv_split_f us_yuv_get_splitter(uint format);
@@ -28,6 +28,7 @@
 #include <stdbool.h>
 #include <stdatomic.h>
 #include <string.h>
+#include <time.h>
 #include <inttypes.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -36,6 +37,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/eventfd.h>
 #include <netinet/tcp.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
@@ -58,8 +60,11 @@
 #include "../../libs/logging.h"
 #include "../../libs/process.h"
 #include "../../libs/frame.h"
+#include "../../libs/framepool.h"
 #include "../../libs/base64.h"
 #include "../../libs/list.h"
+#include "../../libs/ring.h"
+#include "../../libs/tracer.h"
 #include "../data/index_html.h"
 #include "../data/favicon_ico.h"
 #include "../encoder.h"
@@ -70,6 +75,8 @@
 
 #include "bev.h"
 #include "unix.h"
+#include "tcp.h"
+#include "ws.h"
 #include "uri.h"
 #include "mime.h"
 #include "static.h"
@@ -78,27 +85,72 @@
 #endif
 
 
-static int _http_preprocess_request(struct evhttp_request *request, us_server_s *server);
-
-static int _http_check_run_compat_action(struct evhttp_request *request, void *v_server);
+static void _thread_init(us_server_s *server, us_server_thread_s *thread, uint number);
+static void _thread_destroy(us_server_thread_s *thread);
+static void *_thread_loop(void *v_thread);
 
-static void _http_callback_root(struct evhttp_request *request, void *v_server);
-static void _http_callback_favicon(struct evhttp_request *request, void *v_server);
-static void _http_callback_static(struct evhttp_request *request, void *v_server);
-static void _http_callback_state(struct evhttp_request *request, void *v_server);
-static void _http_callback_snapshot(struct evhttp_request *request, void *v_server);
+static int _http_preprocess_request(struct evhttp_request *request, us_server_s *server);
 
-static void _http_callback_stream(struct evhttp_request *request, void *v_server);
+static int _http_check_run_compat_action(struct evhttp_request *request, void *v_thread);
+
+static void _http_callback_root(struct evhttp_request *request, void *v_thread);
+static void _http_callback_favicon(struct evhttp_request *request, void *v_thread);
+static void _http_callback_static(struct evhttp_request *request, void *v_thread);
+static void _http_static_cleanup(const void *data, size_t size, void *v_data);
+static void _http_callback_state(struct evhttp_request *request, void *v_thread);
+static void _http_callback_state_events(struct evhttp_request *request, void *v_thread);
+static void _http_callback_metrics(struct evhttp_request *request, void *v_thread);
+static void _http_callback_trace(struct evhttp_request *request, void *v_thread);
+static void _http_trace_timeout(int fd, short what, void *v_client);
+static void _http_trace_close(struct evhttp_connection *conn, void *v_client);
+static void _http_trace_remove(us_trace_client_s *client);
+static void _http_callback_state_events_error(struct bufferevent *buf_event, short what, void *v_ctx);
+static void _http_callback_snapshot(struct evhttp_request *request, void *v_thread);
+
+static void _http_callback_stream(struct evhttp_request *request, void *v_thread);
+static void _http_callback_ws(struct evhttp_request *request, void *v_thread);
+static void _http_add_stream_client(us_server_thread_s *thread, struct evhttp_request *request, char *ws_accept);
 static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_ctx);
+static void _http_stream_add_http(us_stream_client_s *client, struct evbuffer *buf, us_server_payload_s **chain, uint count);
+static void _http_stream_add_ws(us_stream_client_s *client, struct evbuffer *buf, us_server_payload_s **chain, uint count);
+static void _http_stream_client_setcb(us_stream_client_s *client, struct bufferevent *buf_event, bool write);
+static void _http_callback_ws_read(struct bufferevent *buf_event, void *v_ctx);
+static void _http_callback_ws_closed(struct bufferevent *buf_event, void *v_ctx);
 static void _http_callback_stream_error(struct bufferevent *buf_event, short what, void *v_ctx);
 
-static void _http_refresher(int fd, short event, void *v_server);
-static void _http_send_stream(us_server_s *server, bool stream_updated, bool frame_updated);
-static void _http_send_snapshot(us_server_s *server);
-
-static bool _expose_frame(us_server_s *server, const us_frame_s *frame);
+static void _http_exposer(int fd, short what, void *v_server);
+static void _http_repeater(int fd, short what, void *v_server);
+static void _http_refresher(int fd, short what, void *v_thread);
+static void _http_send_stream(us_server_thread_s *thread, bool stream_updated, bool frame_updated);
+static void _http_send_snapshot(us_server_thread_s *thread);
+static void _http_reply_snapshot(
+	us_server_thread_s *thread, struct evhttp_request *request,
+	const us_frame_s *frame, struct evbuffer *data, u64 payload_id,
+	uint width, uint height, uint quality);
+static void _http_get_snapshot_size(const us_frame_s *frame, uint *width, uint *height);
+static void _http_state_notifier(int fd, short what, void *v_thread);
+static void _http_notify_state(us_server_s *server);
+static void _http_send_state(us_server_thread_s *thread);
+
+static void _state_collect_source(us_server_thread_s *thread, us_server_state_s *state);
+static void _state_collect(us_server_thread_s *thread, us_server_state_s *state);
+static bool _state_render(struct evbuffer *buf, const us_server_state_s *prev, const us_server_state_s *state);
+static const us_server_state_client_s *_state_find_client(const us_server_state_s *state, u64 id);
+
+static void _expose(us_server_s *server, bool repeat);
+static bool _expose_frame(us_server_s *server, us_frame_s *frame);
+static void _expose_render_parts(us_server_exposed_s *ex);
+static void _view_sync(us_server_thread_s *thread, bool *stream_updated, bool *frame_updated);
+
+static us_server_payload_s *_payload_acquire(us_server_exposed_s *ex);
+static void _payload_install(us_server_exposed_s *ex, us_server_payload_s *payload);
+static void _payload_ref(us_server_payload_s *payload);
+static void _payload_unref(us_server_payload_s *payload);
+static void _payload_cleanup(const void *data, size_t size, void *v_payload);
+static void _payload_destroy(us_server_payload_s *payload);
 
 static const char *_http_get_header(struct evhttp_request *request, const char *key);
+static void _http_add_raw_cors(us_server_s *server, struct evhttp_request *request, struct evbuffer *buf);
 static char *_http_get_client_hostport(struct evhttp_request *request);
 
 
@@ -111,6 +163,15 @@ static char *_http_get_client_hostport(struct evhttp_request *request);
 #define _A_EVBUFFER_NEW(x_buf)						assert((x_buf = evbuffer_new()) != NULL)
 #define _A_EVBUFFER_ADD(x_buf, x_data, x_size)		assert(!evbuffer_add(x_buf, x_data, x_size))
 #define _A_EVBUFFER_ADD_PRINTF(x_buf, x_fmt, ...)	assert(evbuffer_add_printf(x_buf, x_fmt, ##__VA_ARGS__) >= 0)
+#define _A_EVBUFFER_ADD_BUFFER_REF(x_buf, x_ref)	assert(!evbuffer_add_buffer_reference(x_buf, x_ref))
+
+#define _MAX_FREE_PAYLOADS 4
+#define _MAX_GOP_FRAMES 300
+
+static const struct timeval _REPEAT_INTERVAL = {.tv_sec = 1};
+static const struct timeval _STATE_TICK_INTERVAL = {.tv_sec = 1};
+
+#define _BOUNDARY "boundarydonotcross"
 
 #define _A_ADD_HEADER(x_request, x_key, x_value) \
 		assert(!evhttp_add_header(evhttp_request_get_output_headers(x_request), x_key, x_value))
@@ -121,13 +182,16 @@ us_server_s *us_server_init(us_stream_s *stream) {
 	savetestfile = fopen("/tmp/test.mjpeg","w");
 	us_server_exposed_s *exposed;
 	US_CALLOC(exposed, 1);
-	exposed->frame = us_frame_init();
-	exposed->queued_fpsi = us_fpsi_init("MJPEG-QUEUED", false);
+	US_MUTEX_INIT(exposed->mutex);
+	US_MUTEX_INIT(exposed->pool_mutex);
 
 	us_server_runtime_s *run;
 	US_CALLOC(run, 1);
 	run->ext_fd = -1;
+	run->etag_seed = us_get_now_id();
+	run->thumbs = us_thumbs_init();
 	run->exposed = exposed;
+	US_MUTEX_INIT(run->clients_mutex);
 
 	us_server_s *server;
 	US_CALLOC(server, 1);
@@ -140,13 +204,11 @@ us_server_s *us_server_init(us_stream_s *stream) {
 	server->allow_origin = "";
 	server->instance_id = "";
 	server->timeout = 10;
+	server->threads = 1;
 	server->stream = stream;
 	server->run = run;
 
 	assert(!evthread_use_pthreads());
-	assert((run->base = event_base_new()) != NULL);
-	assert((run->http = evhttp_new(run->base)) != NULL);
-	evhttp_set_allowed_methods(run->http, EVHTTP_REQ_GET|EVHTTP_REQ_HEAD|EVHTTP_REQ_OPTIONS);
 	return server;
 }
 
@@ -154,34 +216,41 @@ void us_server_destroy(us_server_s *server) {
 	us_server_runtime_s *const run = server->run;
 
 	fclose(savetestfile);
-	if (run->refresher != NULL) {
-		event_del(run->refresher);
-		event_free(run->refresher);
-	}
 
-	evhttp_free(run->http);
+#	define DELETE_EVENT(x_ev) { \
+			if (x_ev != NULL) { \
+				event_del(x_ev); \
+				event_free(x_ev); \
+			} \
+		}
+	DELETE_EVENT(run->repeater);
+	DELETE_EVENT(run->exposer);
+#	undef DELETE_EVENT
+
+	for (uint number = 0; number < run->n_threads; ++number) {
+		_thread_destroy(&run->threads[number]);
+	}
+	US_DELETE(run->threads, free);
 	US_CLOSE_FD(run->ext_fd);
-	event_base_free(run->base);
 
-#	if LIBEVENT_VERSION_NUMBER >= 0x02010100
-	libevent_global_shutdown();
-#	endif
+	US_DELETE(run->auth_token, free);
 
-	US_LIST_ITERATE(run->snapshot_clients, client, { // cppcheck-suppress constStatement
-		free(client);
+	// Releasing the last reference returns the payload to the free list
+	US_DELETE(run->exposed->payload, _payload_unref);
+	US_LIST_ITERATE(run->exposed->free_payloads, payload, { // cppcheck-suppress constStatement
+		_payload_destroy(payload);
 	});
 
-	US_LIST_ITERATE(run->stream_clients, client, { // cppcheck-suppress constStatement
-		us_fpsi_destroy(client->fpsi);
-		free(client->key);
-		free(client->hostport);
-		free(client);
-	});
+	us_thumbs_destroy(run->thumbs);
+	US_DELETE(run->static_cache, us_static_cache_destroy);
 
-	US_DELETE(run->auth_token, free);
+#	if LIBEVENT_VERSION_NUMBER >= 0x02010100
+	libevent_global_shutdown();
+#	endif
 
-	us_fpsi_destroy(run->exposed->queued_fpsi);
-	us_frame_destroy(run->exposed->frame);
+	US_MUTEX_DESTROY(run->clients_mutex);
+	US_MUTEX_DESTROY(run->exposed->pool_mutex);
+	US_MUTEX_DESTROY(run->exposed->mutex);
 	free(run->exposed);
 	free(server->run);
 	free(server);
@@ -193,37 +262,39 @@ int us_server_listen(us_server_s *server) {
 	us_stream_s *const stream = server->stream;
 
 	{
-		if (server->static_path[0] != '\0') {
-			_LOG_INFO("Enabling the file server: %s", server->static_path);
-			evhttp_set_gencb(run->http, _http_callback_static, (void*)server);
-		} else {
-			assert(!evhttp_set_cb(run->http, "/", _http_callback_root, (void*)server));
-			assert(!evhttp_set_cb(run->http, "/favicon.ico", _http_callback_favicon, (void*)server));
-		}
-		assert(!evhttp_set_cb(run->http, "/state", _http_callback_state, (void*)server));
-		assert(!evhttp_set_cb(run->http, "/snapshot", _http_callback_snapshot, (void*)server));
-		assert(!evhttp_set_cb(run->http, "/stream", _http_callback_stream, (void*)server));
+		us_server_payload_s *const payload = _payload_acquire(ex);
+		payload->frame = us_frame_pool_get(stream->run->http->frames);
+		us_frame_copy(stream->run->blank->jpeg, payload->frame);
+		_payload_install(ex, payload);
+		_expose_render_parts(ex);
 	}
-
-	us_frame_copy(stream->run->blank->jpeg, ex->frame);
 	ex->notify_last_width = ex->frame->width;
 	ex->notify_last_height = ex->frame->height;
 
-	{
-		struct timeval interval = {0};
-		if (stream->cap->desired_fps > 0) {
-			interval.tv_usec = 1000000 / (stream->cap->desired_fps * 2);
-		} else {
-			interval.tv_usec = 16000; // ~60fps
-		}
-		// 这里根据desired_fps设置了一个定时器,如果目标帧率是60,那一秒刷新时间是16ms左右,如果目标帧率是30,那么刷新时间是32ms左右,以此类推.
-		// 负责push输出的就是_http_refresher
-		assert((run->refresher = event_new(run->base, -1, EV_PERSIST, _http_refresher, server)) != NULL);
-		assert(!event_add(run->refresher, &interval));
+	if (stream->low_memory) {
+		// Allocated before the options were parsed
+		us_thumbs_trim(run->thumbs);
 	}
 
-	// 设置HTTP超时时间
-	evhttp_set_timeout(run->http, server->timeout);
+	if (server->static_path[0] != '\0') {
+		run->static_cache = us_static_cache_init(server->static_path);
+	}
+
+	// Each thread has its own event loop, evhttp, clients and refresher.
+	// The first one also consumes the JPEG ring and updates the exposed frame.
+	run->n_threads = server->threads;
+	US_CALLOC(run->threads, run->n_threads);
+	for (uint number = 0; number < run->n_threads; ++number) {
+		_thread_init(server, &run->threads[number], number);
+	}
+	us_server_thread_s *const first = &run->threads[0];
+
+	// No polling: the stream signals the eventfd as soon as a frame is put into the ring
+	assert((run->exposer = event_new(
+		first->base, stream->run->http->jpeg_ring_fd, EV_READ|EV_PERSIST, _http_exposer, server)) != NULL);
+	assert(!event_add(run->exposer, NULL));
+	assert((run->repeater = evtimer_new(first->base, _http_repeater, server)) != NULL);
+	assert(!event_add(run->repeater, &_REPEAT_INTERVAL));
 
 	if (server->user[0] != '\0') {
 		char *encoded_token = NULL;
@@ -242,7 +313,7 @@ int us_server_listen(us_server_s *server) {
 	if (server->unix_path[0] != '\0') {
 		_LOG_DEBUG("Binding server to UNIX socket '%s' ...", server->unix_path);
 		if ((run->ext_fd = us_evhttp_bind_unix(
-			run->http,
+			first->http,
 			server->unix_path,
 			server->unix_rm,
 			server->unix_mode)) < 0
@@ -254,32 +325,174 @@ int us_server_listen(us_server_s *server) {
 #	ifdef WITH_SYSTEMD
 	} else if (server->systemd) {
 		_LOG_DEBUG("Binding HTTP to systemd socket ...");
-		if ((run->ext_fd = us_evhttp_bind_systemd(run->http)) < 0) {
+		if ((run->ext_fd = us_evhttp_bind_systemd(first->http)) < 0) {
 			return -1;
 		}
 		_LOG_INFO("Listening systemd socket ...");
 #	endif
 
-	} else {
+	} else if (run->n_threads == 1) {
 		_LOG_DEBUG("Binding HTTP to [%s]:%u ...", server->host, server->port);
-		if (evhttp_bind_socket(run->http, server->host, server->port) < 0) {
+		if (evhttp_bind_socket(first->http, server->host, server->port) < 0) {
 			_LOG_PERROR("Can't bind HTTP on [%s]:%u", server->host, server->port)
 			return -1;
 		}
 		_LOG_INFO("Listening HTTP on [%s]:%u", server->host, server->port);
+
+	} else {
+		_LOG_DEBUG("Binding HTTP to [%s]:%u with SO_REUSEPORT ...", server->host, server->port);
+		for (uint number = 0; number < run->n_threads; ++number) {
+			us_server_thread_s *const thread = &run->threads[number];
+			if (us_evhttp_bind_reuseport(thread->http, thread->base, server->host, server->port) < 0) {
+				return -1;
+			}
+		}
+		_LOG_INFO("Listening HTTP on [%s]:%u", server->host, server->port);
+	}
+
+	if (run->ext_fd >= 0) {
+		// There is only one UNIX or systemd socket, so all threads accept from it
+		for (uint number = 1; number < run->n_threads; ++number) {
+			const evutil_socket_t fd = dup(run->ext_fd);
+			if (fd < 0) {
+				_LOG_PERROR("Can't dup() the listening socket for the thread %u", number);
+				return -1;
+			}
+			if (evhttp_accept_socket(run->threads[number].http, fd) < 0) {
+				_LOG_PERROR("Can't evhttp_accept_socket() for the thread %u", number);
+				close(fd);
+				return -1;
+			}
+		}
 	}
 
+	if (run->n_threads > 1) {
+		_LOG_INFO("Using %u HTTP threads", run->n_threads);
+	}
 	return 0;
 }
 
 void us_server_loop(us_server_s *server) {
+	us_server_runtime_s *const run = server->run;
+
+	for (uint number = 1; number < run->n_threads; ++number) {
+		US_THREAD_CREATE(run->threads[number].tid, _thread_loop, &run->threads[number]);
+	}
+
 	_LOG_INFO("Starting eventloop ...");
-	event_base_dispatch(server->run->base);
+	event_base_dispatch(run->threads[0].base);
 	_LOG_INFO("Eventloop stopped");
+
+	for (uint number = 1; number < run->n_threads; ++number) {
+		US_THREAD_JOIN(run->threads[number].tid);
+	}
 }
 
 void us_server_loop_break(us_server_s *server) {
-	event_base_loopbreak(server->run->base);
+	us_server_runtime_s *const run = server->run;
+	for (uint number = 0; number < run->n_threads; ++number) {
+		event_base_loopbreak(run->threads[number].base);
+	}
+}
+
+static void _thread_init(us_server_s *server, us_server_thread_s *thread, uint number) {
+	thread->server = server;
+	thread->number = number;
+
+	assert((thread->base = event_base_new()) != NULL);
+	assert((thread->http = evhttp_new(thread->base)) != NULL);
+	_A_EVBUFFER_NEW(thread->part_buf);
+	evhttp_set_allowed_methods(thread->http, EVHTTP_REQ_GET|EVHTTP_REQ_HEAD|EVHTTP_REQ_OPTIONS);
+
+	if (number == 0) {
+		thread->queued_fpsi = us_fpsi_init("MJPEG-QUEUED", false);
+	} else {
+		char *name;
+		US_ASPRINTF(name, "MJPEG-QUEUED-%u", number);
+		thread->queued_fpsi = us_fpsi_init(name, false);
+		free(name);
+	}
+
+	{
+		if (server->static_path[0] != '\0') {
+			if (number == 0) {
+				_LOG_INFO("Enabling the file server: %s", server->static_path);
+			}
+			evhttp_set_gencb(thread->http, _http_callback_static, (void*)thread);
+		} else {
+			assert(!evhttp_set_cb(thread->http, "/", _http_callback_root, (void*)thread));
+			assert(!evhttp_set_cb(thread->http, "/favicon.ico", _http_callback_favicon, (void*)thread));
+		}
+		assert(!evhttp_set_cb(thread->http, "/state", _http_callback_state, (void*)thread));
+		assert(!evhttp_set_cb(thread->http, "/state/events", _http_callback_state_events, (void*)thread));
+		assert(!evhttp_set_cb(thread->http, "/metrics", _http_callback_metrics, (void*)thread));
+		assert(!evhttp_set_cb(thread->http, "/trace", _http_callback_trace, (void*)thread));
+		assert(!evhttp_set_cb(thread->http, "/snapshot", _http_callback_snapshot, (void*)thread));
+		assert(!evhttp_set_cb(thread->http, "/stream", _http_callback_stream, (void*)thread));
+		assert(!evhttp_set_cb(thread->http, "/ws", _http_callback_ws, (void*)thread));
+	}
+
+	// 负责push输出的就是_http_refresher, 它不是定时器, 而是在暴露新帧之后由_expose()激活
+	assert((thread->refresher = event_new(thread->base, -1, 0, _http_refresher, thread)) != NULL);
+	assert((thread->state_notifier = event_new(thread->base, -1, 0, _http_state_notifier, thread)) != NULL);
+	assert((thread->state_ticker = event_new(thread->base, -1, EV_PERSIST, _http_state_notifier, thread)) != NULL);
+
+	// 设置HTTP超时时间
+	evhttp_set_timeout(thread->http, server->timeout);
+}
+
+static void _thread_destroy(us_server_thread_s *thread) {
+#	define DELETE_EVENT(x_event) { \
+			if (x_event != NULL) { \
+				event_del(x_event); \
+				event_free(x_event); \
+			} \
+		}
+	DELETE_EVENT(thread->state_ticker);
+	DELETE_EVENT(thread->state_notifier);
+	DELETE_EVENT(thread->refresher);
+	US_LIST_ITERATE(thread->trace_clients, client, { // cppcheck-suppress constStatement
+		// The requests are freed with the connections by evhttp_free()
+		us_tracer_stop();
+		_http_trace_remove(client);
+	});
+#	undef DELETE_EVENT
+
+	// Frees the client connections and drops their references to the payloads
+	evhttp_free(thread->http);
+	evbuffer_free(thread->part_buf);
+	US_DELETE(thread->view.payload, _payload_unref);
+	event_base_free(thread->base);
+
+	US_LIST_ITERATE(thread->snapshot_clients, client, { // cppcheck-suppress constStatement
+		free(client);
+	});
+
+	US_LIST_ITERATE(thread->state_clients, client, { // cppcheck-suppress constStatement
+		free(client->hostport);
+		free(client);
+	});
+	free(thread->state.clients_stat);
+
+	US_LIST_ITERATE(thread->stream_clients, client, { // cppcheck-suppress constStatement
+		us_fpsi_destroy(client->fpsi);
+		free(client->ws_accept);
+		free(client->key);
+		free(client->hostport);
+		free(client);
+	});
+
+	us_fpsi_destroy(thread->queued_fpsi);
+}
+
+static void *_thread_loop(void *v_thread) {
+	us_server_thread_s *const thread = v_thread;
+	US_THREAD_RENAME("http-%u", thread->number);
+
+	_LOG_INFO("Starting eventloop %u ...", thread->number);
+	event_base_dispatch(thread->base);
+	_LOG_INFO("Eventloop %u stopped", thread->number);
+	return NULL;
 }
 
 static int _http_preprocess_request(struct evhttp_request *request, us_server_s *server) {
@@ -328,7 +541,7 @@ static int _http_preprocess_request(struct evhttp_request *request, us_server_s
 		} \
 	}
 
-static int _http_check_run_compat_action(struct evhttp_request *request, void *v_server) {
+static int _http_check_run_compat_action(struct evhttp_request *request, void *v_thread) {
 	// MJPG-Streamer compatibility layer
 
 	int retval = -1;
@@ -338,10 +551,10 @@ static int _http_check_run_compat_action(struct evhttp_request *request, void *v
 	const char *const action = evhttp_find_header(&params, "action");
 
 	if (action && !strcmp(action, "snapshot")) {
-		_http_callback_snapshot(request, v_server);
+		_http_callback_snapshot(request, v_thread);
 		retval = 0;
 	} else if (action && !strcmp(action, "stream")) {
-		_http_callback_stream(request, v_server);
+		_http_callback_stream(request, v_thread);
 		retval = 0;
 	}
 
@@ -350,13 +563,14 @@ static int _http_check_run_compat_action(struct evhttp_request *request, void *v
 }
 
 #define COMPAT_REQUEST { \
-		if (_http_check_run_compat_action(request, v_server) == 0) { \
+		if (_http_check_run_compat_action(request, v_thread) == 0) { \
 			return; \
 		} \
 	}
 
-static void _http_callback_root(struct evhttp_request *request, void *v_server) {
-	us_server_s *const server = v_server;
+static void _http_callback_root(struct evhttp_request *request, void *v_thread) {
+	us_server_thread_s *const thread = v_thread;
+	us_server_s *const server = thread->server;
 
 	PREPROCESS_REQUEST;
 	COMPAT_REQUEST;
@@ -370,8 +584,9 @@ static void _http_callback_root(struct evhttp_request *request, void *v_server)
 	evbuffer_free(buf);
 }
 
-static void _http_callback_favicon(struct evhttp_request *request, void *v_server) {
-	us_server_s *const server = v_server;
+static void _http_callback_favicon(struct evhttp_request *request, void *v_thread) {
+	us_server_thread_s *const thread = v_thread;
+	us_server_s *const server = thread->server;
 
 	PREPROCESS_REQUEST;
 
@@ -384,8 +599,9 @@ static void _http_callback_favicon(struct evhttp_request *request, void *v_serve
 	evbuffer_free(buf);
 }
 
-static void _http_callback_static(struct evhttp_request *request, void *v_server) {
-	us_server_s *const server = v_server;
+static void _http_callback_static(struct evhttp_request *request, void *v_thread) {
+	us_server_thread_s *const thread = v_thread;
+	us_server_s *const server = thread->server;
 
 	PREPROCESS_REQUEST;
 	COMPAT_REQUEST;
@@ -393,7 +609,7 @@ static void _http_callback_static(struct evhttp_request *request, void *v_server
 	struct evbuffer *buf = NULL;
 	struct evhttp_uri *uri = NULL;
 	char *decoded_path = NULL;
-	char *static_path = NULL;
+	us_static_file_s file = {0};
 	int fd = -1;
 
 	{
@@ -409,36 +625,73 @@ static void _http_callback_static(struct evhttp_request *request, void *v_server
 		}
 	}
 
-	_A_EVBUFFER_NEW(buf);
-
-	if ((static_path = us_find_static_file_path(server->static_path, decoded_path)) == NULL) {
+	// The files are loaded once and revalidated by the cache
+	if (us_static_cache_get(
+		server->run->static_cache, decoded_path,
+		_http_get_header(request, "Accept-Encoding"), &file
+	) < 0) {
 		goto not_found;
 	}
 
-	if ((fd = open(static_path, O_RDONLY)) < 0) {
-		_LOG_PERROR("Can't open found static file %s", static_path);
-		goto not_found;
+	{
+		char last_modified[64];
+		struct tm tm;
+		assert(gmtime_r(&file.mtime, &tm) != NULL);
+		assert(strftime(last_modified, 64, "%a, %d %b %Y %H:%M:%S GMT", &tm) > 0);
+
+		_A_ADD_HEADER(request, "ETag", file.etag);
+		_A_ADD_HEADER(request, "Last-Modified", last_modified);
+		if (file.has_encodings) {
+			_A_ADD_HEADER(request, "Vary", "Accept-Encoding");
+		}
+
+		// If-None-Match has a priority: https://www.rfc-editor.org/rfc/rfc9110#section-13.1.3
+		const char *const if_none_match = _http_get_header(request, "If-None-Match");
+		const char *const if_modified_since = _http_get_header(request, "If-Modified-Since");
+		bool not_modified = false;
+		if (if_none_match != NULL) {
+			not_modified = (strstr(if_none_match, file.etag) != NULL || !strcmp(if_none_match, "*"));
+		} else if (if_modified_since != NULL) {
+			US_MEMSET_ZERO(tm);
+			const char *const end = strptime(if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm);
+			not_modified = (end != NULL && *end == '\0' && file.mtime <= timegm(&tm));
+		}
+		if (not_modified) {
+			evhttp_send_reply(request, HTTP_NOTMODIFIED, "Not Modified", NULL);
+			goto cleanup;
+		}
 	}
 
-	{
+	_A_EVBUFFER_NEW(buf);
+	if (file.data == NULL) {
+		// The file is too big to be cached
+		if ((fd = open(file.path, O_RDONLY | O_CLOEXEC)) < 0) {
+			_LOG_PERROR("Can't open found static file %s", file.path);
+			goto not_found;
+		}
 		struct stat st;
 		if (fstat(fd, &st) < 0) {
-			_LOG_PERROR("Can't stat() found static file %s", static_path);
+			_LOG_PERROR("Can't stat() found static file %s", file.path);
 			goto not_found;
 		}
 		if (st.st_size > 0 && evbuffer_add_file(buf, fd, 0, st.st_size) < 0) {
-			_LOG_ERROR("Can't serve static file %s", static_path);
+			_LOG_ERROR("Can't serve static file %s", file.path);
 			goto not_found;
 		}
-
 		// evbuffer_add_file() owns the resulting file descriptor
 		// and will close it when finished transferring data
 		fd = -1;
-
-		_A_ADD_HEADER(request, "Content-Type", us_guess_mime_type(static_path));
-		evhttp_send_reply(request, HTTP_OK, "OK", buf);
-		goto cleanup;
+	} else if (file.data->size > 0) {
+		// The reference is released after the reply has been sent
+		assert(!evbuffer_add_reference(buf, file.data->data, file.data->size, _http_static_cleanup, file.data));
+		file.data = NULL;
+	}
+	if (file.encoding != NULL) {
+		_A_ADD_HEADER(request, "Content-Encoding", file.encoding);
 	}
+	_A_ADD_HEADER(request, "Content-Type", file.mime);
+	evhttp_send_reply(request, HTTP_OK, "OK", buf);
+	goto cleanup;
 
 bad_request:
 	evhttp_send_error(request, HTTP_BADREQUEST, NULL);
@@ -449,19 +702,26 @@ not_found:
 	goto cleanup;
 
 cleanup:
-	US_CLOSE_FD(fd); // cppcheck-suppress unreadVariable
-	US_DELETE(static_path, free);
+	US_CLOSE_FD(fd);
+	US_DELETE(file.data, us_static_data_unref);
+	US_DELETE(file.path, free);
 	US_DELETE(buf, evbuffer_free);
 	US_DELETE(decoded_path, free);
 	US_DELETE(uri, evhttp_uri_free);
 }
 
+static void _http_static_cleanup(const void *data, size_t size, void *v_data) {
+	(void)data;
+	(void)size;
+	us_static_data_unref(v_data);
+}
+
 #undef COMPAT_REQUEST
 
-static void _http_callback_state(struct evhttp_request *request, void *v_server) {
-	us_server_s *const server = v_server;
+static void _http_callback_state(struct evhttp_request *request, void *v_thread) {
+	us_server_thread_s *const thread = v_thread;
+	us_server_s *const server = thread->server;
 	us_server_runtime_s *const run = server->run;
-	us_server_exposed_s *const ex = run->exposed;
 	us_stream_s *const stream = server->stream;
 
 	PREPROCESS_REQUEST;
@@ -473,14 +733,45 @@ static void _http_callback_state(struct evhttp_request *request, void *v_server)
 	struct evbuffer *buf;
 	_A_EVBUFFER_NEW(buf);
 
+	us_frame_stats_s frames;
+	us_frame_get_stats(&frames);
+	uint pool_in_use;
+	uint pool_free;
+	us_frame_pool_get_stats(stream->run->http->frames, &pool_in_use, &pool_free);
+
 	_A_EVBUFFER_ADD_PRINTF(buf,
 		"{\"ok\": true, \"result\": {"
 		" \"instance_id\": \"%s\","
-		" \"encoder\": {\"type\": \"%s\", \"quality\": %u},",
+		" \"encoder\": {\"type\": \"%s\", \"quality\": %u},"
+		" \"memory\": {\"low_memory\": %s,"
+		" \"frames\": {\"allocated\": %zu, \"allocated_peak\": %zu,"
+		" \"used\": %zu, \"used_peak\": %zu, \"sys_allocs\": %" PRIu64 ", \"cache_hits\": %" PRIu64 "},"
+		" \"frame_pool\": {\"in_use\": %u, \"free\": %u},"
+		" \"jpeg_ring\": {\"capacity\": %zu, \"queued\": %u},"
+		" \"sinks\": {",
 		server->instance_id,
 		us_encoder_type_to_string(enc_type),
-		enc_quality
+		enc_quality,
+		us_bool_to_string(stream->low_memory),
+		frames.allocated, frames.allocated_peak,
+		frames.used, frames.used_peak, frames.sys_allocs, frames.cache_hits,
+		pool_in_use, pool_free,
+		stream->run->http->jpeg_ring->capacity, us_ring_get_queued(stream->run->http->jpeg_ring)
 	);
+	{
+		// The shared memory is sparse, so only the touched part is resident
+		const char *sink_comma = "";
+#		define ADD_SINK(x_name, x_sink) if (x_sink != NULL) { \
+				_A_EVBUFFER_ADD_PRINTF(buf, "%s\"" x_name "\": {\"size\": %zu, \"resident\": %llu}", \
+					sink_comma, x_sink->data_size, atomic_load(&x_sink->resident)); \
+				sink_comma = ", "; \
+			}
+		ADD_SINK("jpeg", stream->jpeg_sink);
+		ADD_SINK("raw", stream->raw_sink);
+		ADD_SINK("h264", stream->h264_sink);
+#		undef ADD_SINK
+	}
+	_A_EVBUFFER_ADD_PRINTF(buf, "}},");
 
 #	ifdef WITH_V4P
 	if (stream->drm != NULL) {
@@ -524,8 +815,15 @@ static void _http_callback_state(struct evhttp_request *request, void *v_server)
 		_A_EVBUFFER_ADD_PRINTF(buf, "},");
 	}
 
+	// Every thread queues frames to its own clients, the fastest one is reported
+	uint queued_fps = 0;
+	for (uint number = 0; number < run->n_threads; ++number) {
+		queued_fps = US_MAX(queued_fps, us_fpsi_get(run->threads[number].queued_fpsi, NULL));
+	}
+
 	us_fpsi_meta_s captured_meta;
 	const uint captured_fps = us_fpsi_get(stream->run->http->captured_fpsi, &captured_meta);
+	US_MUTEX_LOCK(run->clients_mutex);
 	_A_EVBUFFER_ADD_PRINTF(buf,
 		" \"source\": {\"resolution\": {\"width\": %u, \"height\": %u},"
 		" \"online\": %s, \"desired_fps\": %u, \"captured_fps\": %u},"
@@ -535,24 +833,33 @@ static void _http_callback_state(struct evhttp_request *request, void *v_server)
 		us_bool_to_string(captured_meta.online),
 		stream->cap->desired_fps,
 		captured_fps,
-		us_fpsi_get(ex->queued_fpsi, NULL),
+		queued_fps,
 		run->stream_clients_count
 	);
 
-	US_LIST_ITERATE(run->stream_clients, client, { // cppcheck-suppress constStatement
-		_A_EVBUFFER_ADD_PRINTF(buf,
-			"\"%" PRIx64 "\": {\"fps\": %u, \"extra_headers\": %s, \"advance_headers\": %s,"
-			" \"dual_final_frames\": %s, \"zero_data\": %s, \"key\": \"%s\"}%s",
-			client->id,
-			us_fpsi_get(client->fpsi, NULL),
-			us_bool_to_string(client->extra_headers),
-			us_bool_to_string(client->advance_headers),
-			us_bool_to_string(client->dual_final_frames),
-			us_bool_to_string(client->zero_data),
-			(client->key != NULL ? client->key : "0"),
-			(client->next ? ", " : "")
-		);
-	});
+	const char *comma = "";
+	for (uint number = 0; number < run->n_threads; ++number) {
+		US_LIST_ITERATE(run->threads[number].stream_clients, client, { // cppcheck-suppress constStatement
+			_A_EVBUFFER_ADD_PRINTF(buf,
+				"%s\"%" PRIx64 "\": {\"fps\": %u, \"dropped\": %u, \"coalesced\": %u,"
+				" \"extra_headers\": %s, \"advance_headers\": %s,"
+				" \"dual_final_frames\": %s, \"zero_data\": %s, \"websocket\": %s, \"key\": \"%s\"}",
+				comma,
+				client->id,
+				us_fpsi_get(client->fpsi, NULL),
+				atomic_load(&client->dropped),
+				atomic_load(&client->coalesced),
+				us_bool_to_string(client->extra_headers),
+				us_bool_to_string(client->advance_headers),
+				us_bool_to_string(client->dual_final_frames),
+				us_bool_to_string(client->zero_data),
+				us_bool_to_string(client->ws_accept != NULL),
+				(client->key != NULL ? client->key : "0")
+			);
+			comma = ", ";
+		});
+	}
+	US_MUTEX_UNLOCK(run->clients_mutex);
 
 	_A_EVBUFFER_ADD_PRINTF(buf, "}}}}");
 
@@ -561,114 +868,527 @@ static void _http_callback_state(struct evhttp_request *request, void *v_server)
 	evbuffer_free(buf);
 }
 
-static void _http_callback_snapshot(struct evhttp_request *request, void *v_server) {
-	us_server_s *const server = v_server;
+static void _http_callback_metrics(struct evhttp_request *request, void *v_thread) {
+	us_server_thread_s *const thread = v_thread;
+	us_server_s *const server = thread->server;
+	us_stream_s *const stream = server->stream;
+	us_metrics_s *const metrics = stream->run->http->metrics;
 
 	PREPROCESS_REQUEST;
 
-	us_snapshot_client_s *client;
-	US_CALLOC(client, 1);
-	client->server = server;
-	client->request = request;
-	client->request_ts = us_get_now_monotonic();
+	// https://github.com/OpenObservability/OpenMetrics/blob/main/specification/OpenMetrics.md
+	// The counters are read without locks, a scrape may be slightly inconsistent.
 
-	atomic_fetch_add(&server->stream->run->http->snapshot_requested, 1);
-	US_LIST_APPEND(server->run->snapshot_clients, client);
-}
+	struct evbuffer *buf;
+	_A_EVBUFFER_NEW(buf);
 
-static void _http_callback_stream(struct evhttp_request *request, void *v_server) {
-	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L2814
-	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L2789
-	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L362
-	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L791
-	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L1458
+#	define LOAD(x_atomic) ((ull)atomic_load_explicit(&(x_atomic), memory_order_relaxed))
 
-	us_server_s *const server = v_server;
-	us_server_runtime_s *const run = server->run;
+	_A_EVBUFFER_ADD_PRINTF(buf,
+		"# TYPE ustreamer_latency_seconds histogram\n"
+		"# HELP ustreamer_latency_seconds Frame latency by the pipeline stages\n"
+	);
+	for (us_metrics_stage_e stage = 0; stage < US_METRICS_N_STAGES; ++stage) {
+		const us_metrics_histogram_s *const hist = &metrics->stages[stage];
+		const char *const name = us_metrics_stage_to_string(stage);
+		ull total = 0;
+		for (uint index = 0; index <= US_METRICS_N_BUCKETS; ++index) {
+			total += LOAD(hist->buckets[index]);
+			if (index < US_METRICS_N_BUCKETS) {
+				_A_EVBUFFER_ADD_PRINTF(buf,
+					"ustreamer_latency_seconds_bucket{stage=\"%s\",le=\"%Lg\"} %llu\n",
+					name, us_metrics_buckets[index], total);
+			} else {
+				_A_EVBUFFER_ADD_PRINTF(buf,
+					"ustreamer_latency_seconds_bucket{stage=\"%s\",le=\"+Inf\"} %llu\n",
+					name, total);
+			}
+		}
+		_A_EVBUFFER_ADD_PRINTF(buf,
+			"ustreamer_latency_seconds_sum{stage=\"%s\"} %.6f\n"
+			"ustreamer_latency_seconds_count{stage=\"%s\"} %llu\n",
+			name, (double)LOAD(hist->sum_us) / 1000000,
+			name, total
+		);
+	}
+
+	_A_EVBUFFER_ADD_PRINTF(buf,
+		"# TYPE ustreamer_frames_dropped counter\n"
+		"# HELP ustreamer_frames_dropped Frames dropped or delayed in the pipeline by reason\n"
+	);
+	for (us_metrics_drop_e reason = 0; reason < US_METRICS_N_DROPS; ++reason) {
+		_A_EVBUFFER_ADD_PRINTF(buf,
+			"ustreamer_frames_dropped_total{reason=\"%s\"} %llu\n",
+			us_metrics_drop_to_string(reason), LOAD(metrics->drops[reason]));
+	}
+	ull memsink_busy = 0;
+#	define ADD_BUSY(x_sink) { if (stream->x_sink != NULL) { memsink_busy += LOAD(stream->x_sink->stat_busy); } }
+	ADD_BUSY(jpeg_sink);
+	ADD_BUSY(raw_sink);
+	ADD_BUSY(h264_sink);
+#	undef ADD_BUSY
+	_A_EVBUFFER_ADD_PRINTF(buf, "ustreamer_frames_dropped_total{reason=\"memsink_busy\"} %llu\n", memsink_busy);
+
+	_A_EVBUFFER_ADD_PRINTF(buf,
+		"# TYPE ustreamer_sink_frames counter\n"
+		"# HELP ustreamer_sink_frames Frames put to the sinks\n"
+		"ustreamer_sink_frames_total{sink=\"http\"} %llu\n",
+		LOAD(metrics->http_frames)
+	);
+#	define ADD_SINK(x_sink, x_name, x_field) { \
+			if (stream->x_sink != NULL) { \
+				_A_EVBUFFER_ADD_PRINTF(buf, \
+					"ustreamer_sink_" #x_field "_total{sink=\"" x_name "\"} %llu\n", \
+					LOAD(stream->x_sink->stat_##x_field)); \
+			} \
+		}
+	ADD_SINK(jpeg_sink, "jpeg", frames);
+	ADD_SINK(raw_sink, "raw", frames);
+	ADD_SINK(h264_sink, "h264", frames);
+	_A_EVBUFFER_ADD_PRINTF(buf,
+		"# TYPE ustreamer_sink_bytes counter\n"
+		"# HELP ustreamer_sink_bytes Bytes put to the sinks\n"
+		"ustreamer_sink_bytes_total{sink=\"http\"} %llu\n",
+		LOAD(metrics->http_bytes)
+	);
+	ADD_SINK(jpeg_sink, "jpeg", bytes);
+	ADD_SINK(raw_sink, "raw", bytes);
+	ADD_SINK(h264_sink, "h264", bytes);
+#	undef ADD_SINK
+#	undef LOAD
+
+	_A_EVBUFFER_ADD_PRINTF(buf, "# EOF\n");
+
+	_A_ADD_HEADER(request, "Content-Type", "application/openmetrics-text; version=1.0.0; charset=utf-8");
+	evhttp_send_reply(request, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
+}
+
+static void _http_callback_trace(struct evhttp_request *request, void *v_thread) {
+	us_server_thread_s *const thread = v_thread;
+	us_server_s *const server = thread->server;
 
 	PREPROCESS_REQUEST;
 
-	// 如果连接存在，创建一个新的 us_stream_client_s 结构体，并初始化它
 	struct evhttp_connection *const conn = evhttp_request_get_connection(request);
-	if (conn != NULL) {
-		us_stream_client_s *client;
-		US_CALLOC(client, 1);
-		client->server = server;
-		client->request = request;
-		client->need_initial = true;
-		client->need_first_frame = true;
+	if (conn == NULL) {
+		evhttp_request_free(request);
+		return;
+	}
 
-		struct evkeyvalq params;
-		evhttp_parse_query(evhttp_request_get_uri(request), &params);
-#		define PARSE_PARAM(x_type, x_name) client->x_name = us_uri_get_##x_type(&params, #x_name)
-		PARSE_PARAM(string, key);
-		PARSE_PARAM(true, extra_headers);
-		PARSE_PARAM(true, advance_headers);
-		PARSE_PARAM(true, dual_final_frames);
-		PARSE_PARAM(true, zero_data);
-#		undef PARSE_PARAM
-		evhttp_clear_headers(&params);
+	uint seconds = 1;
+	struct evkeyvalq params;
+	evhttp_parse_query(evhttp_request_get_uri(request), &params);
+	us_uri_get_uint(&params, "seconds", &seconds);
+	evhttp_clear_headers(&params);
+	seconds = US_MIN(US_MAX(seconds, (uint)1), (uint)60);
 
-		client->hostport = _http_get_client_hostport(request);
-		client->id = us_get_now_id();
+	us_trace_client_s *client;
+	US_CALLOC(client, 1);
+	client->server = server;
+	client->thread = thread;
+	client->request = request;
+	client->begin_ts = us_get_now_monotonic();
+	assert((client->timer = evtimer_new(thread->base, _http_trace_timeout, client)) != NULL);
+	const struct timeval interval = {.tv_sec = seconds};
+	assert(!evtimer_add(client->timer, &interval));
+	US_LIST_APPEND(thread->trace_clients, client);
+	// The request is freed by evhttp if the client goes away before the timer
+	evhttp_connection_set_closecb(conn, _http_trace_close, client);
+
+	_LOG_INFO("Tracing the pipeline for %u seconds ...", seconds);
+	us_tracer_start();
+}
 
-		{
-			char *name;
-			US_ASPRINTF(name, "MJPEG-CLIENT-%" PRIx64, client->id);
-			client->fpsi = us_fpsi_init(name, false);
-			free(name);
-		}
+static void _http_trace_timeout(int fd, short what, void *v_client) {
+	(void)fd;
+	(void)what;
 
-		// 新客户端添加到服务器的客户端列表中
-		US_LIST_APPEND_C(run->stream_clients, client, run->stream_clients_count);
+	us_trace_client_s *const client = v_client;
 
-		// 如果这是第一个客户端，更新相关状态（如 has_clients 标志和 GPIO 状态）
-		if (run->stream_clients_count == 1) {
-			atomic_store(&server->stream->run->http->has_clients, true);
-#			ifdef WITH_GPIO
-			us_gpio_set_has_http_clients(true);
-#			endif
-		}
+	us_tracer_stop();
 
-		_LOG_INFO("NEW client (now=%u): %s, id=%" PRIx64,
-			run->stream_clients_count, client->hostport, client->id);
+	us_tracer_span_s *spans;
+	const uz n_spans = us_tracer_collect(client->begin_ts, &spans);
+	_LOG_INFO("Tracing finished: spans=%zu", n_spans);
 
-		struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(conn);
-		if (server->tcp_nodelay && run->ext_fd >= 0) {
-			_LOG_DEBUG("Setting up TCP_NODELAY to the client %s ...", client->hostport);
-			const evutil_socket_t fd = bufferevent_getfd(buf_event);
-			assert(fd >= 0);
-			int on = 1;
-			if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&on, sizeof(on)) != 0) {
-				_LOG_PERROR("Can't set TCP_NODELAY to the client %s", client->hostport);
+	// https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+	struct evbuffer *buf;
+	_A_EVBUFFER_NEW(buf);
+	_A_EVBUFFER_ADD_PRINTF(buf, "{\"traceEvents\": [");
+	uint max_tid = 0;
+	for (uz index = 0; index < n_spans; ++index) {
+		const us_tracer_span_s *const span = &spans[index];
+		_A_EVBUFFER_ADD_PRINTF(buf,
+			"%s{\"name\": \"%s\", \"cat\": \"frame\", \"ph\": \"X\","
+			" \"ts\": %.3Lf, \"dur\": %.3Lf, \"pid\": 1, \"tid\": %u,"
+			" \"args\": {\"frame\": \"%" PRIx64 "\"}}",
+			(index > 0 ? ", " : ""),
+			span->name,
+			span->begin_ts * 1000000,
+			US_MAX(span->end_ts - span->begin_ts, (ldf)0) * 1000000,
+			span->tid, span->trace_id
+		);
+		max_tid = US_MAX(max_tid, span->tid);
+	}
+	if (max_tid > 0) {
+		bool *named;
+		US_CALLOC(named, max_tid + 1);
+		for (uz index = 0; index < n_spans; ++index) {
+			const us_tracer_span_s *const span = &spans[index];
+			if (!named[span->tid]) {
+				_A_EVBUFFER_ADD_PRINTF(buf,
+					", {\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %u,"
+					" \"args\": {\"name\": \"%s\"}}",
+					span->tid, span->thread
+				);
+				named[span->tid] = true;
 			}
 		}
-		// 设置缓冲事件回调，用于处理连接错误
-		bufferevent_setcb(buf_event, NULL, NULL, _http_callback_stream_error, (void*)client);
-		bufferevent_enable(buf_event, EV_READ);
-	} else {
-		evhttp_request_free(request);
+		free(named);
 	}
+	_A_EVBUFFER_ADD_PRINTF(buf, "], \"displayTimeUnit\": \"ms\"}");
+	free(spans);
+
+	// The request may be freed by the reply, so the client is removed first
+	struct evhttp_request *const request = client->request;
+	_http_trace_remove(client);
+
+	_A_ADD_HEADER(request, "Content-Type", "application/json");
+	evhttp_send_reply(request, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
 }
 
-#undef PREPROCESS_REQUEST
+static void _http_trace_close(struct evhttp_connection *conn, void *v_client) {
+	(void)conn;
+	us_trace_client_s *const client = v_client;
+	_LOG_INFO("Tracing canceled: the client has gone away");
+	us_tracer_stop();
+	_http_trace_remove(client);
+}
 
-static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_client) {
-	us_stream_client_s *const client = v_client;
-	us_server_s *const server = client->server;
-	us_server_exposed_s *const ex = server->run->exposed;
+static void _http_trace_remove(us_trace_client_s *client) {
+	struct evhttp_connection *const conn = evhttp_request_get_connection(client->request);
+	if (conn != NULL) {
+		evhttp_connection_set_closecb(conn, NULL, NULL);
+	}
+	US_LIST_REMOVE(client->thread->trace_clients, client);
+	event_free(client->timer); // Deletes the pending timer too
+	free(client);
+}
 
-	us_fpsi_update(client->fpsi, true, NULL);
+static void _http_callback_state_events(struct evhttp_request *request, void *v_thread) {
+	us_server_thread_s *const thread = v_thread;
+	us_server_s *const server = thread->server;
 
-	struct evbuffer *buf;
-	_A_EVBUFFER_NEW(buf);
+	PREPROCESS_REQUEST;
 
-	// 在 Chrome 及其衍生产品中存在一个根本性的错误：它会在接收到下一个帧的头部时延迟渲染当前帧。
-	// 结合 drop_same_frames 功能，这会导致在大量丢帧的情况下（例如在静态图像中突然发生变化时）
-	// 流媒体出现显著的延迟。
-	//
-	// https://bugs.chromium.org/p/chromium/issues/detail?id=527446
-	//
+	struct evhttp_connection *const conn = evhttp_request_get_connection(request);
+	if (conn == NULL) {
+		evhttp_request_free(request);
+		return;
+	}
+
+	// Brings the existing clients up to date, so the new one starts from the same state
+	_http_send_state(thread);
+
+	us_state_client_s *client;
+	US_CALLOC(client, 1);
+	client->server = server;
+	client->thread = thread;
+	client->request = request;
+	client->hostport = _http_get_client_hostport(request);
+	if (thread->state_clients == NULL) {
+		assert(!event_add(thread->state_ticker, &_STATE_TICK_INTERVAL));
+	}
+	US_LIST_APPEND(thread->state_clients, client);
+	_LOG_INFO("NEW state client: %s", client->hostport);
+
+	struct evbuffer *const buf = thread->part_buf;
+	assert(evbuffer_get_length(buf) == 0);
+	_A_EVBUFFER_ADD_PRINTF(buf, "HTTP/1.0 200 OK" RN);
+	_http_add_raw_cors(server, request, buf);
+	_A_EVBUFFER_ADD_PRINTF(buf,
+		"Cache-Control: no-store, no-cache, must-revalidate, proxy-revalidate, pre-check=0, post-check=0, max-age=0" RN
+		"Pragma: no-cache" RN
+		"Expires: Mon, 3 Jan 2000 12:34:56 GMT" RN
+		"Content-Type: text/event-stream" RN
+		RN
+	);
+	assert(_state_render(buf, NULL, &thread->state));
+
+	struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(conn);
+	assert(!bufferevent_write_buffer(buf_event, buf));
+	bufferevent_setcb(buf_event, NULL, NULL, _http_callback_state_events_error, (void*)client);
+	bufferevent_enable(buf_event, EV_READ);
+}
+
+static void _http_callback_state_events_error(struct bufferevent *buf_event, short what, void *v_client) {
+	(void)buf_event;
+
+	us_state_client_s *const client = v_client;
+	us_server_thread_s *const thread = client->thread;
+
+	US_LIST_REMOVE(thread->state_clients, client);
+	if (thread->state_clients == NULL) {
+		event_del(thread->state_ticker);
+	}
+
+	char *const reason = us_bufferevent_format_reason(what);
+	_LOG_INFO("DEL state client: %s, %s", client->hostport, reason);
+	free(reason);
+
+	struct evhttp_connection *conn = evhttp_request_get_connection(client->request);
+	US_DELETE(conn, evhttp_connection_free);
+
+	free(client->hostport);
+	free(client);
+}
+
+static void _http_callback_snapshot(struct evhttp_request *request, void *v_thread) {
+	us_server_thread_s *const thread = v_thread;
+	us_server_s *const server = thread->server;
+
+	PREPROCESS_REQUEST;
+
+	// The exposed frame is returned right away if it's fresh enough,
+	// without forcing the encoder and waiting for the next frame.
+	uint max_age = 0;
+	uint width = 0;
+	uint height = 0;
+	uint quality = 0;
+	struct evkeyvalq params;
+	evhttp_parse_query(evhttp_request_get_uri(request), &params);
+	const bool has_max_age = us_uri_get_uint(&params, "max_age", &max_age);
+	us_uri_get_uint(&params, "width", &width);
+	us_uri_get_uint(&params, "height", &height);
+	us_uri_get_uint(&params, "quality", &quality);
+	evhttp_clear_headers(&params);
+
+	const us_server_view_s *const view = &thread->view;
+	if (
+		has_max_age && view->payload != NULL && view->frame->online
+		&& us_get_now_monotonic() - view->frame->grab_ts <= (ldf)max_age / 1000
+	) {
+		_http_reply_snapshot(thread, request, view->frame, view->payload->data, view->payload->id, width, height, quality);
+		return;
+	}
+
+	us_snapshot_client_s *client;
+	US_CALLOC(client, 1);
+	client->server = server;
+	client->thread = thread;
+	client->request = request;
+	client->request_ts = us_get_now_monotonic();
+	client->width = width;
+	client->height = height;
+	client->quality = quality;
+
+	atomic_fetch_add(&server->stream->run->http->snapshot_requested, 1);
+	US_LIST_APPEND(thread->snapshot_clients, client);
+}
+
+static void _http_callback_stream(struct evhttp_request *request, void *v_thread) {
+	us_server_thread_s *const thread = v_thread;
+	us_server_s *const server = thread->server;
+
+	PREPROCESS_REQUEST;
+
+	_http_add_stream_client(thread, request, NULL);
+}
+
+static void _http_callback_ws(struct evhttp_request *request, void *v_thread) {
+	us_server_thread_s *const thread = v_thread;
+	us_server_s *const server = thread->server;
+
+	PREPROCESS_REQUEST;
+
+	// https://datatracker.ietf.org/doc/html/rfc6455#section-4.2.1
+	const char *const upgrade = _http_get_header(request, "Upgrade");
+	const char *const version = _http_get_header(request, "Sec-WebSocket-Version");
+	const char *const key = _http_get_header(request, "Sec-WebSocket-Key");
+	char *ws_accept = NULL;
+	if (
+		upgrade == NULL || strcasecmp(upgrade, "websocket") != 0
+		|| version == NULL || strcmp(version, "13") != 0
+		|| key == NULL || (ws_accept = us_ws_make_accept(key)) == NULL
+	) {
+		_A_ADD_HEADER(request, "Sec-WebSocket-Version", "13");
+		evhttp_send_error(request, HTTP_BADREQUEST, NULL);
+		return;
+	}
+
+	_http_add_stream_client(thread, request, ws_accept);
+}
+
+#undef PREPROCESS_REQUEST
+
+static void _http_add_stream_client(us_server_thread_s *thread, struct evhttp_request *request, char *ws_accept) {
+	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L2814
+	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L2789
+	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L362
+	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L791
+	// https://github.com/libevent/libevent/blob/29cc8386a2f7911eaa9336692a2c5544d8b4734f/http.c#L1458
+
+	us_server_s *const server = thread->server;
+	us_server_runtime_s *const run = server->run;
+
+	// 如果连接存在，创建一个新的 us_stream_client_s 结构体，并初始化它
+	struct evhttp_connection *const conn = evhttp_request_get_connection(request);
+	if (conn != NULL) {
+		us_stream_client_s *client;
+		US_CALLOC(client, 1);
+		client->server = server;
+		client->thread = thread;
+		client->request = request;
+		client->need_initial = true;
+		client->need_first_frame = true;
+		client->ws_accept = ws_accept;
+
+		struct evkeyvalq params;
+		evhttp_parse_query(evhttp_request_get_uri(request), &params);
+#		define PARSE_PARAM(x_type, x_name) client->x_name = us_uri_get_##x_type(&params, #x_name)
+		PARSE_PARAM(string, key);
+		PARSE_PARAM(true, extra_headers);
+		PARSE_PARAM(true, advance_headers);
+		PARSE_PARAM(true, dual_final_frames);
+		PARSE_PARAM(true, zero_data);
+#		undef PARSE_PARAM
+		evhttp_clear_headers(&params);
+
+		client->hostport = _http_get_client_hostport(request);
+		client->id = us_get_now_id();
+
+		{
+			char *name;
+			US_ASPRINTF(name, "MJPEG-CLIENT-%" PRIx64, client->id);
+			client->fpsi = us_fpsi_init(name, false);
+			free(name);
+		}
+
+		// 新客户端添加到当前线程的客户端列表中
+		US_MUTEX_LOCK(run->clients_mutex);
+		US_LIST_APPEND_C(thread->stream_clients, client, run->stream_clients_count);
+
+		// 如果这是第一个客户端，更新相关状态（如 has_clients 标志和 GPIO 状态）
+		if (run->stream_clients_count == 1) {
+			atomic_store(&server->stream->run->http->has_clients, true);
+#			ifdef WITH_GPIO
+			us_gpio_set_has_http_clients(true);
+#			endif
+		}
+
+		_LOG_INFO("NEW client (now=%u): %s, id=%" PRIx64,
+			run->stream_clients_count, client->hostport, client->id);
+		US_MUTEX_UNLOCK(run->clients_mutex);
+		_http_notify_state(server);
+
+		struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(conn);
+		if (server->tcp_nodelay && run->ext_fd >= 0) {
+			_LOG_DEBUG("Setting up TCP_NODELAY to the client %s ...", client->hostport);
+			const evutil_socket_t fd = bufferevent_getfd(buf_event);
+			assert(fd >= 0);
+			int on = 1;
+			if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, (void*)&on, sizeof(on)) != 0) {
+				_LOG_PERROR("Can't set TCP_NODELAY to the client %s", client->hostport);
+			}
+		}
+		// The write callback is called only after the unsent data has drained to the watermark,
+		// so a slow client holds no more than one frame above it (see _http_send_stream()).
+		bufferevent_setwatermark(buf_event, EV_WRITE, server->stream_wm, 0);
+		// 设置缓冲事件回调，用于处理连接错误
+		_http_stream_client_setcb(client, buf_event, false);
+		bufferevent_enable(buf_event, EV_READ);
+
+		// Send the first frame right now instead of waiting for the next one
+		event_active(thread->refresher, 0, 0);
+	} else {
+		free(ws_accept);
+		evhttp_request_free(request);
+	}
+}
+
+static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_client) {
+	us_stream_client_s *const client = v_client;
+	us_server_thread_s *const thread = client->thread;
+	const us_server_view_s *const view = &thread->view;
+
+	us_fpsi_update(client->fpsi, true, NULL);
+
+	// The frames to send: the current one for MJPEG, or all frames of the GOP
+	// which the client has not got yet for H.264/H.265. So a new client starts
+	// from the keyframe and a slow one doesn't lose the reference frames.
+	us_server_payload_s *chain[_MAX_GOP_FRAMES];
+	uint count = 0;
+	if (view->frame->format == V4L2_PIX_FMT_MJPEG) {
+		chain[count++] = view->payload;
+	} else if (view->payload->gop_broken) {
+		// Only the client which has got all the previous frames can decode this one,
+		// the others are waiting for the next keyframe.
+		if (client->sent_id > 0 && view->payload->id == client->sent_id + 1) {
+			chain[count++] = view->payload;
+		}
+	} else {
+		for (
+			us_server_payload_s *payload = view->payload;
+			payload != NULL && payload->id > client->sent_id;
+			payload = payload->gop_prev
+		) {
+			assert(count < _MAX_GOP_FRAMES);
+			chain[count++] = payload;
+		}
+	}
+
+	if (count > 0) {
+		const u64 first_id = chain[count - 1]->id;
+		if (client->sent_id > 0 && first_id > client->sent_id + 1) {
+			// Only the freshest frames are sent, the others have been replaced while waiting
+			atomic_fetch_add(&client->dropped, first_id - client->sent_id - 1);
+		}
+		client->sent_id = view->payload->id;
+	}
+	if (client->pending_updates > 1) {
+		atomic_fetch_add(&client->coalesced, 1);
+	}
+	client->pending_updates = 0;
+
+	// The buffer is shared by the thread clients: bufferevent_write_buffer() drains it completely
+	struct evbuffer *const buf = thread->part_buf;
+	assert(evbuffer_get_length(buf) == 0);
+
+	if (client->ws_accept != NULL) {
+		_http_stream_add_ws(client, buf, chain, count);
+	} else {
+		_http_stream_add_http(client, buf, chain, count);
+	}
+
+	if (count > 0) {
+		us_tracer_span("send", us_tracer_get_id(view->frame->grab_ts), view->payload->expose_ts, us_get_now_monotonic());
+		us_metrics_s *const metrics = client->server->stream->run->http->metrics;
+		us_metrics_observe(metrics, US_METRICS_EXPOSE_TO_SEND, view->payload->expose_ts, us_get_now_monotonic());
+		atomic_fetch_add_explicit(&metrics->http_frames, count, memory_order_relaxed);
+		atomic_fetch_add_explicit(&metrics->http_bytes, evbuffer_get_length(buf), memory_order_relaxed);
+	}
+
+	// 3. 一次性将构建好的数据写入到客户端的连接缓冲区
+	assert(!bufferevent_write_buffer(buf_event, buf));
+	US_LOG_DEBUG("time clause from venc to evhttp is %.3Lf ms",(us_get_now_monotonic() - view->frame->grab_ts)*1000);
+
+	_http_stream_client_setcb(client, buf_event, false);
+	bufferevent_enable(buf_event, EV_READ);
+}
+
+static void _http_stream_add_http(us_stream_client_s *client, struct evbuffer *buf, us_server_payload_s **chain, uint count) {
+	const us_server_s *const server = client->server;
+	const us_server_view_s *const view = &client->thread->view;
+	const us_server_parts_s *const parts = &view->parts;
+
+	// 在 Chrome 及其衍生产品中存在一个根本性的错误：它会在接收到下一个帧的头部时延迟渲染当前帧。
+	// 结合 drop_same_frames 功能，这会导致在大量丢帧的情况下（例如在静态图像中突然发生变化时）
+	// 流媒体出现显著的延迟。
+	//
+	// https://bugs.chromium.org/p/chromium/issues/detail?id=527446
+	//
 	// 启用 advance_headers 会强制流媒体在发送当前帧数据后立即发送下一个帧的头部，以触发渲染。
 	// 其自然结果是无法设置 Content-Length 头部，因为我们还无法预测未来。
 	// 虽然 RFC 并不要求 Content-Length，但 MJPEG over HTTP 并没有任何标准，
@@ -677,8 +1397,9 @@ static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_c
 	// 此外，advance_headers 还会强制禁用 X-UStreamer-* 头部，原因与无法设置 Content-Length 相同。
 
 	// 1. 构建MJPEG头部信息
-#	define BOUNDARY "boundarydonotcross"
+#	define ADD_PART(x_part) _A_EVBUFFER_ADD(buf, (x_part)->data, (x_part)->size)
 
+	// X-Timestamp is the time when the part is sent to this client
 #	define ADD_ADVANCE_HEADERS \
 		_A_EVBUFFER_ADD_PRINTF(buf, \
 			"Content-Type: image/jpeg" RN "X-Timestamp: %.06Lf" RN RN, us_get_now_real())
@@ -686,24 +1407,9 @@ static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_c
 	if (client->need_initial) {
 		_A_EVBUFFER_ADD_PRINTF(buf, "HTTP/1.0 200 OK" RN);
 		
-		if (client->server->allow_origin[0] != '\0') {
-			const char *const cors_headers = _http_get_header(client->request, "Access-Control-Request-Headers");
-			const char *const cors_method = _http_get_header(client->request, "Access-Control-Request-Method");
-
-			_A_EVBUFFER_ADD_PRINTF(buf,
-				"Access-Control-Allow-Origin: %s" RN
-				"Access-Control-Allow-Credentials: true" RN,
-				client->server->allow_origin				
-			);
-			if (cors_headers != NULL) {
-				_A_EVBUFFER_ADD_PRINTF(buf, "Access-Control-Allow-Headers: %s" RN, cors_headers);
-			}
-			if (cors_method != NULL) {
-				_A_EVBUFFER_ADD_PRINTF(buf, "Access-Control-Allow-Methods: %s" RN, cors_method);
-			}
-		}
+		_http_add_raw_cors(client->server, client->request, buf);
 
-		if (ex->frame->format == V4L2_PIX_FMT_H264){
+		if (view->frame->format == V4L2_PIX_FMT_H264){
 			_A_EVBUFFER_ADD_PRINTF(buf,
 				"Cache-Control: no-store, no-cache, must-revalidate, proxy-revalidate, pre-check=0, post-check=0, max-age=0" RN
 				"Pragma: no-cache" RN
@@ -716,7 +1422,7 @@ static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_c
 				(client->key != NULL ? client->key : "0"),
 				client->id
 			);
-		}else if (ex->frame->format == V4L2_PIX_FMT_DV){ // v4l2驱动没有H265定义,先偷一个用着
+		}else if (view->frame->format == V4L2_PIX_FMT_DV){ // v4l2驱动没有H265定义,先偷一个用着
 			_A_EVBUFFER_ADD_PRINTF(buf,
 				"Cache-Control: no-store, no-cache, must-revalidate, proxy-revalidate, pre-check=0, post-check=0, max-age=0" RN
 				"Pragma: no-cache" RN
@@ -729,15 +1435,15 @@ static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_c
 				(client->key != NULL ? client->key : "0"),
 				client->id
 			);
-		}else if (ex->frame->format == V4L2_PIX_FMT_MJPEG){
+		}else if (view->frame->format == V4L2_PIX_FMT_MJPEG){
 			_A_EVBUFFER_ADD_PRINTF(buf,
 				"Cache-Control: no-store, no-cache, must-revalidate, proxy-revalidate, pre-check=0, post-check=0, max-age=0" RN
 				"Pragma: no-cache" RN
 				"Expires: Mon, 3 Jan 2000 12:34:56 GMT" RN
 				"Set-Cookie: stream_client%s%s=%s/%" PRIx64 "; path=/; max-age=30" RN
-				"Content-Type: multipart/x-mixed-replace;boundary=" BOUNDARY RN
+				"Content-Type: multipart/x-mixed-replace;boundary=" _BOUNDARY RN
 				RN
-				"--" BOUNDARY RN,
+				"--" _BOUNDARY RN,
 				(server->instance_id[0] == '\0' ? "" : "_"),
 				server->instance_id,
 				(client->key != NULL ? client->key : "0"),
@@ -749,79 +1455,99 @@ static void _http_callback_stream_write(struct bufferevent *buf_event, void *v_c
 			}
 		}
 
-
-		assert(!bufferevent_write_buffer(buf_event, buf));
 		client->need_initial = false;
 	}
 
-	if (ex->frame->format == V4L2_PIX_FMT_MJPEG && !client->advance_headers) {
-		_A_EVBUFFER_ADD_PRINTF(buf,
-			"Content-Type: image/jpeg" RN
-			"Content-Length: %zu" RN
-			"X-Timestamp: %.06Lf" RN
-			"%s",
-			(!client->zero_data ? ex->frame->used : 0),
-			us_get_now_real(),
-			(client->extra_headers ? "" : RN)
-		);
-		const ldf now_ts = us_get_now_monotonic();
+	if (view->frame->format == V4L2_PIX_FMT_MJPEG && !client->advance_headers) {
+		// The part headers are rendered once per frame by _expose_render_parts(),
+		// only the per-client fields are printed here.
+		ADD_PART(client->zero_data ? &parts->head_zero : &parts->head);
+		_A_EVBUFFER_ADD_PRINTF(buf, "X-Timestamp: %.06Lf" RN, us_get_now_real());
 		if (client->extra_headers) {
+			ADD_PART(&parts->extra);
+			const ldf now_ts = us_get_now_monotonic();
 			_A_EVBUFFER_ADD_PRINTF(buf,
-				"X-UStreamer-Online: %s" RN
-				"X-UStreamer-Dropped: %u" RN
-				"X-UStreamer-Width: %u" RN
-				"X-UStreamer-Height: %u" RN
 				"X-UStreamer-Client-FPS: %u" RN
-				"X-UStreamer-Grab-Time: %.06Lf" RN
-				"X-UStreamer-Encode-Begin-Time: %.06Lf" RN
-				"X-UStreamer-Encode-End-Time: %.06Lf" RN
-				"X-UStreamer-Expose-Begin-Time: %.06Lf" RN
-				"X-UStreamer-Expose-Cmp-Time: %.06Lf" RN
-				"X-UStreamer-Expose-End-Time: %.06Lf" RN
 				"X-UStreamer-Send-Time: %.06Lf" RN
 				"X-UStreamer-Latency: %.06Lf" RN
 				RN,
-				us_bool_to_string(ex->frame->online),
-				ex->dropped,
-				ex->frame->width,
-				ex->frame->height,
 				us_fpsi_get(client->fpsi, NULL),
-				ex->frame->grab_ts,
-				ex->frame->encode_begin_ts,
-				ex->frame->encode_end_ts,
-				ex->expose_begin_ts,
-				ex->expose_cmp_ts,
-				ex->expose_end_ts,
 				now_ts,
-				now_ts - ex->frame->grab_ts
+				now_ts - view->frame->grab_ts
 			);
+		} else {
+			_A_EVBUFFER_ADD(buf, RN, 2);
 		}
 	}
 
-
-	// 2. 添加H264帧数据到缓冲区
+	// 2. 添加帧数据到缓冲区: 只引用共享的payload, 不拷贝数据
 	if (!client->zero_data) {
-		// 假设ex->frame->data包含H264编码的数据
-		_A_EVBUFFER_ADD(buf, (void*)ex->frame->data, ex->frame->used);
+		while (count > 0) {
+			_A_EVBUFFER_ADD_BUFFER_REF(buf, chain[--count]->data);
+		}
 	}
 
-	if (ex->frame->format == V4L2_PIX_FMT_MJPEG){
-		_A_EVBUFFER_ADD_PRINTF(buf, RN "--" BOUNDARY RN);
+	if (view->frame->format == V4L2_PIX_FMT_MJPEG){
+		_A_EVBUFFER_ADD(buf, RN "--" _BOUNDARY RN, 4 + strlen(_BOUNDARY) + 2);
 
 		if (client->advance_headers) {
 			ADD_ADVANCE_HEADERS;
 		}
 	}
 
-	// 3. 将构建好的数据写入到客户端的连接缓冲区
-	assert(!bufferevent_write_buffer(buf_event, buf));
-	US_LOG_DEBUG("time clause from venc to evhttp is %lf ms",(us_get_now_monotonic() - ex->frame->grab_ts)*1000);
-	evbuffer_free(buf);
-
-	bufferevent_setcb(buf_event, NULL, NULL, _http_callback_stream_error, (void*)client);
-	bufferevent_enable(buf_event, EV_READ);
 #	undef ADD_ADVANCE_HEADERS
-#	undef BOUNDARY
+#	undef ADD_PART
+}
+
+static void _http_stream_add_ws(us_stream_client_s *client, struct evbuffer *buf, us_server_payload_s **chain, uint count) {
+	if (client->need_initial) {
+		_A_EVBUFFER_ADD_PRINTF(buf,
+			"HTTP/1.1 101 Switching Protocols" RN
+			"Upgrade: websocket" RN
+			"Connection: Upgrade" RN
+			"Sec-WebSocket-Accept: %s" RN
+			RN,
+			client->ws_accept
+		);
+		client->need_initial = false;
+	}
+
+	// One binary message per frame, the data is referenced like for the HTTP clients
+	while (count > 0) {
+		const us_server_payload_s *const payload = chain[--count];
+		u8 prefix[US_WS_MAX_PREFIX_SIZE];
+		const uz prefix_size = us_ws_make_prefix(prefix, payload->frame, payload->id);
+		_A_EVBUFFER_ADD(buf, prefix, prefix_size);
+		_A_EVBUFFER_ADD_BUFFER_REF(buf, payload->data);
+	}
+}
+
+static void _http_stream_client_setcb(us_stream_client_s *client, struct bufferevent *buf_event, bool write) {
+	bufferevent_setcb(buf_event,
+		(client->ws_accept != NULL ? _http_callback_ws_read : NULL),
+		(write ? _http_callback_stream_write : NULL),
+		_http_callback_stream_error, (void*)client);
+}
+
+static void _http_callback_ws_read(struct bufferevent *buf_event, void *v_client) {
+	us_stream_client_s *const client = v_client;
+	if (client->need_initial) {
+		return; // Nothing can be answered before the handshake reply, the input is kept
+	}
+	const int retval = us_ws_read_input(bufferevent_get_input(buf_event), bufferevent_get_output(buf_event));
+	if (retval < 0) {
+		_http_callback_stream_error(buf_event, BEV_EVENT_EOF, v_client);
+	} else if (retval > 0) {
+		// The echoed close frame is sent after the queued frames, then the connection is dropped
+		client->ws_closing = true;
+		bufferevent_setwatermark(buf_event, EV_WRITE, 0, 0);
+		bufferevent_setcb(buf_event, NULL, _http_callback_ws_closed, _http_callback_stream_error, v_client);
+		bufferevent_enable(buf_event, EV_WRITE);
+	}
+}
+
+static void _http_callback_ws_closed(struct bufferevent *buf_event, void *v_client) {
+	_http_callback_stream_error(buf_event, BEV_EVENT_EOF, v_client);
 }
 
 static void _http_callback_stream_error(struct bufferevent *buf_event, short what, void *v_client) {
@@ -832,7 +1558,8 @@ static void _http_callback_stream_error(struct bufferevent *buf_event, short wha
 	us_server_s *const server = client->server;
 	us_server_runtime_s *const run = server->run;
 
-	US_LIST_REMOVE_C(run->stream_clients, client, run->stream_clients_count);
+	US_MUTEX_LOCK(run->clients_mutex);
+	US_LIST_REMOVE_C(client->thread->stream_clients, client, run->stream_clients_count);
 
 	if (run->stream_clients_count == 0) {
 		atomic_store(&server->stream->run->http->has_clients, false);
@@ -845,27 +1572,29 @@ static void _http_callback_stream_error(struct bufferevent *buf_event, short wha
 	_LOG_INFO("DEL client (now=%u): %s, id=%" PRIx64 ", %s",
 		run->stream_clients_count, client->hostport, client->id, reason);
 	free(reason);
+	US_MUTEX_UNLOCK(run->clients_mutex);
+	_http_notify_state(server);
 
 	struct evhttp_connection *conn = evhttp_request_get_connection(client->request);
 	US_DELETE(conn, evhttp_connection_free);
 
 	us_fpsi_destroy(client->fpsi);
+	free(client->ws_accept);
 	free(client->key);
 	free(client->hostport);
 	free(client);
 }
 
-static void _http_send_stream(us_server_s *server, bool stream_updated, bool frame_updated) {
-	us_server_runtime_s *const run = server->run;
-	us_server_exposed_s *const ex = run->exposed;
+static void _http_send_stream(us_server_thread_s *thread, bool stream_updated, bool frame_updated) {
+	const us_server_s *const server = thread->server;
 
 	bool queued = false;
 	bool has_clients = true;
 
-	US_LIST_ITERATE(run->stream_clients, client, { // cppcheck-suppress constStatement
+	US_LIST_ITERATE(thread->stream_clients, client, { // cppcheck-suppress constStatement
 		// 对每个客户端，检查是否需要发送新帧
 		struct evhttp_connection *const conn = evhttp_request_get_connection(client->request);
-		if (conn != NULL) {
+		if (conn != NULL && !client->ws_closing) {
 			// 修复 WebKit 的 bug。当启用丢弃相同帧的选项时，
 			// WebKit 在系列中渲染最后一个帧时会有一些延迟，
 			// 因此需要发送两个帧以确保系列及时完成。
@@ -881,9 +1610,14 @@ static void _http_send_stream(us_server_s *server, bool stream_updated, bool fra
 			);
 
 			if (dual_update || frame_updated || client->need_first_frame) {
-				struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(conn);
-				bufferevent_setcb(buf_event, NULL, _http_callback_stream_write, _http_callback_stream_error, (void*)client);
-				bufferevent_enable(buf_event, EV_READ|EV_WRITE);
+				// Don't queue a frame behind the unsent one: if the write is already queued,
+				// the client will get the freshest frame from the view when it drains.
+				if (client->pending_updates == 0) {
+					struct bufferevent *const buf_event = evhttp_connection_get_bufferevent(conn);
+					_http_stream_client_setcb(client, buf_event, true);
+					bufferevent_enable(buf_event, EV_READ|EV_WRITE);
+				}
+				++client->pending_updates;
 
 				client->need_first_frame = false;
 				client->updated_prev = (frame_updated || client->need_first_frame); // Игнорировать dual
@@ -896,114 +1630,414 @@ static void _http_send_stream(us_server_s *server, bool stream_updated, bool fra
 	});
 
 	if (queued) {
-		us_fpsi_update(ex->queued_fpsi, true, NULL);
+		us_fpsi_update(thread->queued_fpsi, true, NULL);
 	} else if (!has_clients) {
-		us_fpsi_update(ex->queued_fpsi, false, NULL);
+		us_fpsi_update(thread->queued_fpsi, false, NULL);
 	}
 }
 
-static void _http_send_snapshot(us_server_s *server) {
-	us_server_exposed_s *const ex = server->run->exposed;
+static void _http_send_snapshot(us_server_thread_s *thread) {
+	const us_server_s *const server = thread->server;
 	us_blank_s *blank = NULL;
-
-#	define ADD_TIME_HEADER(x_key, x_value) { \
-			US_SNPRINTF(header_buf, 255, "%.06Lf", x_value); \
-			_A_ADD_HEADER(request, x_key, header_buf); \
-		}
-
-#	define ADD_UNSIGNED_HEADER(x_key, x_value) { \
-			US_SNPRINTF(header_buf, 255, "%u", x_value); \
-			_A_ADD_HEADER(request, x_key, header_buf); \
-		}
+	struct evbuffer *blank_data = NULL;
 
 	us_fpsi_meta_s captured_meta;
 	us_fpsi_get(server->stream->run->http->captured_fpsi, &captured_meta);
 
-	US_LIST_ITERATE(server->run->snapshot_clients, client, { // cppcheck-suppress constStatement
-		struct evhttp_request *request = client->request;
-
+	US_LIST_ITERATE(thread->snapshot_clients, client, { // cppcheck-suppress constStatement
 		const bool has_fresh_snapshot = (atomic_load(&server->stream->run->http->snapshot_requested) == 0);
 		const bool timed_out = (client->request_ts + US_MAX((uint)1, server->stream->error_delay * 3) < us_get_now_monotonic());
 
 		if (has_fresh_snapshot || timed_out) {
-			us_frame_s *frame = ex->frame;
 			if (!captured_meta.online) {
 				if (blank == NULL) {
 					blank = us_blank_init();
 					us_blank_draw(blank, "< NO SIGNAL >", captured_meta.width, captured_meta.height);
+					// Referenced by all waiting clients like the payload data
+					_A_EVBUFFER_NEW(blank_data);
+					_A_EVBUFFER_ADD(blank_data, (const void*)blank->jpeg->data, blank->jpeg->used);
 				}
-				frame = blank->jpeg;
+				_http_reply_snapshot(thread, client->request, blank->jpeg, blank_data, 0, 0, 0, 0);
+			} else {
+				const us_server_view_s *const view = &thread->view;
+				_http_reply_snapshot(
+					thread, client->request, view->frame, view->payload->data, view->payload->id,
+					client->width, client->height, client->quality);
 			}
 
-			struct evbuffer *buf;
-			_A_EVBUFFER_NEW(buf);
-			_A_EVBUFFER_ADD(buf, (const void*)frame->data, frame->used);
+			US_LIST_REMOVE(thread->snapshot_clients, client);
+			free(client);
+		}
+	});
+
+	US_DELETE(blank_data, evbuffer_free);
+	US_DELETE(blank, us_blank_destroy);
+}
+
+static void _http_reply_snapshot(
+	us_server_thread_s *thread, struct evhttp_request *request,
+	const us_frame_s *frame, struct evbuffer *data, u64 payload_id,
+	uint width, uint height, uint quality) {
 
-			_A_ADD_HEADER(request, "Cache-Control", "no-store, no-cache, must-revalidate, proxy-revalidate, pre-check=0, post-check=0, max-age=0");
-			_A_ADD_HEADER(request, "Pragma", "no-cache");
-			_A_ADD_HEADER(request, "Expires", "Mon, 3 Jan 2000 12:34:56 GMT");
+	us_server_s *const server = thread->server;
+	const us_server_runtime_s *const run = server->run;
 
-			char header_buf[256];
+#	define ADD_TIME_HEADER(x_key, x_value) { \
+			US_SNPRINTF(header_buf, 255, "%.06Lf", x_value); \
+			_A_ADD_HEADER(request, x_key, header_buf); \
+		}
 
-			ADD_TIME_HEADER("X-Timestamp", us_get_now_real());
+#	define ADD_UNSIGNED_HEADER(x_key, x_value) { \
+			US_SNPRINTF(header_buf, 255, "%u", x_value); \
+			_A_ADD_HEADER(request, x_key, header_buf); \
+		}
 
-			_A_ADD_HEADER(request, "X-UStreamer-Online",			us_bool_to_string(frame->online));
-			ADD_UNSIGNED_HEADER("X-UStreamer-Width",				frame->width);
-			ADD_UNSIGNED_HEADER("X-UStreamer-Height",				frame->height);
-			ADD_TIME_HEADER("X-UStreamer-Grab-Timestamp",			frame->grab_ts);
-			ADD_TIME_HEADER("X-UStreamer-Encode-Begin-Timestamp",	frame->encode_begin_ts);
-			ADD_TIME_HEADER("X-UStreamer-Encode-End-Timestamp",		frame->encode_end_ts);
-			ADD_TIME_HEADER("X-UStreamer-Send-Timestamp",			us_get_now_monotonic());
+	char header_buf[256];
+	char variant[64] = {0};
 
-			_A_ADD_HEADER(request, "Content-Type", "image/jpeg");
+	const bool scale = ((width > 0 || height > 0 || quality > 0) && payload_id > 0 && us_is_jpeg(frame->format));
+	if (scale) {
+		_http_get_snapshot_size(frame, &width, &height);
+		if (quality == 0) {
+			us_encoder_type_e enc_type;
+			us_encoder_get_runtime_params(server->stream->enc, &enc_type, &quality);
+		}
+		quality = US_MIN(quality, 100u);
+		US_SNPRINTF(variant, 63, "-%ux%u-q%u", width, height, quality);
+	}
 
-			evhttp_send_reply(request, HTTP_OK, "OK", buf);
-			evbuffer_free(buf);
+	_A_ADD_HEADER(request, "Cache-Control", "no-store, no-cache, must-revalidate, proxy-revalidate, pre-check=0, post-check=0, max-age=0");
+	_A_ADD_HEADER(request, "Pragma", "no-cache");
+	_A_ADD_HEADER(request, "Expires", "Mon, 3 Jan 2000 12:34:56 GMT");
 
-			US_LIST_REMOVE(server->run->snapshot_clients, client);
-			free(client);
+	if (payload_id > 0) {
+		// The blank frame has no ID and no ETag.
+		// The tag is known before scaling, so the revalidation doesn't make a thumbnail.
+		US_SNPRINTF(header_buf, 255, "\"%" PRIx64 "-%" PRIx64 "%s\"", run->etag_seed, payload_id, variant);
+		_A_ADD_HEADER(request, "ETag", header_buf);
+
+		const char *const if_none_match = _http_get_header(request, "If-None-Match");
+		if (if_none_match != NULL && strstr(if_none_match, header_buf) != NULL) {
+			evhttp_send_reply(request, HTTP_NOTMODIFIED, "Not Modified", NULL);
+			return;
 		}
-	});
+	}
+
+	// The body only references the shared data, so a burst of requests doesn't copy the frame
+	struct evbuffer *buf;
+	_A_EVBUFFER_NEW(buf);
+
+	us_frame_s scaled = {0};
+	if (scale) {
+		// The thumbnails are made once per frame, size and quality and cached
+		if (us_thumbs_get(run->thumbs, frame, payload_id, width, height, quality, &scaled, buf) < 0) {
+			evbuffer_free(buf);
+			evhttp_send_error(request, HTTP_INTERNAL, NULL);
+			return;
+		}
+		frame = &scaled;
+	} else {
+		_A_EVBUFFER_ADD_BUFFER_REF(buf, data);
+	}
 
-#	undef ADD_UNSUGNED_HEADER
+	ADD_TIME_HEADER("X-Timestamp", us_get_now_real());
+
+	_A_ADD_HEADER(request, "X-UStreamer-Online",			us_bool_to_string(frame->online));
+	ADD_UNSIGNED_HEADER("X-UStreamer-Width",				frame->width);
+	ADD_UNSIGNED_HEADER("X-UStreamer-Height",				frame->height);
+	ADD_TIME_HEADER("X-UStreamer-Grab-Timestamp",			frame->grab_ts);
+	ADD_TIME_HEADER("X-UStreamer-Encode-Begin-Timestamp",	frame->encode_begin_ts);
+	ADD_TIME_HEADER("X-UStreamer-Encode-End-Timestamp",		frame->encode_end_ts);
+	ADD_TIME_HEADER("X-UStreamer-Send-Timestamp",			us_get_now_monotonic());
+
+	_A_ADD_HEADER(request, "Content-Type", "image/jpeg");
+
+	evhttp_send_reply(request, HTTP_OK, "OK", buf);
+	evbuffer_free(buf);
+
+#	undef ADD_UNSIGNED_HEADER
 #	undef ADD_TIME_HEADER
+}
 
-	US_DELETE(blank, us_blank_destroy);
+static void _http_get_snapshot_size(const us_frame_s *frame, uint *width, uint *height) {
+	// Fits the requested size keeping the aspect ratio, the snapshots are never upscaled
+	const ull fw = frame->width;
+	const ull fh = frame->height;
+	ull w = *width;
+	ull h = *height;
+	if (w == 0 && h == 0) {
+		w = fw;
+		h = fh;
+	} else if (h == 0) {
+		h = fh * w / fw;
+	} else if (w == 0) {
+		w = fw * h / fh;
+	} else if (w * fh <= h * fw) {
+		h = fh * w / fw;
+	} else {
+		w = fw * h / fh;
+	}
+	if (w > fw || h > fh) {
+		w = fw;
+		h = fh;
+	}
+	*width = US_MAX(w, 1ull);
+	*height = US_MAX(h, 1ull);
+}
+
+static void _http_state_notifier(int fd, short what, void *v_thread) {
+	(void)fd;
+	(void)what;
+
+	us_server_thread_s *const thread = v_thread;
+	if (thread->state_clients != NULL) {
+		_http_send_state(thread);
+	}
+}
+
+static void _http_notify_state(us_server_s *server) {
+	const us_server_runtime_s *const run = server->run;
+	for (uint number = 0; number < run->n_threads; ++number) {
+		event_active(run->threads[number].state_notifier, 0, 0);
+	}
+}
+
+static void _http_send_state(us_server_thread_s *thread) {
+	us_server_state_s state = {0};
+	_state_collect(thread, &state);
+
+	struct evbuffer *const buf = thread->part_buf;
+	assert(evbuffer_get_length(buf) == 0);
+	if (thread->state_clients != NULL && _state_render(buf, &thread->state, &state)) {
+		const uz size = evbuffer_get_length(buf);
+		const u8 *const data = evbuffer_pullup(buf, -1);
+		US_LIST_ITERATE(thread->state_clients, client, { // cppcheck-suppress constStatement
+			struct evhttp_connection *const conn = evhttp_request_get_connection(client->request);
+			if (conn != NULL) {
+				assert(!bufferevent_write(evhttp_connection_get_bufferevent(conn), data, size));
+			}
+		});
+		evbuffer_drain(buf, size);
+	}
+
+	free(thread->state.clients_stat);
+	thread->state = state;
+}
+
+static void _state_collect_source(us_server_thread_s *thread, us_server_state_s *state) {
+	const us_server_s *const server = thread->server;
+	const us_frame_s *const frame = thread->view.frame;
+	state->online = (frame != NULL && frame->online);
+	state->width = (server->fake_width ? server->fake_width : (frame != NULL ? frame->width : 0));
+	state->height = (server->fake_height ? server->fake_height : (frame != NULL ? frame->height : 0));
+}
+
+static void _state_collect(us_server_thread_s *thread, us_server_state_s *state) {
+	us_server_s *const server = thread->server;
+	us_server_runtime_s *const run = server->run;
+
+	_state_collect_source(thread, state);
+	state->captured_fps = us_fpsi_get(server->stream->run->http->captured_fpsi, NULL);
+
+	state->queued_fps = 0;
+	for (uint number = 0; number < run->n_threads; ++number) {
+		state->queued_fps = US_MAX(state->queued_fps, us_fpsi_get(run->threads[number].queued_fpsi, NULL));
+	}
+
+	US_MUTEX_LOCK(run->clients_mutex);
+	state->n_clients = 0;
+	US_CALLOC(state->clients_stat, run->stream_clients_count + 1);
+	for (uint number = 0; number < run->n_threads; ++number) {
+		US_LIST_ITERATE(run->threads[number].stream_clients, client, { // cppcheck-suppress constStatement
+			assert(state->n_clients < run->stream_clients_count);
+			state->clients_stat[state->n_clients].id = client->id;
+			state->clients_stat[state->n_clients].fps = us_fpsi_get(client->fpsi, NULL);
+			++state->n_clients;
+		});
+	}
+	US_MUTEX_UNLOCK(run->clients_mutex);
+}
+
+static bool _state_render(struct evbuffer *buf, const us_server_state_s *prev, const us_server_state_s *state) {
+	// Renders an SSE event with the fields which differ from prev, or with all fields if prev is NULL.
+	// The clients which have gone away are reported as null.
+
+#	define CHANGED(x_field) (prev == NULL || prev->x_field != state->x_field)
+#	define ADD(x_fmt, ...) _A_EVBUFFER_ADD_PRINTF(buf, x_fmt, ##__VA_ARGS__)
+
+	bool clients_changed = (prev == NULL || prev->n_clients != state->n_clients);
+	for (uint index = 0; index < state->n_clients && !clients_changed; ++index) {
+		const us_server_state_client_s *const client = _state_find_client(prev, state->clients_stat[index].id);
+		clients_changed = (client == NULL || client->fps != state->clients_stat[index].fps);
+	}
+
+	const bool source_changed = (CHANGED(online) || CHANGED(width) || CHANGED(height) || CHANGED(captured_fps));
+	const bool stream_changed = (CHANGED(queued_fps) || clients_changed);
+	if (!source_changed && !stream_changed) {
+		return false;
+	}
+
+	ADD("event: state" RN "data: {");
+
+	if (source_changed) {
+		const char *comma = "";
+		ADD("\"source\": {");
+		if (CHANGED(width) || CHANGED(height)) {
+			ADD("\"resolution\": {\"width\": %u, \"height\": %u}", state->width, state->height);
+			comma = ", ";
+		}
+		if (CHANGED(online)) {
+			ADD("%s\"online\": %s", comma, us_bool_to_string(state->online));
+			comma = ", ";
+		}
+		if (CHANGED(captured_fps)) {
+			ADD("%s\"captured_fps\": %u", comma, state->captured_fps);
+		}
+		ADD("}");
+	}
+
+	if (stream_changed) {
+		const char *comma = "";
+		ADD("%s\"stream\": {", (source_changed ? ", " : ""));
+		if (CHANGED(queued_fps)) {
+			ADD("\"queued_fps\": %u", state->queued_fps);
+			comma = ", ";
+		}
+		if (clients_changed) {
+			ADD("%s\"clients\": %u, \"clients_stat\": {", comma, state->n_clients);
+			comma = "";
+			for (uint index = 0; index < state->n_clients; ++index) {
+				const us_server_state_client_s *const client = &state->clients_stat[index];
+				const us_server_state_client_s *const prev_client = (prev != NULL ? _state_find_client(prev, client->id) : NULL);
+				if (prev_client == NULL || prev_client->fps != client->fps) {
+					ADD("%s\"%" PRIx64 "\": {\"fps\": %u}", comma, client->id, client->fps);
+					comma = ", ";
+				}
+			}
+			for (uint index = 0; prev != NULL && index < prev->n_clients; ++index) {
+				const us_server_state_client_s *const prev_client = &prev->clients_stat[index];
+				if (_state_find_client(state, prev_client->id) == NULL) {
+					ADD("%s\"%" PRIx64 "\": null", comma, prev_client->id);
+					comma = ", ";
+				}
+			}
+			ADD("}");
+		}
+		ADD("}");
+	}
+
+	ADD("}" RN RN);
+
+#	undef ADD
+#	undef CHANGED
+	return true;
+}
+
+static const us_server_state_client_s *_state_find_client(const us_server_state_s *state, u64 id) {
+	for (uint index = 0; index < state->n_clients; ++index) {
+		if (state->clients_stat[index].id == id) {
+			return &state->clients_stat[index];
+		}
+	}
+	return NULL;
 }
 
-static void _http_refresher(int fd, short what, void *v_server) {
+static void _http_exposer(int fd, short what, void *v_server) {
+	(void)what;
+
+	eventfd_t count;
+	(void)eventfd_read(fd, &count); // Just reset the counter, all frames are taken from the ring
+	_expose((us_server_s*)v_server, false);
+}
+
+static void _http_repeater(int fd, short what, void *v_server) {
+	(void)fd;
+	(void)what;
+
+	// The timer is restarted on every stream update, so it fires
+	// only if there were no new frames during the interval.
+	_expose((us_server_s*)v_server, true);
+}
+
+static void _http_refresher(int fd, short what, void *v_thread) {
 	(void)fd;
 	(void)what;
 
-	us_server_s *server = v_server;
-	us_server_exposed_s *ex = server->run->exposed;
+	us_server_thread_s *const thread = v_thread;
+
+	bool stream_updated;
+	bool frame_updated;
+	_view_sync(thread, &stream_updated, &frame_updated);
+
+	// 调用 _http_send_stream 函数发送流数据给当前线程的客户端
+	_http_send_stream(thread, stream_updated, frame_updated);
+	// 调用 _http_send_snapshot 函数处理快照请求 ?
+	_http_send_snapshot(thread);
+
+	if (stream_updated && thread->state_clients != NULL) {
+		// The source changes are pushed right away, the rest is checked by the ticker
+		us_server_state_s source = thread->state;
+		_state_collect_source(thread, &source);
+		if (
+			source.online != thread->state.online
+			|| source.width != thread->state.width
+			|| source.height != thread->state.height
+		) {
+			_http_send_state(thread);
+		}
+	}
+}
+
+static void _expose(us_server_s *server, bool repeat) {
+	us_server_runtime_s *const run = server->run;
+	us_server_exposed_s *const ex = run->exposed;
 	us_ring_s *const ring = server->stream->run->http->jpeg_ring;
 
 	bool stream_updated = false;
 	bool frame_updated = false;
 
-	// 从 JPEG 环形缓冲区获取最新的帧
-	const int ri = us_ring_consumer_acquire(ring, 0);
-	if (ri >= 0) {
-		const us_frame_s *const frame = ring->items[ri];
-		// 如果获取到新帧，调用 _expose_frame 函数更新暴露的帧
-		frame_updated = _expose_frame(server, frame);
-		stream_updated = true;
-		us_ring_consumer_release(ring, ri);
-	} else if (ex->expose_end_ts + 1 < us_get_now_monotonic()) {
+	US_MUTEX_LOCK(ex->mutex);
+
+	if (repeat) {
 		// 如果长时间没有新帧，重置暴露帧的时间戳
 		_LOG_DEBUG("Repeating exposed ...");
 		ex->expose_begin_ts = us_get_now_monotonic();
 		ex->expose_cmp_ts = ex->expose_begin_ts;
 		ex->expose_end_ts = ex->expose_begin_ts;
+		_expose_render_parts(ex);
 		frame_updated = true;
 		stream_updated = true;
+	} else {
+		// 从 JPEG 环形缓冲区获取所有的帧. H.264/H.265 can't be decoded
+		// without the intermediate frames, so none of them is skipped here.
+		int ri;
+		while ((ri = us_ring_consumer_acquire(ring, 0)) >= 0) {
+			// The reference is taken from the ring, so the slot is free right away
+			us_frame_s *const frame = ring->items[ri];
+			ring->items[ri] = NULL;
+			us_ring_consumer_release(ring, ri);
+			// 如果获取到新帧，调用 _expose_frame 函数更新暴露的帧
+			frame_updated |= _expose_frame(server, frame);
+			stream_updated = true;
+			us_frame_unref(frame);
+		}
 	}
 
-	// 调用 _http_send_stream 函数发送流数据给所有连接的客户端
-	_http_send_stream(server, stream_updated, frame_updated);
-	// 调用 _http_send_snapshot 函数处理快照请求 ?
-	_http_send_snapshot(server);
+	if (stream_updated) {
+		++ex->stream_seq;
+	}
+	if (frame_updated) {
+		++ex->frame_seq;
+	}
+
+	US_MUTEX_UNLOCK(ex->mutex);
+
+	if (stream_updated) {
+		assert(!event_add(run->repeater, &_REPEAT_INTERVAL));
+		for (uint number = 0; number < run->n_threads; ++number) {
+			event_active(run->threads[number].refresher, 0, 0);
+		}
+	}
 
 	// 检查是否需要通知父进程关于帧状态的变化
 	// 这里大概率是通知KVMD
@@ -1023,7 +2057,7 @@ static void _http_refresher(int fd, short what, void *v_server) {
 	}
 }
 
-static bool _expose_frame(us_server_s *server, const us_frame_s *frame) {
+static bool _expose_frame(us_server_s *server, us_frame_s *frame) {
 	us_server_exposed_s *const ex = server->run->exposed;
 
 	_LOG_DEBUG("Updating exposed frame (online=%d) ...", frame->online);
@@ -1044,6 +2078,8 @@ static bool _expose_frame(us_server_s *server, const us_frame_s *frame) {
 			_LOG_VERBOSE("Dropped same frame number %u; cmp_time=%.06Lf",
 				ex->dropped, (ex->expose_cmp_ts - ex->expose_begin_ts));
 			ex->dropped += 1;
+			us_metrics_drop(server->stream->run->http->metrics, US_METRICS_DROP_SAME_FRAME);
+			_expose_render_parts(ex);
 			return false; // 帧未更新
 		} else {
 			// 如果不需要丢弃或帧不同，记录比较时间
@@ -1053,30 +2089,240 @@ static bool _expose_frame(us_server_s *server, const us_frame_s *frame) {
 		}
 	}
 
+	// 把帧的引用放到一个新的payload里面。旧的payload由还没发完它的客户端和其他线程继续引用，
+	// 最后一个引用释放之后才会被回收。
+	us_server_payload_s *const payload = _payload_acquire(ex);
 	if (frame->used == 0) {
 		// Фрейм нулевой длины означает, что мы просто должны повторить то,
 		// что у нас уже есть, с поправкой на онлайн.
-		// 帧长度为0，只更新在线状态
-		ex->frame->online = frame->online;
+		// 帧长度为0，只更新在线状态. The payloads are immutable, so the current one is copied.
+		payload->frame = us_frame_pool_get(server->stream->run->http->frames);
+		us_frame_copy(ex->frame, payload->frame);
+		payload->frame->online = frame->online;
 	} else {
-		// 否则，复制整个帧
-		us_frame_copy(frame, ex->frame);
+		payload->frame = us_frame_ref(frame);
 	}
+	_payload_install(ex, payload);
 
 	// 重置丢弃计数和更新时间戳
 	ex->dropped = 0;
 	ex->expose_cmp_ts = ex->expose_begin_ts;
 	ex->expose_end_ts = us_get_now_monotonic();
 
+	_expose_render_parts(ex);
+
+	if (frame->used > 0) {
+		us_tracer_span("expose", us_tracer_get_id(frame->grab_ts), ex->expose_begin_ts, ex->expose_end_ts);
+		us_metrics_s *const metrics = server->stream->run->http->metrics;
+		us_metrics_observe(metrics, US_METRICS_GRAB_TO_ENCODE, frame->grab_ts, frame->encode_begin_ts);
+		us_metrics_observe(metrics, US_METRICS_ENCODE, frame->encode_begin_ts, frame->encode_end_ts);
+		us_metrics_observe(metrics, US_METRICS_ENCODE_TO_EXPOSE, frame->encode_end_ts, ex->expose_end_ts);
+	}
+
 	_LOG_VERBOSE("Exposed frame: online=%d, exp_time=%.06Lf",
 		 ex->frame->online, (ex->expose_end_ts - ex->expose_begin_ts));
 	return true; // Updated
 }
 
+static void _expose_render_parts(us_server_exposed_s *ex) {
+	// Everything except the per-client fields is the same for all clients,
+	// so the multipart headers are rendered once for the exposed frame.
+
+	us_server_parts_s *const parts = &ex->parts;
+	const us_frame_s *const frame = ex->frame;
+
+#	define RENDER(x_part, x_fmt, ...) { \
+			const int m_size = snprintf((x_part)->data, sizeof((x_part)->data), x_fmt, ##__VA_ARGS__); \
+			assert(m_size > 0 && (uz)m_size < sizeof((x_part)->data)); \
+			(x_part)->size = m_size; \
+		}
+
+#	define RENDER_HEAD(x_part, x_used) RENDER(x_part, \
+			"Content-Type: image/jpeg" RN \
+			"Content-Length: %zu" RN, \
+			(x_used) \
+		)
+
+	RENDER_HEAD(&parts->head, frame->used);
+	RENDER_HEAD(&parts->head_zero, (uz)0);
+
+	RENDER(&parts->extra,
+		"X-UStreamer-Online: %s" RN
+		"X-UStreamer-Dropped: %u" RN
+		"X-UStreamer-Width: %u" RN
+		"X-UStreamer-Height: %u" RN
+		"X-UStreamer-Grab-Time: %.06Lf" RN
+		"X-UStreamer-Encode-Begin-Time: %.06Lf" RN
+		"X-UStreamer-Encode-End-Time: %.06Lf" RN
+		"X-UStreamer-Expose-Begin-Time: %.06Lf" RN
+		"X-UStreamer-Expose-Cmp-Time: %.06Lf" RN
+		"X-UStreamer-Expose-End-Time: %.06Lf" RN,
+		us_bool_to_string(frame->online),
+		ex->dropped,
+		frame->width,
+		frame->height,
+		frame->grab_ts,
+		frame->encode_begin_ts,
+		frame->encode_end_ts,
+		ex->expose_begin_ts,
+		ex->expose_cmp_ts,
+		ex->expose_end_ts
+	);
+
+#	undef RENDER_HEAD
+#	undef RENDER
+}
+
+static void _view_sync(us_server_thread_s *thread, bool *stream_updated, bool *frame_updated) {
+	// Copies the exposed frame to the thread view, so the clients of the thread
+	// can be served without holding the exposed mutex.
+
+	us_server_exposed_s *const ex = thread->server->run->exposed;
+	us_server_view_s *const view = &thread->view;
+
+	US_MUTEX_LOCK(ex->mutex);
+	*stream_updated = (view->stream_seq != ex->stream_seq);
+	*frame_updated = (view->frame_seq != ex->frame_seq);
+	if (*stream_updated || *frame_updated || view->payload == NULL) {
+		if (view->payload != ex->payload) {
+			_payload_ref(ex->payload);
+			US_DELETE(view->payload, _payload_unref);
+			view->payload = ex->payload;
+			view->frame = ex->frame;
+		}
+		view->parts = ex->parts;
+		view->stream_seq = ex->stream_seq;
+		view->frame_seq = ex->frame_seq;
+	}
+	US_MUTEX_UNLOCK(ex->mutex);
+}
+
+static us_server_payload_s *_payload_acquire(us_server_exposed_s *ex) {
+	US_MUTEX_LOCK(ex->pool_mutex);
+	us_server_payload_s *payload = ex->free_payloads;
+	if (payload != NULL) {
+		US_LIST_REMOVE_C(ex->free_payloads, payload, ex->n_free_payloads);
+	}
+	US_MUTEX_UNLOCK(ex->pool_mutex);
+
+	if (payload == NULL) {
+		US_CALLOC(payload, 1);
+		payload->ex = ex;
+	}
+	assert(payload->frame == NULL); // Set by the caller
+	return payload;
+}
+
+static void _payload_install(us_server_exposed_s *ex, us_server_payload_s *payload) {
+	assert(payload->frame->used > 0);
+	assert(payload->data == NULL);
+
+	_A_EVBUFFER_NEW(payload->data);
+	// The client chains referencing the data may be released by any HTTP thread
+	assert(!evbuffer_enable_locking(payload->data, NULL));
+	assert(!evbuffer_add_reference(payload->data,
+		payload->frame->data, payload->frame->used,
+		_payload_cleanup, (void*)payload));
+	atomic_store(&payload->refs, 1);
+	payload->id = ++ex->last_payload_id;
+	payload->expose_ts = us_get_now_monotonic();
+
+	assert(payload->gop_prev == NULL);
+	payload->gop_size = 1;
+	payload->gop_broken = false;
+	if (payload->frame->format != V4L2_PIX_FMT_MJPEG && !payload->frame->key) {
+		if (
+			ex->payload != NULL
+			&& ex->payload->frame->format == payload->frame->format
+			&& !ex->payload->gop_broken
+			&& ex->payload->gop_size < _MAX_GOP_FRAMES
+		) {
+			// Chains the GOP for the late joiners, it's released on the next keyframe
+			_payload_ref(ex->payload);
+			payload->gop_prev = ex->payload;
+			payload->gop_size = ex->payload->gop_size + 1;
+		} else {
+			// A truncated GOP can't be decoded, so the chain isn't cached anymore
+			// and the rest of the GOP is sent only to the clients which have got its beginning.
+			payload->gop_broken = true;
+		}
+	}
+
+	if (ex->payload != NULL) {
+		// The thread views and the chains which are still queued
+		// to the clients keep the old payload alive
+		_payload_unref(ex->payload);
+	}
+	ex->payload = payload;
+	ex->frame = payload->frame;
+}
+
+static void _payload_ref(us_server_payload_s *payload) {
+	atomic_fetch_add(&payload->refs, 1);
+}
+
+static void _payload_unref(us_server_payload_s *payload) {
+	// Releasing the last frame of a GOP releases the previous ones too
+	while (payload != NULL && atomic_fetch_sub(&payload->refs, 1) == 1) {
+		us_server_payload_s *const prev = payload->gop_prev;
+		payload->gop_prev = NULL;
+		struct evbuffer *const data = payload->data;
+		payload->data = NULL;
+		evbuffer_free(data); // May call _payload_cleanup() immediately
+		payload = prev;
+	}
+}
+
+static void _payload_cleanup(const void *data, size_t size, void *v_payload) {
+	(void)data;
+	(void)size;
+
+	// Called by libevent when the last reference to the payload data has been released
+	us_server_payload_s *const payload = v_payload;
+	us_server_exposed_s *const ex = payload->ex;
+	US_DELETE(payload->frame, us_frame_unref);
+	bool recycled = false;
+	US_MUTEX_LOCK(ex->pool_mutex);
+	if (ex->n_free_payloads < _MAX_FREE_PAYLOADS) {
+		US_LIST_APPEND_C(ex->free_payloads, payload, ex->n_free_payloads);
+		recycled = true;
+	}
+	US_MUTEX_UNLOCK(ex->pool_mutex);
+	if (!recycled) {
+		_payload_destroy(payload);
+	}
+}
+
+static void _payload_destroy(us_server_payload_s *payload) {
+	assert(payload->data == NULL);
+	assert(payload->frame == NULL);
+	free(payload);
+}
+
 static const char *_http_get_header(struct evhttp_request *request, const char *key) {
 	return evhttp_find_header(evhttp_request_get_input_headers(request), key);
 }
 
+static void _http_add_raw_cors(us_server_s *server, struct evhttp_request *request, struct evbuffer *buf) {
+	// For the long-lived responses which are written directly to the bufferevent
+	if (server->allow_origin[0] != '\0') {
+		const char *const cors_headers = _http_get_header(request, "Access-Control-Request-Headers");
+		const char *const cors_method = _http_get_header(request, "Access-Control-Request-Method");
+
+		_A_EVBUFFER_ADD_PRINTF(buf,
+			"Access-Control-Allow-Origin: %s" RN
+			"Access-Control-Allow-Credentials: true" RN,
+			server->allow_origin
+		);
+		if (cors_headers != NULL) {
+			_A_EVBUFFER_ADD_PRINTF(buf, "Access-Control-Allow-Headers: %s" RN, cors_headers);
+		}
+		if (cors_method != NULL) {
+			_A_EVBUFFER_ADD_PRINTF(buf, "Access-Control-Allow-Methods: %s" RN, cors_method);
+		}
+	}
+}
+
 static char *_http_get_client_hostport(struct evhttp_request *request) {
 	char *addr = NULL;
 	unsigned short port = 0;
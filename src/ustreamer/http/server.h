@@ -22,8 +22,12 @@
 
 #pragma once
 
+#include <stdatomic.h>
+
 #include <sys/stat.h>
 
+#include <pthread.h>
+
 #include <event2/util.h>
 #include <event2/event.h>
 #include <event2/http.h>
@@ -35,16 +39,22 @@
 #include "../encoder.h"
 #include "../stream.h"
 
+#include "thumbs.h"
+#include "static.h"
+
 
 typedef struct {
-	struct us_server_sx		*server;
-	struct evhttp_request	*request;
+	struct us_server_sx			*server;
+	struct us_server_thread_sx	*thread;
+	struct evhttp_request		*request;
 
 	char	*key;
 	bool	extra_headers;
 	bool	advance_headers;
 	bool	dual_final_frames;
 	bool	zero_data;
+	char	*ws_accept; // Not NULL for the WebSocket clients
+	bool	ws_closing; // The close frame is being sent, no more frames after it
 
 	char	*hostport;
 	u64		id;
@@ -52,46 +62,177 @@ typedef struct {
 	bool	need_first_frame;
 	bool	updated_prev;
 
+	u64			sent_id; // The last sent payload
+	uint		pending_updates; // Requested since the last write, the write is queued if non-zero
+	atomic_uint	dropped; // Frames replaced by newer ones while the client was busy
+	atomic_uint	coalesced; // Writes which have served several pending updates
+
 	us_fpsi_s *fpsi;
 
 	US_LIST_DECLARE;
 } us_stream_client_s;
 
 typedef struct {
-	struct us_server_sx		*server;
-	struct evhttp_request	*request;
-	ldf						request_ts;
+	struct us_server_sx			*server;
+	struct us_server_thread_sx	*thread;
+	struct evhttp_request		*request;
+	ldf							request_ts;
+
+	// Scaling of the snapshot, zeros for the original frame
+	uint	width;
+	uint	height;
+	uint	quality;
 
 	US_LIST_DECLARE;
 } us_snapshot_client_s;
 
 typedef struct {
+	struct us_server_sx			*server;
+	struct us_server_thread_sx	*thread;
+	struct evhttp_request		*request;
+	char						*hostport;
+
+	US_LIST_DECLARE;
+} us_state_client_s;
+
+typedef struct {
+	struct us_server_sx			*server;
+	struct us_server_thread_sx	*thread;
+	struct evhttp_request		*request;
+	ldf							begin_ts;
+	struct event				*timer; // Fires once at the end of the trace
+
+	US_LIST_DECLARE;
+} us_trace_client_s;
+
+typedef struct {
+	u64		id;
+	uint	fps;
+} us_server_state_client_s;
+
+typedef struct {
+	// A subset of /state which is pushed to the /state/events clients
+	bool	online;
+	uint	width;
+	uint	height;
+	uint	captured_fps;
+	uint	queued_fps;
+	uint	n_clients;
+	us_server_state_client_s	*clients_stat;
+} us_server_state_s;
+
+typedef struct us_server_payload_sx {
 	us_frame_s	*frame;
-	us_fpsi_s	*queued_fpsi;
+	// Immutable reference to frame->data which is shared by all clients.
+	// The frame is recycled by the libevent cleanup callback
+	// after the last client has flushed it.
+	struct evbuffer	*data;
+	// One reference is held by the exposed frame and one by each thread view
+	atomic_uint		refs;
+	u64				id;
+	ldf				expose_ts;
+
+	// The previous frame of the H.264/H.265 GOP, referenced by this one.
+	// A reference to the last frame keeps the whole GOP since the keyframe.
+	struct us_server_payload_sx	*gop_prev;
+	uint						gop_size;
+	// There is no keyframe for this frame in the chain: the GOP is longer
+	// than the chain limit or has no beginning, so the new clients wait for the next one.
+	bool						gop_broken;
+
+	struct us_server_exposed_sx	*ex;
+
+	US_LIST_DECLARE;
+} us_server_payload_s;
+
+typedef struct {
+	char	data[1024];
+	uz		size;
+} us_server_part_s;
+
+typedef struct {
+	us_server_part_s	head;		// Content-Type and Content-Length
+	us_server_part_s	head_zero;	// The same with zero Content-Length for zero_data
+	us_server_part_s	extra;		// X-UStreamer-* headers except the per-client ones
+} us_server_parts_s;
+
+typedef struct {
+	u64					stream_seq;
+	u64					frame_seq;
+	us_server_payload_s	*payload;
+	us_frame_s			*frame; // Alias for payload->frame
+	us_server_parts_s	parts;
+} us_server_view_s;
+
+typedef struct us_server_exposed_sx {
+	// Updated by the first HTTP thread and copied to the views of all threads
+	pthread_mutex_t		mutex;
+	u64					stream_seq; // Incremented on every stream update
+	u64					frame_seq; // Incremented on every new or repeated frame
+
+	us_server_payload_s	*payload;
+	u64					last_payload_id;
+	us_frame_s	*frame; // Alias for payload->frame
 	uint		dropped;
 	ldf			expose_begin_ts;
 	ldf			expose_cmp_ts;
 	ldf			expose_end_ts;
 
+	us_server_parts_s	parts; // Rendered once per exposed frame
+
 	bool		notify_last_online;
 	uint		notify_last_width;
 	uint		notify_last_height;
+
+	// The last reference to a payload may be dropped by any thread
+	pthread_mutex_t		pool_mutex;
+	us_server_payload_s	*free_payloads;
+	uint				n_free_payloads;
 } us_server_exposed_s;
 
-typedef struct {
+typedef struct us_server_thread_sx {
+	struct us_server_sx	*server;
+	uint				number;
+	pthread_t			tid;
+
 	struct event_base	*base;
 	struct evhttp		*http;
+
+	struct event		*refresher; // Activated by the first thread after the exposed frame update
+	us_server_view_s	view;
+	us_fpsi_s			*queued_fpsi;
+	struct evbuffer		*part_buf; // Scratch buffer for the gathered client writes
+
+	// Changed only by the owning thread under run->clients_mutex
+	us_stream_client_s	*stream_clients;
+
+	us_snapshot_client_s *snapshot_clients;
+
+	us_state_client_s	*state_clients;
+	struct event		*state_notifier; // Activated by any thread on the stream client changes
+	struct event		*state_ticker; // Checks the FPS every second while there are state clients
+	us_server_state_s	state; // The last one sent to the state clients
+
+	us_trace_client_s	*trace_clients;
+} us_server_thread_s;
+
+typedef struct {
+	us_server_thread_s	*threads;
+	uint				n_threads;
 	evutil_socket_t		ext_fd; // Unix or socket activation
 
 	char				*auth_token;
+	u64					etag_seed; // Makes the snapshot ETags unique for the process
+	us_thumbs_s			*thumbs; // Scaled snapshots shared by all threads
+	us_static_cache_s	*static_cache; // For --static
 
-	struct event		*refresher;
 	us_server_exposed_s	*exposed;
+	struct event		*exposer; // Woken up by the stream on every new JPEG frame
+	struct event		*repeater; // Repeats the exposed frame if there are no new ones
 
-	us_stream_client_s	*stream_clients;
-	uint				stream_clients_count;
-
-	us_snapshot_client_s *snapshot_clients;
+	// Guards the stream client lists of all threads against the other threads
+	pthread_mutex_t		clients_mutex;
+	uint				stream_clients_count; // For all threads
 } us_server_runtime_s;
 
 typedef struct us_server_sx {
@@ -110,6 +251,8 @@ typedef struct us_server_sx {
 
 	bool	tcp_nodelay;
 	uint	timeout;
+	uint	threads;
+	uint	stream_wm;
 
 	char	*user;
 	char	*passwd;
@@ -24,16 +24,46 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
 #include <assert.h>
 
 #include <sys/stat.h>
 
+#include <pthread.h>
+
+#include "../../libs/types.h"
 #include "../../libs/tools.h"
+#include "../../libs/threading.h"
 #include "../../libs/logging.h"
+#include "../../libs/list.h"
 
 #include "path.h"
+#include "mime.h"
+
+
+#define _REVALIDATE_INTERVAL 1 // Seconds
+
+
+static const char *const _ENCODINGS[US_STATIC_N_VARIANTS] = {NULL, "gzip", "br"};
+static const char *const _SUFFIXES[US_STATIC_N_VARIANTS] = {"", ".gz", ".br"};
+
+
+static us_static_entry_s *_cache_find(us_static_cache_s *cache, const char *request_path);
+static void _entry_revalidate(const char *root_path, const char *request_path, us_static_entry_s *entry);
+static void _entry_copy(const us_static_entry_s *src, us_static_entry_s *dest);
+static void _entry_move(us_static_entry_s *src, us_static_entry_s *dest);
+static void _entry_reset(us_static_entry_s *entry);
+static void _entry_destroy(us_static_entry_s *entry);
+static void _variant_update(us_static_variant_s *variant, const char *path, const struct timespec *min_mtime);
+static void _variant_reset(us_static_variant_s *variant);
+static us_static_data_s *_data_load(const char *path, uz size);
+static bool _accepts_encoding(const char *accept_encoding, const char *encoding);
 
 
 char *us_find_static_file_path(const char *root_path, const char *request_path) {
@@ -82,3 +112,286 @@ ok:
 	free(simplified_path);
 	return path;
 }
+
+us_static_cache_s *us_static_cache_init(const char *root_path) {
+	us_static_cache_s *cache;
+	US_CALLOC(cache, 1);
+	cache->root_path = us_strdup(root_path);
+	US_MUTEX_INIT(cache->mutex);
+	return cache;
+}
+
+void us_static_cache_destroy(us_static_cache_s *cache) {
+	US_LIST_ITERATE(cache->entries, entry, { // cppcheck-suppress constStatement
+		_entry_destroy(entry);
+	});
+	US_MUTEX_DESTROY(cache->mutex);
+	free(cache->root_path);
+	free(cache);
+}
+
+int us_static_cache_get(us_static_cache_s *cache, const char *request_path, const char *accept_encoding, us_static_file_s *file) {
+	int retval = -1;
+
+	US_MUTEX_LOCK(cache->mutex);
+
+	us_static_entry_s *entry = _cache_find(cache, request_path);
+	const ldf now_ts = us_get_now_monotonic();
+	if (entry->checked_ts + _REVALIDATE_INTERVAL < now_ts) {
+		// The disk is accessed without the lock, so the other threads
+		// are serving the previous state of the entry meanwhile.
+		entry->checked_ts = now_ts;
+		us_static_entry_s fresh;
+		_entry_copy(entry, &fresh);
+		US_MUTEX_UNLOCK(cache->mutex);
+
+		_entry_revalidate(cache->root_path, request_path, &fresh);
+
+		US_MUTEX_LOCK(cache->mutex);
+		entry = _cache_find(cache, request_path); // It could be dropped by another thread
+		_entry_move(&fresh, entry);
+		entry->checked_ts = now_ts;
+	}
+	entry->used_ts = now_ts;
+
+	const us_static_variant_s *const identity = &entry->variants[US_STATIC_IDENTITY];
+	if (entry->path != NULL && identity->exists) {
+		US_MEMSET_ZERO(*file);
+		us_static_encoding_e encoding = US_STATIC_IDENTITY;
+		for (us_static_encoding_e index = US_STATIC_N_VARIANTS - 1; index > US_STATIC_IDENTITY; --index) {
+			if (entry->variants[index].exists) {
+				file->has_encodings = true;
+				if (encoding == US_STATIC_IDENTITY && _accepts_encoding(accept_encoding, _ENCODINGS[index])) {
+					encoding = index;
+				}
+			}
+		}
+
+		file->data = entry->variants[encoding].data;
+		if (file->data != NULL) {
+			atomic_fetch_add(&file->data->refs, 1);
+		} else {
+			US_CALLOC(file->path, strlen(entry->path) + 8);
+			sprintf(file->path, "%s%s", entry->path, _SUFFIXES[encoding]);
+		}
+		file->mime = entry->mime;
+		file->encoding = _ENCODINGS[encoding];
+		file->mtime = identity->mtime.tv_sec;
+		US_SNPRINTF(file->etag, 63, "\"%jx-%jx-%jx.%lx%s%s\"",
+			(uintmax_t)identity->ino, (uintmax_t)identity->size,
+			(uintmax_t)identity->mtime.tv_sec, identity->mtime.tv_nsec,
+			(file->encoding != NULL ? "-" : ""), (file->encoding != NULL ? file->encoding : ""));
+		retval = 0;
+	}
+
+	US_MUTEX_UNLOCK(cache->mutex);
+	return retval;
+}
+
+void us_static_data_unref(us_static_data_s *data) {
+	if (atomic_fetch_sub(&data->refs, 1) == 1) {
+		free(data->data);
+		free(data);
+	}
+}
+
+static us_static_entry_s *_cache_find(us_static_cache_s *cache, const char *request_path) {
+	US_LIST_ITERATE(cache->entries, entry, { // cppcheck-suppress constStatement
+		if (!strcmp(entry->request_path, request_path)) {
+			return entry;
+		}
+	});
+
+	if (cache->n_entries >= US_STATIC_MAX_ENTRIES) {
+		// The least recently used entry goes away, the files referenced by the replies are kept
+		us_static_entry_s *lru = cache->entries;
+		US_LIST_ITERATE(cache->entries, entry, { // cppcheck-suppress constStatement
+			if (entry->used_ts < lru->used_ts) {
+				lru = entry;
+			}
+		});
+		US_LIST_REMOVE_C(cache->entries, lru, cache->n_entries);
+		_entry_destroy(lru);
+	}
+
+	us_static_entry_s *entry;
+	US_CALLOC(entry, 1);
+	entry->request_path = us_strdup(request_path);
+	entry->checked_ts = -_REVALIDATE_INTERVAL - 1; // Forces the first check
+	US_LIST_APPEND_C(cache->entries, entry, cache->n_entries);
+	return entry;
+}
+
+static void _entry_revalidate(const char *root_path, const char *request_path, us_static_entry_s *entry) {
+	// The path lookup is memoized too: the file may appear or go away
+	char *const path = us_find_static_file_path(root_path, request_path);
+	if (path == NULL) {
+		_entry_reset(entry);
+		return;
+	}
+	if (entry->path == NULL || strcmp(entry->path, path)) {
+		US_DELETE(entry->path, free);
+		entry->path = path;
+		entry->mime = us_guess_mime_type(path);
+	} else {
+		free(path);
+	}
+
+	us_static_variant_s *const identity = &entry->variants[US_STATIC_IDENTITY];
+	_variant_update(identity, entry->path, NULL);
+
+	char *variant_path;
+	US_CALLOC(variant_path, strlen(entry->path) + 8);
+	for (uint index = US_STATIC_IDENTITY + 1; index < US_STATIC_N_VARIANTS; ++index) {
+		if (identity->exists) {
+			sprintf(variant_path, "%s%s", entry->path, _SUFFIXES[index]);
+			// The precompressed file which is older than the original one is outdated
+			_variant_update(&entry->variants[index], variant_path, &identity->mtime);
+		} else {
+			_variant_reset(&entry->variants[index]);
+		}
+	}
+	free(variant_path);
+}
+
+static void _entry_copy(const us_static_entry_s *src, us_static_entry_s *dest) {
+	// Only the state of the file, the references to the data are taken
+	US_MEMSET_ZERO(*dest);
+	dest->path = (src->path != NULL ? us_strdup(src->path) : NULL);
+	dest->mime = src->mime;
+	for (uint index = 0; index < US_STATIC_N_VARIANTS; ++index) {
+		dest->variants[index] = src->variants[index];
+		if (dest->variants[index].data != NULL) {
+			atomic_fetch_add(&dest->variants[index].data->refs, 1);
+		}
+	}
+}
+
+static void _entry_move(us_static_entry_s *src, us_static_entry_s *dest) {
+	_entry_reset(dest);
+	dest->path = src->path;
+	dest->mime = src->mime;
+	memcpy(dest->variants, src->variants, sizeof(src->variants));
+	US_MEMSET_ZERO(*src);
+}
+
+static void _entry_reset(us_static_entry_s *entry) {
+	US_DELETE(entry->path, free);
+	entry->mime = NULL;
+	for (uint index = 0; index < US_STATIC_N_VARIANTS; ++index) {
+		_variant_reset(&entry->variants[index]);
+	}
+}
+
+static void _entry_destroy(us_static_entry_s *entry) {
+	_entry_reset(entry);
+	free(entry->request_path);
+	free(entry);
+}
+
+static void _variant_update(us_static_variant_s *variant, const char *path, const struct timespec *min_mtime) {
+	struct stat st;
+	if (stat(path, &st) < 0 || !S_ISREG(st.st_mode)) {
+		_variant_reset(variant);
+		return;
+	}
+	if (min_mtime != NULL && (
+		st.st_mtim.tv_sec < min_mtime->tv_sec
+		|| (st.st_mtim.tv_sec == min_mtime->tv_sec && st.st_mtim.tv_nsec < min_mtime->tv_nsec)
+	)) {
+		_variant_reset(variant);
+		return;
+	}
+	if (
+		variant->exists
+		&& variant->dev == st.st_dev
+		&& variant->ino == st.st_ino
+		&& variant->size == st.st_size
+		&& variant->mtime.tv_sec == st.st_mtim.tv_sec
+		&& variant->mtime.tv_nsec == st.st_mtim.tv_nsec
+	) {
+		return; // Not changed
+	}
+
+	_variant_reset(variant);
+	if (st.st_size > US_STATIC_MAX_CACHED_SIZE) {
+		// Only the state is cached, the big file isn't pinned in memory
+		US_LOG_VERBOSE("HTTP: Static file %s is too big to be cached (%jd bytes)", path, (intmax_t)st.st_size);
+	} else if ((variant->data = _data_load(path, st.st_size)) != NULL) {
+		US_LOG_VERBOSE("HTTP: Cached static file %s (%zu bytes)", path, variant->data->size);
+	} else {
+		return;
+	}
+	variant->exists = true;
+	variant->dev = st.st_dev;
+	variant->ino = st.st_ino;
+	variant->size = st.st_size;
+	variant->mtime = st.st_mtim;
+}
+
+static void _variant_reset(us_static_variant_s *variant) {
+	US_DELETE(variant->data, us_static_data_unref);
+	US_MEMSET_ZERO(*variant);
+}
+
+static us_static_data_s *_data_load(const char *path, uz size) {
+	// The file is read instead of mmap() because it can be truncated
+	// in place by a deploy, and the mapping would crash the server then.
+	us_static_data_s *data;
+	US_CALLOC(data, 1);
+	atomic_init(&data->refs, 1);
+
+	int fd = -1;
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		US_LOG_PERROR("HTTP: Can't open static file %s", path);
+		goto error;
+	}
+	if (size > 0) {
+		US_CALLOC(data->data, size);
+		while (data->size < size) {
+			const sz retval = read(fd, data->data + data->size, size - data->size);
+			if (retval < 0 && errno == EINTR) {
+				continue;
+			} else if (retval < 0) {
+				US_LOG_PERROR("HTTP: Can't read static file %s", path);
+				goto error;
+			} else if (retval == 0) {
+				break; // Truncated meanwhile, will be reloaded on the next check
+			}
+			data->size += retval;
+		}
+	}
+	close(fd);
+	return data;
+
+error:
+	US_CLOSE_FD(fd);
+	us_static_data_unref(data);
+	return NULL;
+}
+
+static bool _accepts_encoding(const char *accept_encoding, const char *encoding) {
+	// Something like "gzip, deflate;q=0.5, br;q=0"
+	if (accept_encoding == NULL) {
+		return false;
+	}
+	const uz len = strlen(encoding);
+	for (const char *ptr = accept_encoding; *ptr != '\0';) {
+		ptr += strspn(ptr, " \t,");
+		const uz token_len = strcspn(ptr, " \t,;");
+		if (token_len == len && !strncasecmp(ptr, encoding, len)) {
+			ptr += token_len;
+			ptr += strspn(ptr, " \t");
+			if (*ptr == ';') {
+				const char *const q = strstr(ptr, "q=");
+				const char *const next = strchr(ptr, ',');
+				if (q != NULL && (next == NULL || q < next) && strtod(q + 2, NULL) <= 0) {
+					return false;
+				}
+			}
+			return true;
+		}
+		ptr += strcspn(ptr, ",");
+	}
+	return false;
+}
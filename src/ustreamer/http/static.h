@@ -22,5 +22,76 @@
 
 #pragma once
 
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <sys/types.h>
+
+#include <pthread.h>
+
+#include "../../libs/types.h"
+#include "../../libs/list.h"
+
+
+#define US_STATIC_MAX_ENTRIES 256
+#define US_STATIC_MAX_CACHED_SIZE (256 * 1024) // The bigger files are sent by evbuffer_add_file()
+
+
+typedef struct {
+	u8			*data; // The whole file, NULL if it's empty
+	uz			size;
+	atomic_uint	refs; // One for the cache and one for each reply
+} us_static_data_s;
+
+typedef struct {
+	bool				exists;
+	us_static_data_s	*data; // NULL if the file is too big to be cached
+	dev_t				dev;
+	ino_t				ino;
+	off_t				size;
+	struct timespec		mtime;
+} us_static_variant_s;
+
+typedef enum {
+	US_STATIC_IDENTITY = 0,
+	US_STATIC_GZIP,
+	US_STATIC_BR,
+	US_STATIC_N_VARIANTS,
+} us_static_encoding_e;
+
+typedef struct {
+	char				*request_path;
+	char				*path; // NULL if there is no such file
+	const char			*mime;
+	us_static_variant_s	variants[US_STATIC_N_VARIANTS];
+	ldf					checked_ts;
+	ldf					used_ts;
+
+	US_LIST_DECLARE;
+} us_static_entry_s;
+
+typedef struct {
+	char				*root_path;
+	pthread_mutex_t		mutex;
+	us_static_entry_s	*entries;
+	uint				n_entries;
+} us_static_cache_s;
+
+typedef struct {
+	us_static_data_s	*data; // Referenced for the caller, see us_static_data_unref()
+	char				*path; // The file to be sent if it's not cached, must be freed by the caller
+	const char			*mime;
+	const char			*encoding; // NULL for the original file
+	bool				has_encodings; // There are the precompressed variants, so Vary is needed
+	time_t				mtime;
+	char				etag[64];
+} us_static_file_s;
+
 
 char *us_find_static_file_path(const char *root_path, const char *request_path);
+
+us_static_cache_s *us_static_cache_init(const char *root_path);
+void us_static_cache_destroy(us_static_cache_s *cache);
+
+int us_static_cache_get(us_static_cache_s *cache, const char *request_path, const char *accept_encoding, us_static_file_s *file);
+void us_static_data_unref(us_static_data_s *data);
@@ -0,0 +1,76 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "tcp.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/socket.h>
+#include <netdb.h>
+
+#include <event2/event.h>
+#include <event2/http.h>
+#include <event2/listener.h>
+#include <event2/util.h>
+
+#include "../../libs/types.h"
+#include "../../libs/tools.h"
+#include "../../libs/logging.h"
+
+
+int us_evhttp_bind_reuseport(struct evhttp *http, struct event_base *base, const char *host, uint port) {
+	// Every HTTP thread has its own listening socket on the same address,
+	// so the kernel balances the incoming connections between the threads.
+
+	char port_str[16];
+	US_SNPRINTF(port_str, 15, "%u", port);
+
+	struct evutil_addrinfo hints = {0};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = EVUTIL_AI_PASSIVE | EVUTIL_AI_ADDRCONFIG;
+
+	struct evutil_addrinfo *ai = NULL;
+	const int err = evutil_getaddrinfo(host, port_str, &hints, &ai);
+	if (err != 0) {
+		US_LOG_ERROR("HTTP: Can't resolve [%s]:%u: %s", host, port, evutil_gai_strerror(err));
+		return -1;
+	}
+
+	struct evconnlistener *const listener = evconnlistener_new_bind(
+		base, NULL, NULL,
+		LEV_OPT_CLOSE_ON_FREE | LEV_OPT_CLOSE_ON_EXEC | LEV_OPT_REUSEABLE | LEV_OPT_REUSEABLE_PORT,
+		-1, ai->ai_addr, ai->ai_addrlen);
+	evutil_freeaddrinfo(ai);
+	if (listener == NULL) {
+		US_LOG_PERROR("HTTP: Can't bind HTTP on [%s]:%u with SO_REUSEPORT", host, port);
+		return -1;
+	}
+
+	if (evhttp_bind_listener(http, listener) == NULL) {
+		US_LOG_ERROR("HTTP: Can't evhttp_bind_listener() on [%s]:%u", host, port);
+		evconnlistener_free(listener);
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,197 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "thumbs.h"
+
+#include <string.h>
+#include <inttypes.h>
+#include <assert.h>
+
+#include <pthread.h>
+
+#include <event2/buffer.h>
+
+#include <linux/videodev2.h>
+
+#include "../../libs/types.h"
+#include "../../libs/tools.h"
+#include "../../libs/threading.h"
+#include "../../libs/logging.h"
+#include "../../libs/frame.h"
+#include "../../libs/unjpeg.h"
+#include "../encoders/cpu/encoder.h"
+
+
+static us_thumb_s *_thumbs_find(us_thumbs_s *thumbs, u64 id, uint width, uint height, uint quality);
+static us_thumb_s *_thumbs_make(us_thumbs_s *thumbs, const us_frame_s *src, u64 id, uint width, uint height, uint quality);
+static void _resize_rgb24(const us_frame_s *src, us_frame_s *dest, uint width, uint height);
+
+
+us_thumbs_s *us_thumbs_init(void) {
+	us_thumbs_s *thumbs;
+	US_CALLOC(thumbs, 1);
+	US_MUTEX_INIT(thumbs->mutex);
+	for (uint index = 0; index < US_THUMBS_MAX; ++index) {
+		thumbs->thumbs[index].jpeg = us_frame_init();
+	}
+	thumbs->decoded = us_frame_init();
+	thumbs->resized = us_frame_init();
+	thumbs->enc = us_cpu_encoder_init();
+	return thumbs;
+}
+
+void us_thumbs_destroy(us_thumbs_s *thumbs) {
+	us_cpu_encoder_destroy(thumbs->enc);
+	us_frame_destroy(thumbs->resized);
+	us_frame_destroy(thumbs->decoded);
+	for (uint index = 0; index < US_THUMBS_MAX; ++index) {
+		US_DELETE(thumbs->thumbs[index].data, evbuffer_free);
+		us_frame_destroy(thumbs->thumbs[index].jpeg);
+	}
+	US_MUTEX_DESTROY(thumbs->mutex);
+	free(thumbs);
+}
+
+void us_thumbs_trim(us_thumbs_s *thumbs) {
+	// The buffers grow back on the next snapshot
+	US_MUTEX_LOCK(thumbs->mutex);
+	for (uint index = 0; index < US_THUMBS_MAX; ++index) {
+		us_frame_shrink_data(thumbs->thumbs[index].jpeg);
+	}
+	us_frame_shrink_data(thumbs->decoded);
+	us_frame_shrink_data(thumbs->resized);
+	US_MUTEX_UNLOCK(thumbs->mutex);
+}
+
+int us_thumbs_get(
+	us_thumbs_s *thumbs, const us_frame_s *src, u64 id,
+	uint width, uint height, uint quality,
+	us_frame_s *meta, struct evbuffer *dest) {
+
+	assert(id > 0);
+	int retval = 0;
+
+	US_MUTEX_LOCK(thumbs->mutex);
+	us_thumb_s *thumb = _thumbs_find(thumbs, id, width, height, quality);
+	if (thumb == NULL) {
+		thumb = _thumbs_make(thumbs, src, id, width, height, quality);
+	}
+	if (thumb != NULL) {
+		thumb->last_ts = us_get_now_monotonic();
+		US_FRAME_COPY_META(thumb->jpeg, meta);
+		assert(!evbuffer_add_buffer_reference(dest, thumb->data));
+	} else {
+		retval = -1;
+	}
+	US_MUTEX_UNLOCK(thumbs->mutex);
+	return retval;
+}
+
+static us_thumb_s *_thumbs_find(us_thumbs_s *thumbs, u64 id, uint width, uint height, uint quality) {
+	for (uint index = 0; index < US_THUMBS_MAX; ++index) {
+		us_thumb_s *const thumb = &thumbs->thumbs[index];
+		if (
+			thumb->id == id
+			&& thumb->width == width
+			&& thumb->height == height
+			&& thumb->quality == quality
+		) {
+			return thumb;
+		}
+	}
+	return NULL;
+}
+
+static us_thumb_s *_thumbs_make(us_thumbs_s *thumbs, const us_frame_s *src, u64 id, uint width, uint height, uint quality) {
+	// The oldest frames go first, then the least recently used sizes
+	us_thumb_s *thumb = &thumbs->thumbs[0];
+	for (uint index = 1; index < US_THUMBS_MAX; ++index) {
+		us_thumb_s *const item = &thumbs->thumbs[index];
+		if (item->id < thumb->id || (item->id == thumb->id && item->last_ts < thumb->last_ts)) {
+			thumb = item;
+		}
+	}
+
+	if (us_unjpeg_scaled(src, thumbs->decoded, width, height) < 0) {
+		return NULL;
+	}
+	const us_frame_s *scaled = thumbs->decoded;
+	if (scaled->width != width || scaled->height != height) {
+		_resize_rgb24(scaled, thumbs->resized, width, height);
+		scaled = thumbs->resized;
+	}
+
+	us_cpu_encoder_compress(thumbs->enc, scaled, thumb->jpeg, quality);
+	US_DELETE(thumb->data, evbuffer_free);
+	assert((thumb->data = evbuffer_new()) != NULL);
+	assert(!evbuffer_add(thumb->data, thumb->jpeg->data, thumb->jpeg->used));
+	assert(!evbuffer_enable_locking(thumb->data, NULL));
+
+	thumb->id = id;
+	thumb->width = width;
+	thumb->height = height;
+	thumb->quality = quality;
+
+	US_LOG_VERBOSE("HTTP: Made thumbnail %ux%u, quality=%u, size=%zu, id=%" PRIx64,
+		width, height, quality, thumb->jpeg->used, id);
+	return thumb;
+}
+
+static void _resize_rgb24(const us_frame_s *src, us_frame_s *dest, uint width, uint height) {
+	// Bilinear, the DCT scaling leaves less than 2x to shrink.
+	// The inner loop works on the fixed point and is vectorized by the compiler.
+	assert(src->format == V4L2_PIX_FMT_RGB24);
+	assert(width > 0 && height > 0);
+
+	US_FRAME_COPY_META(src, dest);
+	dest->width = width;
+	dest->height = height;
+	dest->stride = width * 3;
+	us_frame_realloc_data(dest, dest->stride * height);
+	dest->used = dest->stride * height;
+
+	const uint x_step = ((src->width - 1) << 16) / US_MAX(width - 1, 1u);
+	const uint y_step = ((src->height - 1) << 16) / US_MAX(height - 1, 1u);
+
+	for (uint y = 0; y < height; ++y) {
+		const uint sy = y * y_step;
+		const uint y0 = sy >> 16;
+		const uint y1 = US_MIN(y0 + 1, src->height - 1);
+		const uint fy = (sy >> 8) & 0xFF;
+		const u8 *const row0 = src->data + y0 * src->stride;
+		const u8 *const row1 = src->data + y1 * src->stride;
+		u8 *const out = dest->data + y * dest->stride;
+
+		for (uint x = 0; x < width; ++x) {
+			const uint sx = x * x_step;
+			const uint x0 = sx >> 16;
+			const uint x1 = US_MIN(x0 + 1, src->width - 1);
+			const uint fx = (sx >> 8) & 0xFF;
+			for (uint ch = 0; ch < 3; ++ch) {
+				const uint top = row0[x0 * 3 + ch] * (256 - fx) + row0[x1 * 3 + ch] * fx;
+				const uint bottom = row1[x0 * 3 + ch] * (256 - fx) + row1[x1 * 3 + ch] * fx;
+				out[x * 3 + ch] = (top * (256 - fy) + bottom * fy) >> 16;
+			}
+		}
+	}
+}
@@ -0,0 +1,65 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include <pthread.h>
+
+#include <event2/buffer.h>
+
+#include "../../libs/types.h"
+#include "../../libs/frame.h"
+
+#include "../encoders/cpu/encoder.h"
+
+
+#define US_THUMBS_MAX 8
+
+
+typedef struct {
+	u64				id; // Payload ID of the source frame, 0 for the free slot
+	uint			width;
+	uint			height;
+	uint			quality;
+	ldf				last_ts;
+	us_frame_s		*jpeg; // Meta only, the data is moved to the buffer
+	struct evbuffer	*data; // Referenced by the replies, so the slot can be reused
+} us_thumb_s;
+
+typedef struct {
+	pthread_mutex_t	mutex;
+	us_thumb_s		thumbs[US_THUMBS_MAX];
+	us_frame_s		*decoded;
+	us_frame_s		*resized;
+	us_cpu_encoder_s *enc;
+} us_thumbs_s;
+
+
+us_thumbs_s *us_thumbs_init(void);
+void us_thumbs_destroy(us_thumbs_s *thumbs);
+void us_thumbs_trim(us_thumbs_s *thumbs);
+
+int us_thumbs_get(
+	us_thumbs_s *thumbs, const us_frame_s *src, u64 id,
+	uint width, uint height, uint quality,
+	us_frame_s *meta, struct evbuffer *dest);
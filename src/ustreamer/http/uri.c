@@ -22,6 +22,10 @@
 
 #include "uri.h"
 
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+
 #include <event2/util.h>
 #include <event2/http.h>
 #include <event2/keyvalq_struct.h>
@@ -50,3 +54,17 @@ char *us_uri_get_string(struct evkeyvalq *params, const char *key) {
 	}
 	return NULL;
 }
+
+bool us_uri_get_uint(struct evkeyvalq *params, const char *key, uint *value) {
+	const char *const value_str = evhttp_find_header(params, key);
+	if (value_str != NULL && value_str[0] >= '0' && value_str[0] <= '9') {
+		char *end = NULL;
+		errno = 0;
+		const ull tmp = strtoull(value_str, &end, 10);
+		if (errno == 0 && *end == '\0' && tmp <= UINT_MAX) {
+			*value = tmp;
+			return true;
+		}
+	}
+	return false;
+}
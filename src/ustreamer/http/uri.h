@@ -29,3 +29,4 @@
 
 bool us_uri_get_true(struct evkeyvalq *params, const char *key);
 char *us_uri_get_string(struct evkeyvalq *params, const char *key);
+bool us_uri_get_uint(struct evkeyvalq *params, const char *key, uint *value);
@@ -0,0 +1,244 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#include "ws.h"
+
+#include <string.h>
+#include <assert.h>
+
+#include <event2/buffer.h>
+
+#include "../../libs/types.h"
+#include "../../libs/tools.h"
+#include "../../libs/frame.h"
+#include "../../libs/base64.h"
+
+
+#define _GUID		"258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+#define _MAX_KEY	64
+#define _MAX_INPUT	(64 * 1024)
+#define _MAX_CONTROL	125
+
+#define _OPCODE_CLOSE	0x8
+#define _OPCODE_PING	0x9
+#define _OPCODE_PONG	0xA
+
+
+static void _sha1(const u8 *data, uz size, u8 *digest);
+
+
+char *us_ws_make_accept(const char *key) {
+	// https://datatracker.ietf.org/doc/html/rfc6455#section-4.2.2
+	const uz key_len = strlen(key);
+	if (key_len == 0 || key_len > _MAX_KEY) {
+		return NULL;
+	}
+
+	char buf[_MAX_KEY + sizeof(_GUID)];
+	memcpy(buf, key, key_len);
+	memcpy(buf + key_len, _GUID, sizeof(_GUID) - 1);
+
+	u8 digest[20];
+	_sha1((const u8*)buf, key_len + sizeof(_GUID) - 1, digest);
+
+	char *accept = NULL;
+	us_base64_encode(digest, 20, &accept, NULL);
+	return accept;
+}
+
+uz us_ws_make_prefix(u8 *dest, const us_frame_s *frame, u64 id) {
+	uz pos = 0;
+
+#	define PUT_BE(x_value, x_bytes) { \
+			const u64 m_value = (x_value); \
+			for (int m_index = (x_bytes) - 1; m_index >= 0; --m_index) { \
+				dest[pos++] = (m_value >> (m_index * 8)) & 0xFF; \
+			} \
+		}
+
+	// Unfragmented binary message from the server, no mask
+	dest[pos++] = 0x82;
+	const u64 size = US_WS_FRAME_HEADER_SIZE + frame->used;
+	if (size < 126) {
+		dest[pos++] = size;
+	} else if (size <= 0xFFFF) {
+		dest[pos++] = 126;
+		PUT_BE(size, 2);
+	} else {
+		dest[pos++] = 127;
+		PUT_BE(size, 8);
+	}
+
+	const uz header_begin = pos;
+	PUT_BE(frame->format, 4);
+	PUT_BE(frame->width, 2);
+	PUT_BE(frame->height, 2);
+	dest[pos++] = (frame->key ? 1 : 0) | (frame->online ? 2 : 0);
+	dest[pos++] = 0;
+	dest[pos++] = 0;
+	dest[pos++] = 0;
+	{
+		const double grab_ts = frame->grab_ts;
+		u64 bits;
+		memcpy(&bits, &grab_ts, sizeof(bits));
+		PUT_BE(bits, 8);
+	}
+	PUT_BE(id, 8);
+	assert(pos - header_begin == US_WS_FRAME_HEADER_SIZE);
+
+#	undef PUT_BE
+
+	return pos;
+}
+
+int us_ws_read_input(struct evbuffer *input, struct evbuffer *output) {
+	// The data messages from the client are not used, only the complete frames
+	// are dropped from the buffer. The control frames are answered
+	// as required by https://datatracker.ietf.org/doc/html/rfc6455#section-5.5
+
+	while (true) {
+		const uz avail = evbuffer_get_length(input);
+		if (avail < 2) {
+			return 0;
+		}
+
+		u8 head[14];
+		const uz head_size = US_MIN(avail, sizeof(head));
+		assert(evbuffer_copyout(input, head, head_size) == (ssize_t)head_size);
+
+		if (!(head[1] & 0x80)) {
+			return -1; // The client frames must be masked
+		}
+
+		u64 size = head[1] & 0x7F;
+		uz pos = 2;
+		if (size == 126 || size == 127) {
+			const uz bytes = (size == 126 ? 2 : 8);
+			if (head_size < pos + bytes) {
+				return 0;
+			}
+			size = 0;
+			for (uz index = 0; index < bytes; ++index) {
+				size = (size << 8) | head[pos++];
+			}
+		}
+		if (head_size < pos + 4) {
+			return 0;
+		}
+		const u8 *const mask = head + pos;
+		pos += 4;
+
+		const u8 opcode = head[0] & 0x0F;
+		const bool control = (opcode & 0x08);
+		if (size > _MAX_INPUT || (control && (size > _MAX_CONTROL || !(head[0] & 0x80)))) {
+			return -1; // The control frames are short and never fragmented
+		}
+		if (avail < pos + size) {
+			return 0;
+		}
+
+		if (opcode == _OPCODE_PING || opcode == _OPCODE_CLOSE) {
+			// Pong has the same payload. Close is echoed with the status code
+			// of the client, then the connection can be dropped.
+			u8 frame[2 + _MAX_CONTROL];
+			assert(!evbuffer_drain(input, pos));
+			assert(evbuffer_remove(input, frame + 2, size) == (int)size);
+			for (uz index = 0; index < size; ++index) {
+				frame[2 + index] ^= mask[index % 4];
+			}
+			frame[0] = 0x80 | (opcode == _OPCODE_PING ? _OPCODE_PONG : _OPCODE_CLOSE);
+			frame[1] = (opcode == _OPCODE_CLOSE ? (size >= 2 ? 2 : 0) : size);
+			assert(!evbuffer_add(output, frame, 2 + frame[1]));
+			if (opcode == _OPCODE_CLOSE) {
+				return 1;
+			}
+		} else {
+			assert(!evbuffer_drain(input, pos + size));
+		}
+	}
+}
+
+static void _sha1(const u8 *data, uz size, u8 *digest) {
+	// Only for the handshake, so the simplest implementation is enough
+
+#	define ROL(x_value, x_bits) (((x_value) << (x_bits)) | ((x_value) >> (32 - (x_bits))))
+
+	u32 hash[5] = {0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0};
+
+	const uz total = ((size + 8) / 64 + 1) * 64;
+	u8 *msg;
+	US_CALLOC(msg, total);
+	memcpy(msg, data, size);
+	msg[size] = 0x80;
+	const u64 bits = (u64)size * 8;
+	for (uint index = 0; index < 8; ++index) {
+		msg[total - 1 - index] = (bits >> (index * 8)) & 0xFF;
+	}
+
+	for (uz offset = 0; offset < total; offset += 64) {
+		u32 w[80];
+		for (uint index = 0; index < 16; ++index) {
+			const u8 *const ptr = msg + offset + index * 4;
+			w[index] = ((u32)ptr[0] << 24) | ((u32)ptr[1] << 16) | ((u32)ptr[2] << 8) | (u32)ptr[3];
+		}
+		for (uint index = 16; index < 80; ++index) {
+			w[index] = ROL(w[index - 3] ^ w[index - 8] ^ w[index - 14] ^ w[index - 16], 1);
+		}
+
+		u32 a = hash[0], b = hash[1], c = hash[2], d = hash[3], e = hash[4];
+		for (uint index = 0; index < 80; ++index) {
+			u32 f;
+			u32 k;
+			if (index < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5A827999;
+			} else if (index < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			} else if (index < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			} else {
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+			const u32 tmp = ROL(a, 5) + f + e + k + w[index];
+			e = d;
+			d = c;
+			c = ROL(b, 30);
+			b = a;
+			a = tmp;
+		}
+		hash[0] += a;
+		hash[1] += b;
+		hash[2] += c;
+		hash[3] += d;
+		hash[4] += e;
+	}
+	free(msg);
+
+	for (uint index = 0; index < 20; ++index) {
+		digest[index] = (hash[index / 4] >> (24 - (index % 4) * 8)) & 0xFF;
+	}
+
+#	undef ROL
+}
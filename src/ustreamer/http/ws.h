@@ -0,0 +1,46 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+#pragma once
+
+#include <event2/buffer.h>
+
+#include "../../libs/types.h"
+#include "../../libs/frame.h"
+
+
+// Every binary message starts with this header (big-endian):
+//   0: u32 format (V4L2 fourcc)
+//   4: u16 width
+//   6: u16 height
+//   8: u8  flags (1 - keyframe, 2 - online)
+//   9: u8  reserved[3]
+//  12: f64 grab timestamp
+//  20: u64 frame id
+// The frame data follows it.
+#define US_WS_FRAME_HEADER_SIZE	28
+#define US_WS_MAX_PREFIX_SIZE	(10 + US_WS_FRAME_HEADER_SIZE)
+
+
+char *us_ws_make_accept(const char *key);
+uz us_ws_make_prefix(u8 *dest, const us_frame_s *frame, u64 id);
+int us_ws_read_input(struct evbuffer *input, struct evbuffer *output);
@@ -90,6 +90,9 @@ int main(int argc, char *argv[]) {
 	_g_server = us_server_init(_g_stream);
 
 	if ((exit_code = options_parse(options, cap, enc, _g_stream, _g_server)) == 0) {
+		// The workers and the HTTP threads should never wait for stderr
+		us_log_async_start();
+
 #		ifdef WITH_GPIO
 		us_gpio_init();
 #		endif
@@ -0,0 +1,84 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#include "metrics.h"
+
+#include <stdatomic.h>
+
+#include "../libs/types.h"
+#include "../libs/tools.h"
+
+
+const ldf us_metrics_buckets[US_METRICS_N_BUCKETS] = {
+	0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5,
+};
+
+
+us_metrics_s *us_metrics_init(void) {
+	us_metrics_s *metrics;
+	US_CALLOC(metrics, 1); // Zeroed atomics are valid on all our platforms
+	return metrics;
+}
+
+void us_metrics_destroy(us_metrics_s *metrics) {
+	free(metrics);
+}
+
+void us_metrics_observe(us_metrics_s *metrics, us_metrics_stage_e stage, ldf begin_ts, ldf end_ts) {
+	if (begin_ts <= 0 || end_ts < begin_ts) {
+		return; // Some timestamps are not set by some encoders
+	}
+	us_metrics_histogram_s *const hist = &metrics->stages[stage];
+	const ldf value = end_ts - begin_ts;
+	uint index = 0;
+	for (; index < US_METRICS_N_BUCKETS && value > us_metrics_buckets[index]; ++index);
+	atomic_fetch_add_explicit(&hist->buckets[index], 1, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->sum_us, value * 1000000, memory_order_relaxed);
+	atomic_fetch_add_explicit(&hist->count, 1, memory_order_relaxed);
+}
+
+void us_metrics_drop(us_metrics_s *metrics, us_metrics_drop_e reason) {
+	atomic_fetch_add_explicit(&metrics->drops[reason], 1, memory_order_relaxed);
+}
+
+const char *us_metrics_stage_to_string(us_metrics_stage_e stage) {
+	switch (stage) {
+		case US_METRICS_GRAB_TO_ENCODE: return "grab_to_encode";
+		case US_METRICS_ENCODE: return "encode";
+		case US_METRICS_ENCODE_TO_EXPOSE: return "encode_to_expose";
+		case US_METRICS_EXPOSE_TO_SEND: return "expose_to_send";
+		default: break;
+	}
+	return "unknown";
+}
+
+const char *us_metrics_drop_to_string(us_metrics_drop_e reason) {
+	switch (reason) {
+		case US_METRICS_DROP_FLUENCY: return "fluency";
+		case US_METRICS_DROP_SAME_FRAME: return "same_frame";
+		case US_METRICS_DROP_NOT_TIMELY: return "not_timely";
+		case US_METRICS_DROP_RING_FULL: return "ring_full";
+		default: break;
+	}
+	return "unknown";
+}
@@ -0,0 +1,77 @@
+/*****************************************************************************
+#                                                                            #
+#    uStreamer - Lightweight and fast MJPEG-HTTP streamer.                   #
+#                                                                            #
+#    Copyright (C) 2018-2024  Maxim Devaev <mdevaev@gmail.com>               #
+#                                                                            #
+#    This program is free software: you can redistribute it and/or modify    #
+#    it under the terms of the GNU General Public License as published by    #
+#    the Free Software Foundation, either version 3 of the License, or       #
+#    (at your option) any later version.                                     #
+#                                                                            #
+#    This program is distributed in the hope that it will be useful,         #
+#    but WITHOUT ANY WARRANTY; without even the implied warranty of          #
+#    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the           #
+#    GNU General Public License for more details.                            #
+#                                                                            #
+#    You should have received a copy of the GNU General Public License       #
+#    along with this program.  If not, see <https://www.gnu.org/licenses/>.  #
+#                                                                            #
+*****************************************************************************/
+
+
+
+#pragma once
+
+#include <stdatomic.h>
+
+#include "../libs/types.h"
+
+
+#define US_METRICS_N_BUCKETS 12
+
+
+typedef enum {
+	US_METRICS_GRAB_TO_ENCODE = 0,
+	US_METRICS_ENCODE,
+	US_METRICS_ENCODE_TO_EXPOSE,
+	US_METRICS_EXPOSE_TO_SEND,
+	US_METRICS_N_STAGES,
+} us_metrics_stage_e;
+
+typedef enum {
+	US_METRICS_DROP_FLUENCY = 0,
+	US_METRICS_DROP_SAME_FRAME,
+	US_METRICS_DROP_NOT_TIMELY,
+	US_METRICS_DROP_RING_FULL,
+	US_METRICS_N_DROPS,
+	// The busy memsinks are counted by the sinks themselves
+} us_metrics_drop_e;
+
+typedef struct {
+	// Non-cumulative, the last one is +Inf
+	atomic_ullong	buckets[US_METRICS_N_BUCKETS + 1];
+	atomic_ullong	sum_us;
+	atomic_ullong	count;
+} us_metrics_histogram_s;
+
+typedef struct {
+	// Updated by any thread without locks, see us_metrics_observe()
+	us_metrics_histogram_s	stages[US_METRICS_N_STAGES];
+	atomic_ullong			drops[US_METRICS_N_DROPS];
+	atomic_ullong			http_frames;
+	atomic_ullong			http_bytes;
+} us_metrics_s;
+
+
+extern const ldf us_metrics_buckets[US_METRICS_N_BUCKETS];
+
+
+us_metrics_s *us_metrics_init(void);
+void us_metrics_destroy(us_metrics_s *metrics);
+
+void us_metrics_observe(us_metrics_s *metrics, us_metrics_stage_e stage, ldf begin_ts, ldf end_ts);
+void us_metrics_drop(us_metrics_s *metrics, us_metrics_drop_e reason);
+
+const char *us_metrics_stage_to_string(us_metrics_stage_e stage);
+const char *us_metrics_drop_to_string(us_metrics_drop_e reason);
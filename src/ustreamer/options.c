@@ -63,6 +63,7 @@ enum _US_OPT_VALUES {
 	_O_DEVICE_ERROR_DELAY,
 	_O_FORMAT_SWAP_RGB,
 	_O_M2M_DEVICE,
+	_O_CPU_INCREMENTAL,
 
 	_O_IMAGE_DEFAULT,
 	_O_BRIGHTNESS,
@@ -86,6 +87,8 @@ enum _US_OPT_VALUES {
 	_O_INSTANCE_ID,
 	_O_TCP_NODELAY,
 	_O_SERVER_TIMEOUT,
+	_O_HTTP_THREADS,
+	_O_STREAM_WM,
 
 #	define ADD_SINK(x_prefix) \
 		_O_##x_prefix, \
@@ -118,6 +121,8 @@ enum _US_OPT_VALUES {
 	_O_EXIT_ON_PARENT_DEATH,
 #	endif
 	_O_EXIT_ON_NO_CLIENTS,
+	_O_HUGE_PAGES,
+	_O_LOW_MEMORY,
 #	ifdef WITH_SETPROCTITLE
 	_O_PROCESS_NAME_PREFIX,
 #	endif
@@ -158,6 +163,7 @@ static const struct option _LONG_OPTS[] = {
 	{"device-timeout",			required_argument,	NULL,	_O_DEVICE_TIMEOUT},
 	{"device-error-delay",		required_argument,	NULL,	_O_DEVICE_ERROR_DELAY},
 	{"m2m-device",				required_argument,	NULL,	_O_M2M_DEVICE},
+	{"cpu-incremental",			no_argument,		NULL,	_O_CPU_INCREMENTAL},
 
 	{"image-default",			no_argument,		NULL,	_O_IMAGE_DEFAULT},
 	{"brightness",				required_argument,	NULL,	_O_BRIGHTNESS},
@@ -191,6 +197,8 @@ static const struct option _LONG_OPTS[] = {
 	{"fake-resolution",			required_argument,	NULL,	_O_FAKE_RESOLUTION},
 	{"tcp-nodelay",				no_argument,		NULL,	_O_TCP_NODELAY},
 	{"server-timeout",			required_argument,	NULL,	_O_SERVER_TIMEOUT},
+	{"http-threads",			required_argument,	NULL,	_O_HTTP_THREADS},
+	{"stream-wm",				required_argument,	NULL,	_O_STREAM_WM},
 
 #	define ADD_SINK(x_opt, x_prefix) \
 		{x_opt "-sink",				required_argument,	NULL,	_O_##x_prefix}, \
@@ -230,6 +238,8 @@ static const struct option _LONG_OPTS[] = {
 	{"exit-on-parent-death",	no_argument,		NULL,	_O_EXIT_ON_PARENT_DEATH},
 #	endif
 	{"exit-on-no-clients",		required_argument,	NULL,	_O_EXIT_ON_NO_CLIENTS},
+	{"huge-pages",				no_argument,		NULL,	_O_HUGE_PAGES},
+	{"low-memory",				no_argument,		NULL,	_O_LOW_MEMORY},
 #	ifdef WITH_SETPROCTITLE
 	{"process-name-prefix",		required_argument,	NULL,	_O_PROCESS_NAME_PREFIX},
 #	endif
@@ -403,6 +413,7 @@ int options_parse(us_options_s *options, us_capture_s *cap, us_encoder_s *enc, u
 			case _O_DEVICE_TIMEOUT:		OPT_NUMBER("--device-timeout", cap->timeout, 1, 60, 0);
 			case _O_DEVICE_ERROR_DELAY:	OPT_NUMBER("--device-error-delay", stream->error_delay, 1, 60, 0);
 			case _O_M2M_DEVICE:			OPT_SET(enc->m2m_path, optarg);
+			case _O_CPU_INCREMENTAL:	OPT_SET(enc->cpu_incremental, true);
 
 			case _O_IMAGE_DEFAULT:
 				OPT_CTL_DEFAULT_NOBREAK(brightness);
@@ -456,6 +467,8 @@ int options_parse(us_options_s *options, us_capture_s *cap, us_encoder_s *enc, u
 				break;
 			case _O_TCP_NODELAY:		OPT_SET(server->tcp_nodelay, true);
 			case _O_SERVER_TIMEOUT:		OPT_NUMBER("--server-timeout", server->timeout, 1, 60, 0);
+			case _O_HTTP_THREADS:		OPT_NUMBER("--http-threads", server->threads, 1, 32, 0);
+			case _O_STREAM_WM:			OPT_NUMBER("--stream-wm", server->stream_wm, 0, 16 * 1024 * 1024, 0);
 
 #			define ADD_SINK(x_opt, x_lp, x_up) \
 				case _O_##x_up:					OPT_SET(x_lp##_name, optarg); \
@@ -495,6 +508,8 @@ int options_parse(us_options_s *options, us_capture_s *cap, us_encoder_s *enc, u
 				break;
 #			endif
 			case _O_EXIT_ON_NO_CLIENTS:		OPT_NUMBER("--exit-on-no-clients", stream->exit_on_no_clients, 0, 86400, 0);
+			case _O_HUGE_PAGES:				us_frame_set_huge_pages(true); break;
+			case _O_LOW_MEMORY:				stream->low_memory = true; us_frame_set_low_memory(true); break;
 #			ifdef WITH_SETPROCTITLE
 			case _O_PROCESS_NAME_PREFIX:	OPT_SET(process_name_prefix, optarg);
 #			endif
@@ -521,6 +536,11 @@ int options_parse(us_options_s *options, us_capture_s *cap, us_encoder_s *enc, u
 		}
 	}
 
+	if (enc->cpu_incremental && enc->type != US_ENCODER_TYPE_CPU) {
+		printf("Option --cpu-incremental requires --encoder=CPU\n");
+		return -1;
+	}
+
 	US_LOG_INFO("Starting PiKVM uStreamer %s ...", US_VERSION);
 
 #	define ADD_SINK(x_label, x_prefix) { \
@@ -661,6 +681,8 @@ static void _help(FILE *fp, const us_capture_s *cap, const us_encoder_s *enc, co
 	SAY("    -c|--encoder <type>  ───────────────── Use specified encoder. It may affect the number of workers.");
 	SAY("                                           Available:");
 	SAY("                                             * CPU  ──────── Software MJPEG encoding (default);");
+	SAY("                                             * CPU-SLICED  ─ Software encoding of every frame by horizontal stripes");
+	SAY("                                                             on all workers, for the lowest latency of a frame;");
 	SAY("                                             * HW  ───────── Use pre-encoded MJPEG frames directly from camera hardware;");
 	SAY("                                             * M2M-VIDEO  ── GPU-accelerated MJPEG encoding using V4L2 M2M video interface;");
 	SAY("                                             * M2M-IMAGE  ── GPU-accelerated JPEG encoding using V4L2 M2M image interface.\n");
@@ -673,6 +695,11 @@ static void _help(FILE *fp, const us_capture_s *cap, const us_encoder_s *enc, co
 	SAY("    --device-error-delay <sec>  ────────── Delay before trying to connect to the device again");
 	SAY("                                           after an error (timeout for example). Default: %u.\n", stream->error_delay);
 	SAY("    --m2m-device </dev/path>  ──────────── Path to V4L2 M2M encoder device. Default: auto select.\n");
+	SAY("    --cpu-incremental  ─────────────────── Re-encode only the changed rows of 16 pixels by the CPU encoder");
+	SAY("                                           and reuse the rest from the previous JPEG. Requires --encoder=CPU");
+	SAY("                                           and uses a single worker, because each frame is compared");
+	SAY("                                           with the previous one. Useful for the desktops, costs a copy");
+	SAY("                                           of the raw frame. Default: disabled.\n");
 	SAY("Image control options:");
 	SAY("══════════════════════");
 	SAY("    --image-default  ────────────────────── Reset all image settings below to default. Default: no change.\n");
@@ -715,6 +742,12 @@ static void _help(FILE *fp, const us_capture_s *cap, const us_encoder_s *enc, co
 	SAY("    --instance-id <str>  ──────── A short string identifier to be displayed in the /state handle.");
 	SAY("                                  It must satisfy regexp ^[a-zA-Z0-9\\./+_-]*$. Default: an empty string.\n");
 	SAY("    --server-timeout <sec>  ───── Timeout for client connections. Default: %u.\n", server->timeout);
+	SAY("    --http-threads <N>  ───────── Number of HTTP event loops. Each loop serves its own clients,");
+	SAY("                                  TCP connections are balanced between them by the kernel (SO_REUSEPORT).");
+	SAY("                                  Default: %u.\n", server->threads);
+	SAY("    --stream-wm <bytes>  ──────── Per-client output watermark for /stream. The next frame is written");
+	SAY("                                  only after the unsent data of the client has drained to this size,");
+	SAY("                                  meanwhile newer frames replace the waiting one. Default: %u.\n", server->stream_wm);
 #	define ADD_SINK(x_name, x_opt) \
 		SAY(x_name " sink options:"); \
 		SAY("══════════════════"); \
@@ -757,6 +790,13 @@ static void _help(FILE *fp, const us_capture_s *cap, const us_encoder_s *enc, co
 #	endif
 	SAY("    --exit-on-no-clients <sec> ──── Exit the program if there have been no stream or sink clients");
 	SAY("                                    or any HTTP requests in the last N seconds. Default: 0 (disabled)\n");
+	SAY("    --huge-pages  ───────────────── Use the huge pages for the frame buffers of 2 MiB and larger.");
+	SAY("                                    Falls back to the transparent huge pages if none are reserved.");
+	SAY("                                    Default: disabled.\n");
+	SAY("    --low-memory  ───────────────── Allocate the frames on demand up to the observed peak size and keep");
+	SAY("                                    fewer spare buffers. After %d seconds without clients the spare memory", US_STREAM_IDLE_TRIM_DELAY);
+	SAY("                                    and the unused tails of the sinks are returned to the system.");
+	SAY("                                    The memory footprint is reported in /state. Default: disabled.\n");
 #	ifdef WITH_SETPROCTITLE
 	SAY("    --process-name-prefix <str>  ── Set process name prefix which will be displayed in the process list");
 	SAY("                                    like '<str>: ustreamer --blah-blah-blah'. Default: disabled.\n");
@@ -248,7 +248,7 @@ int us_rv1126_get_frame(us_frame_s* frame){
         US_LOG_ERROR("get VENC data faile");
         return false;
     }
-    US_LOG_DEBUG("get frame size %d", RK_MPI_MB_GetSize(mb));
+    US_LOG_DEBUG("get frame size %zu", (uz)RK_MPI_MB_GetSize(mb));
     frame->grab_ts = frame->encode_begin_ts = frame->encode_end_ts  = us_get_now_monotonic();
 
     // fill frame
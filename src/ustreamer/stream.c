@@ -29,6 +29,8 @@
 #include <errno.h>
 #include <assert.h>
 
+#include <sys/eventfd.h>
+
 #include <pthread.h>
 
 #include "../libs/types.h"
@@ -38,11 +40,13 @@
 #include "../libs/process.h"
 #include "../libs/logging.h"
 #include "../libs/ring.h"
+#include "../libs/mailbox.h"
 #include "../libs/frame.h"
 #include "../libs/memsink.h"
 #include "../libs/capture.h"
 #include "../libs/unjpeg.h"
 #include "../libs/fpsi.h"
+#include "../libs/tracer.h"
 #ifdef WITH_V4P
 #	include "../libs/drm/drm.h"
 #endif
@@ -59,15 +63,13 @@
 typedef struct {
 	pthread_t		tid;
 	us_capture_s	*cap;
-	us_queue_s		*queue;
-	pthread_mutex_t	*mutex;
 	atomic_bool		*stop;
 } _releaser_context_s;
 
 typedef struct {
-	pthread_t	tid;
-	us_queue_s	*queue;
-	us_stream_s	*stream;
+	pthread_t		tid;
+	us_mailbox_s	*mailbox;
+	us_stream_s		*stream;
 	atomic_bool	*stop;
 } _worker_context_s;
 
@@ -81,7 +83,7 @@ static void *_rv1126_thread(void *v_ctx);
 static void *_drm_thread(void *v_ctx);
 #endif
 
-static us_capture_hwbuf_s *_get_latest_hw(us_queue_s *queue);
+static us_capture_hwbuf_s *_get_latest_hw(us_mailbox_s *mailbox);
 
 static bool _stream_has_jpeg_clients_cached(us_stream_s *stream);
 static bool _stream_has_any_clients_cached(us_stream_s *stream);
@@ -89,10 +91,11 @@ static int _stream_init_loop(us_stream_s *stream);
 #ifdef WITH_V4P
 static void _stream_drm_ensure_no_signal(us_stream_s *stream);
 #endif
-static void _stream_expose_jpeg(us_stream_s *stream, const us_frame_s *frame);
+static void _stream_expose_jpeg(us_stream_s *stream, us_frame_s *frame);
 static void _stream_expose_raw(us_stream_s *stream, const us_frame_s *frame);
 static void _stream_encode_expose_h264(us_stream_s *stream, const us_frame_s *frame, bool force_key);
 static void _stream_check_suicide(us_stream_s *stream);
+static void _stream_check_idle(us_stream_s *stream);
 
 
 us_stream_s *us_stream_init(us_capture_s *cap, us_encoder_s *enc) {
@@ -102,11 +105,14 @@ us_stream_s *us_stream_init(us_capture_s *cap, us_encoder_s *enc) {
 	http->drm_fpsi = us_fpsi_init("DRM", true);
 #	endif
 	http->h264_fpsi = us_fpsi_init("H264", true);
-	US_RING_INIT_WITH_ITEMS(http->jpeg_ring, 4, us_frame_init);
+	http->frames = us_frame_pool_init(16);
+	http->jpeg_ring = us_ring_init(4);
+	assert((http->jpeg_ring_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) >= 0);
 	atomic_init(&http->has_clients, false);
 	atomic_init(&http->snapshot_requested, 0);
 	atomic_init(&http->last_request_ts, 0);
 	http->captured_fpsi = us_fpsi_init("STREAM-CAPTURED", true);
+	http->metrics = us_metrics_init();
 
 	us_stream_runtime_s *run;
 	US_CALLOC(run, 1);
@@ -131,8 +137,11 @@ us_stream_s *us_stream_init(us_capture_s *cap, us_encoder_s *enc) {
 }
 
 void us_stream_destroy(us_stream_s *stream) {
+	us_metrics_destroy(stream->run->http->metrics);
 	us_fpsi_destroy(stream->run->http->captured_fpsi);
-	US_RING_DELETE_WITH_ITEMS(stream->run->http->jpeg_ring, us_frame_destroy);
+	US_CLOSE_FD(stream->run->http->jpeg_ring_fd);
+	US_RING_DELETE_WITH_ITEMS(stream->run->http->jpeg_ring, us_frame_unref);
+	us_frame_pool_destroy(stream->run->http->frames);
 	us_fpsi_destroy(stream->run->http->h264_fpsi);
 #	ifdef WITH_V4P
 	us_fpsi_destroy(stream->run->http->drm_fpsi);
@@ -150,6 +159,7 @@ void us_stream_loop(us_stream_s *stream) {
 
 	// 更新最后一次请求的时间戳
 	atomic_store(&run->http->last_request_ts, us_get_now_monotonic());
+	run->idle_ts = us_get_now_monotonic();
 
 	// 如果存在H264 sink，初始化H264编码器和相关帧 ?其他编码器就不需要初始化了?即使是表面上的?
 	if (stream->h264_sink != NULL) {
@@ -170,47 +180,35 @@ void us_stream_loop(us_stream_s *stream) {
 		atomic_bool threads_stop;
 		atomic_init(&threads_stop, false);
 
-		// 初始化释放互斥锁
-		pthread_mutex_t release_mutex;
-		US_MUTEX_INIT(release_mutex);
-
-		// 获取释放器数量
-		const uint n_releasers = cap->run->n_bufs;
-		_releaser_context_s *releasers;
-		US_CALLOC(releasers, n_releasers);
-
-		// 初始化每个释放器
-		for (uint index = 0; index < n_releasers; ++index) {
-			_releaser_context_s *ctx = &releasers[index];
-			ctx->cap = cap;
-			ctx->queue = us_queue_init(1);
-			ctx->mutex = &release_mutex;
-			ctx->stop = &threads_stop;
-			US_THREAD_CREATE(ctx->tid, _releaser_thread, ctx);
-		}
+		// A single releaser for all buffers, woken up by the last us_capture_hwbuf_decref()
+		_releaser_context_s releaser = {
+			.cap = cap,
+			.stop = &threads_stop,
+		};
+		US_THREAD_CREATE(releaser.tid, _releaser_thread, &releaser);
 
 		// 定义创建工作线程的宏
-#		define CREATE_WORKER(x_cond, x_ctx, x_thread, x_capacity) \
+#		define CREATE_WORKER(x_cond, x_ctx, x_thread) \
 			_worker_context_s *x_ctx = NULL; \
 			if (x_cond) { \
 				US_CALLOC(x_ctx, 1); \
-				x_ctx->queue = us_queue_init(x_capacity); \
+				x_ctx->mailbox = us_mailbox_init(); \
 				x_ctx->stream = stream; \
 				x_ctx->stop = &threads_stop; \
 				US_THREAD_CREATE(x_ctx->tid, (x_thread), x_ctx); \
 			}
 
 		// 创建JPEG工作线程
-		CREATE_WORKER(true, jpeg_ctx, _jpeg_thread, cap->run->n_bufs);
+		CREATE_WORKER(true, jpeg_ctx, _jpeg_thread);
 		// 创建RAW工作线程
-		CREATE_WORKER((stream->raw_sink != NULL), raw_ctx, _raw_thread, 2);
+		CREATE_WORKER((stream->raw_sink != NULL), raw_ctx, _raw_thread);
 		// 创建H264工作线程
-		CREATE_WORKER((stream->h264_sink != NULL), h264_ctx, _h264_thread, cap->run->n_bufs);
-		// CREATE_WORKER((stream->rv1126_sink != NULL), rv1126_ctx, _rv1126_thread, cap->run->n_bufs);
-		// CREATE_WORKER(true, rv1126_ctx, _rv1126_thread, cap->run->n_bufs);
+		CREATE_WORKER((stream->h264_sink != NULL), h264_ctx, _h264_thread);
+		// CREATE_WORKER((stream->rv1126_sink != NULL), rv1126_ctx, _rv1126_thread);
+		// CREATE_WORKER(true, rv1126_ctx, _rv1126_thread);
 #		ifdef WITH_V4P
 		// 创建DRM工作线程
-		CREATE_WORKER((stream->drm != NULL), drm_ctx, _drm_thread, cap->run->n_bufs); // cppcheck-suppress assertWithSideEffect
+		CREATE_WORKER((stream->drm != NULL), drm_ctx, _drm_thread); // cppcheck-suppress assertWithSideEffect
 #		endif
 #		undef CREATE_WORKER
 
@@ -219,32 +217,24 @@ void us_stream_loop(us_stream_s *stream) {
 		uint slowdown_count = 0;
 		// 主循环，直到停止标志被设置
 		while (!atomic_load(&run->stop) && !atomic_load(&threads_stop)) {
-			us_capture_hwbuf_s *hw;
+			us_capture_hwbuf_s *hw = NULL;
 			if (stream->enc->type == US_ENCODER_TYPE_RV1126_H264 || stream->enc->type == US_ENCODER_TYPE_RV1126_H265 || stream->enc->type == US_ENCODER_TYPE_RV1126_MJPEG){
 				// RV1126输入绑定了VENC,所以直接调过所有代码,获取编码后的帧就行
 				//get frame from venc
-				if (us_rv1126_get_frame(run->dest)){
+				// The frame goes to the ring and the HTTP server by reference
+				us_frame_s *const frame = us_frame_pool_get(run->http->frames);
+				if (us_rv1126_get_frame(frame)){
 					// put h264 to memsink
 					// if (stream->rv1126_sink){
-						// meta.online = !us_memsink_server_put(stream->jpeg_sink, run->dest, &run->h264_key_requested);
+						// meta.online = !us_memsink_server_put(stream->jpeg_sink, frame, &run->h264_key_requested);
 						// us_fpsi_update(run->http->h264_fpsi, meta.online, &meta);
 
-						// 把数据塞进jpeg的环形队列里面
-						int ri;
-						while ((ri = us_ring_producer_acquire(run->http->jpeg_ring, 0)) < 0) {
-							if (atomic_load(&run->stop)) {
-								return;
-							}
-						}
-						us_frame_s *const dest = run->http->jpeg_ring->items[ri];
-						us_frame_copy(run->dest, dest);
-						us_ring_producer_release(run->http->jpeg_ring, ri);
-						// US_LOG_DEBUG("memsink_server_put jpeg frame %d",run->dest->used);
-						if (stream->jpeg_sink != NULL) {
-							us_memsink_server_put(stream->jpeg_sink, run->dest, NULL);
-						}
+						// 把数据塞进jpeg的环形队列里面, 并通知HTTP服务器
+						_stream_expose_jpeg(stream, frame);
+						// US_LOG_DEBUG("memsink_server_put jpeg frame %d",frame->used);
 					// }
 				}
+				us_frame_unref(frame);
 			}else{
 				// 抓取硬件缓冲区
 				switch (us_capture_hwbuf_grab(cap, &hw)) {
@@ -252,6 +242,7 @@ void us_stream_loop(us_stream_s *stream) {
 					case US_ERROR_NO_DATA: continue; // 抓取到损坏的帧
 					default: goto close; // 其他错误
 				}
+				us_capture_hwbuf_incref(hw); // Keeps the buffer until it's queued to the workers
 			}
 
 
@@ -269,29 +260,32 @@ void us_stream_loop(us_stream_s *stream) {
 			us_gpio_set_stream_online(true);
 #			endif
 
-			// 定义将硬件缓冲区加入队列的宏
-// #			define QUEUE_HW(x_ctx) if (x_ctx != NULL) { \
-// 					us_capture_hwbuf_incref(hw); \
-// 					us_queue_put(x_ctx->queue, hw, 0); \
-// 				}
-// 			// 将缓冲区加入JPEG队列
-			// 这么看的话,这里面获取到的就已经是编码后的mjpeg了
-// 			QUEUE_HW(jpeg_ctx); // 这里把原始输入塞进队列,在jpeg之类的线程里面通过_get_latest_hw()获取
-// 			// 将缓冲区加入RAW队列
-// 			QUEUE_HW(raw_ctx);
-// 			// 将缓冲区加入H264队列
-// 			QUEUE_HW(h264_ctx);
+			// 定义将硬件缓冲区加入队列的宏. The displaced buffer was not taken
+			// by the worker, so its reference is dropped here.
+			// RV1126 has no hwbuf: the encoded frame is already exposed above.
+#			define QUEUE_HW(x_ctx) if (x_ctx != NULL && hw != NULL) { \
+					us_capture_hwbuf_incref(hw); \
+					us_capture_hwbuf_s *m_prev_hw = us_mailbox_put(x_ctx->mailbox, hw); \
+					US_DELETE(m_prev_hw, us_capture_hwbuf_decref); \
+				}
+			// 将缓冲区加入JPEG队列
+			QUEUE_HW(jpeg_ctx); // 这里把原始输入塞进队列,在jpeg之类的线程里面通过_get_latest_hw()获取
+			// 将缓冲区加入RAW队列
+			QUEUE_HW(raw_ctx);
+			// 将缓冲区加入H264队列
+			QUEUE_HW(h264_ctx);
 #			ifdef WITH_V4P
 			// 将缓冲区加入DRM队列
 			QUEUE_HW(drm_ctx);
 #			endif
 #			undef QUEUE_HW
 
-			// 将缓冲区加入释放队列
-			// us_queue_put(releasers[hw->buf.index].queue, hw, 0); // Plan to release
+			// Drops the reference of the grabber, the buffer is released after the last consumer
+			US_DELETE(hw, us_capture_hwbuf_decref);
 
 			// 检查是否需要自杀,默认好像是一天,如果没有人连上来就把当前进程干了
 			_stream_check_suicide(stream);
+			_stream_check_idle(stream);
 			// 如果需要减速且没有客户端，则减速
 			if (stream->slowdown && !_stream_has_any_clients_cached(stream)) {
 				usleep(100 * 1000);
@@ -309,7 +303,7 @@ void us_stream_loop(us_stream_s *stream) {
 		// 定义删除工作线程的宏
 #		define DELETE_WORKER(x_ctx) if (x_ctx != NULL) { \
 				US_THREAD_JOIN(x_ctx->tid); \
-				us_queue_destroy(x_ctx->queue); \
+				US_MAILBOX_DELETE_WITH_ITEM(x_ctx->mailbox, us_capture_hwbuf_decref); \
 				free(x_ctx); \
 			}
 #		ifdef WITH_V4P
@@ -325,13 +319,8 @@ void us_stream_loop(us_stream_s *stream) {
 		DELETE_WORKER(jpeg_ctx);
 #		undef DELETE_WORKER
 
-		// 删除所有释放器
-		for (uint index = 0; index < n_releasers; ++index) {
-			US_THREAD_JOIN(releasers[index].tid);
-			us_queue_destroy(releasers[index].queue);
-		}
-		free(releasers);
-		US_MUTEX_DESTROY(release_mutex);
+		// 删除释放器
+		US_THREAD_JOIN(releaser.tid);
 
 		// 重置线程停止标志
 		atomic_store(&threads_stop, false);
@@ -357,28 +346,13 @@ void us_stream_loop_break(us_stream_s *stream) {
 	atomic_store(&stream->run->stop, true);
 }
 
-// 这个代码有问题,如果队列头部的引用始终不被释放,那就会一直卡主
 static void *_releaser_thread(void *v_ctx) {
 	US_THREAD_SETTLE("str_rel")
 	_releaser_context_s *ctx = v_ctx;
 
 	while (!atomic_load(ctx->stop)) {
-		us_capture_hwbuf_s *hw;
-		if (us_queue_get(ctx->queue, (void**)&hw, 0.1) < 0) {
-			continue;
-		}
-
-		while (atomic_load(&hw->refs) > 0) {
-			if (atomic_load(ctx->stop)) {
-				goto done;
-			}
-			usleep(5 * 1000);
-		}
-
-		US_MUTEX_LOCK(*ctx->mutex);
-		const int released = us_capture_hwbuf_release(ctx->cap, hw);
-		US_MUTEX_UNLOCK(*ctx->mutex);
-		if (released < 0) {
+		// The buffers are queued in the order of freeing, so a stuck one doesn't hold the others
+		if (us_capture_hwbuf_release_ready(ctx->cap, 0.1) < 0) {
 			goto done;
 		}
 	}
@@ -415,10 +389,13 @@ static void *_jpeg_thread(void *v_ctx) {
 					wr->name, us_get_now_monotonic() - job->dest->grab_ts);
 			} else {
 				US_LOG_PERF("JPEG: ----- Encoded JPEG dropped; worker=%s", wr->name);
+				us_metrics_drop(stream->run->http->metrics, US_METRICS_DROP_NOT_TIMELY);
 			}
+			// The exposed frame is referenced by the ring, the next job gets a new one
+			US_DELETE(job->dest, us_frame_unref);
 		}
 
-		us_capture_hwbuf_s *hw = _get_latest_hw(ctx->queue);
+		us_capture_hwbuf_s *hw = _get_latest_hw(ctx->mailbox);
 		if (hw == NULL) {
 			continue;
 		}
@@ -433,6 +410,7 @@ static void *_jpeg_thread(void *v_ctx) {
 		const ldf now_ts = us_get_now_monotonic();
 		if (now_ts < grab_after_ts) {
 			fluency_passed += 1;
+			us_metrics_drop(stream->run->http->metrics, US_METRICS_DROP_FLUENCY);
 			US_LOG_VERBOSE("JPEG: Passed %u frames for fluency: now=%.03Lf, grab_after=%.03Lf",
 				fluency_passed, now_ts, grab_after_ts);
 			us_capture_hwbuf_decref(hw);
@@ -445,6 +423,9 @@ static void *_jpeg_thread(void *v_ctx) {
 		US_LOG_VERBOSE("JPEG: Fluency: delay=%.03Lf, grab_after=%.03Lf", fluency_delay, grab_after_ts);
 
 		job->hw = hw;
+		if (job->dest == NULL) {
+			job->dest = us_frame_pool_get(stream->run->http->frames);
+		}
 		us_workers_pool_assign(stream->enc->run->pool, wr);
 		US_LOG_DEBUG("JPEG: Assigned new frame in buffer=%d to worker=%s", hw->buf.index, wr->name);
 	}
@@ -457,7 +438,7 @@ static void *_raw_thread(void *v_ctx) {
 	_worker_context_s *ctx = v_ctx;
 
 	while (!atomic_load(ctx->stop)) {
-		us_capture_hwbuf_s *hw = _get_latest_hw(ctx->queue);
+		us_capture_hwbuf_s *hw = _get_latest_hw(ctx->mailbox);
 		if (hw == NULL) {
 			continue;
 		}
@@ -509,7 +490,7 @@ static void *_h264_thread(void *v_ctx) {
 
 	ldf grab_after_ts = 0;
 	while (!atomic_load(ctx->stop)) {
-		us_capture_hwbuf_s *hw = _get_latest_hw(ctx->queue);
+		us_capture_hwbuf_s *hw = _get_latest_hw(ctx->mailbox);
 		if (hw == NULL) {
 			continue;
 		}
@@ -557,7 +538,7 @@ static void *_drm_thread(void *v_ctx) {
 #		define SLOWDOWN { \
 				const ldf m_next_ts = us_get_now_monotonic() + 1; \
 				while (!atomic_load(ctx->stop) && us_get_now_monotonic() < m_next_ts) { \
-					us_capture_hwbuf_s *m_pass_hw = _get_latest_hw(ctx->queue); \
+					us_capture_hwbuf_s *m_pass_hw = _get_latest_hw(ctx->mailbox); \
 					if (m_pass_hw != NULL) { \
 						us_capture_hwbuf_decref(m_pass_hw); \
 					} \
@@ -570,7 +551,7 @@ static void *_drm_thread(void *v_ctx) {
 			CHECK(us_drm_wait_for_vsync(stream->drm));
 			US_DELETE(prev_hw, us_capture_hwbuf_decref);
 
-			us_capture_hwbuf_s *hw = _get_latest_hw(ctx->queue);
+			us_capture_hwbuf_s *hw = _get_latest_hw(ctx->mailbox);
 			if (hw == NULL) {
 				continue;
 			}
@@ -606,29 +587,18 @@ static void *_drm_thread(void *v_ctx) {
 }
 #endif
 
-static us_capture_hwbuf_s *_get_latest_hw(us_queue_s *queue) {
+static us_capture_hwbuf_s *_get_latest_hw(us_mailbox_s *mailbox) {
+	// The mailbox keeps only the freshest frame, the older ones are dropped by the producer
 	us_capture_hwbuf_s *hw;
-	if (us_queue_get(queue, (void**)&hw, 0.1) < 0) {
+	if (us_mailbox_get(mailbox, (void**)&hw, 0.1) < 0) {
 		return NULL;
 	}
-	while (!us_queue_is_empty(queue)) { // Берем только самый свежий кадр
-		us_capture_hwbuf_decref(hw);
-		assert(!us_queue_get(queue, (void**)&hw, 0));
-	}
 	return hw;
 }
 
 
-static us_capture_hwbuf_s *_get_rv1126_latest_hw(us_queue_s *queue) {
-	us_capture_hwbuf_s *hw;
-	 if (us_queue_get(queue, (void**)&hw, 0.1) < 0) {
-	 	return NULL;
-	 }
-	 while (!us_queue_is_empty(queue)) { // Берем только самый свежий кадр
-	 	us_capture_hwbuf_decref(hw);
-	 	assert(!us_queue_get(queue, (void**)&hw, 0));
-	 }
-	return hw;
+static us_capture_hwbuf_s *_get_rv1126_latest_hw(us_mailbox_s *mailbox) {
+	return _get_latest_hw(mailbox);
 }
 
 static bool _stream_has_jpeg_clients_cached(us_stream_s *stream) {
@@ -753,19 +723,37 @@ close:
 }
 #endif
 
-static void _stream_expose_jpeg(us_stream_s *stream, const us_frame_s *frame) {
+static void _stream_expose_jpeg(us_stream_s *stream, us_frame_s *frame) {
 	us_stream_runtime_s *const run = stream->run;
+	const ldf begin_ts = us_get_now_monotonic();
 	int ri;
-	while ((ri = us_ring_producer_acquire(run->http->jpeg_ring, 0)) < 0) {
-		if (atomic_load(&run->stop)) {
-			return;
+	if ((ri = us_ring_producer_acquire(run->http->jpeg_ring, 0)) < 0) {
+		// The HTTP server is late, the producer waits for a free slot
+		us_metrics_drop(run->http->metrics, US_METRICS_DROP_RING_FULL);
+		while ((ri = us_ring_producer_acquire(run->http->jpeg_ring, 0.1)) < 0) {
+			if (atomic_load(&run->stop)) {
+				return;
+			}
 		}
 	}
-	us_frame_s *const dest = run->http->jpeg_ring->items[ri];
-	us_frame_copy(frame, dest);
+	us_frame_s *dest;
+	if (frame->pool != NULL) {
+		dest = us_frame_ref(frame);
+	} else {
+		// The blank frame is not shared
+		dest = us_frame_pool_get(run->http->frames);
+		us_frame_copy(frame, dest);
+	}
+	assert(run->http->jpeg_ring->items[ri] == NULL);
+	run->http->jpeg_ring->items[ri] = dest;
 	us_ring_producer_release(run->http->jpeg_ring, ri);
+	// Wakes up the HTTP server to expose the frame immediately
+	assert(!eventfd_write(run->http->jpeg_ring_fd, 1));
+	us_tracer_span("ring_handoff", us_tracer_get_id(frame->grab_ts), begin_ts, us_get_now_monotonic());
+	// The dest belongs to the HTTP server after the release and can be already recycled,
+	// so the sink gets the caller's frame which is the same data.
 	if (stream->jpeg_sink != NULL) {
-		us_memsink_server_put(stream->jpeg_sink, dest, NULL);
+		us_memsink_server_put(stream->jpeg_sink, frame, NULL);
 	}
 }
 
@@ -793,7 +781,9 @@ static void _stream_encode_expose_h264(us_stream_s *stream, const us_frame_s *fr
 		run->h264_key_requested = false;
 		force_key = true;
 	}
+	const ldf encode_begin_ts = us_get_now_monotonic();
 	if (!us_m2m_encoder_compress(run->m2m_enc, frame, run->dest, force_key)) {
+		us_tracer_span("h264_encode", us_tracer_get_id(frame->grab_ts), encode_begin_ts, us_get_now_monotonic());
 		meta.online = !us_memsink_server_put(stream->h264_sink, run->dest, &run->h264_key_requested);
 	}
 
@@ -818,3 +808,29 @@ static void _stream_check_suicide(us_stream_s *stream) {
 		atomic_store(&run->http->last_request_ts, now_ts);
 	}
 }
+
+static void _stream_check_idle(us_stream_s *stream) {
+	if (!stream->low_memory) {
+		return;
+	}
+	us_stream_runtime_s *const run = stream->run;
+
+	const ldf now_ts = us_get_now_monotonic();
+	if (_stream_has_any_clients_cached(stream)) {
+		run->idle_ts = now_ts;
+		run->idle_trimmed = false;
+	} else if (!run->idle_trimmed && run->idle_ts + US_STREAM_IDLE_TRIM_DELAY < now_ts) {
+		US_LOG_INFO("No clients found in last %d seconds, releasing the spare memory ...",
+			US_STREAM_IDLE_TRIM_DELAY);
+		us_frame_pool_trim(run->http->frames);
+		// The encoders' frames are kept: they are owned by the workers and are already at the peak size
+		us_frame_shrink_data(run->blank->jpeg);
+#		define TRIM_SINK(x_sink) if (x_sink != NULL) { us_memsink_server_trim(x_sink); }
+		TRIM_SINK(stream->jpeg_sink);
+		TRIM_SINK(stream->raw_sink);
+		TRIM_SINK(stream->h264_sink);
+#		undef TRIM_SINK
+		us_frame_trim();
+		run->idle_trimmed = true;
+	}
+}
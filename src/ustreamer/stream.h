@@ -30,6 +30,7 @@
 #include "../libs/queue.h"
 #include "../libs/ring.h"
 #include "../libs/frame.h"
+#include "../libs/framepool.h"
 #include "../libs/memsink.h"
 #include "../libs/capture.h"
 #include "../libs/fpsi.h"
@@ -41,6 +42,11 @@
 #include "encoder.h"
 #include "m2m.h"
 #include "rv1126.h"
+#include "metrics.h"
+
+
+// The spare memory is released after this time without clients in the low memory mode
+#define US_STREAM_IDLE_TRIM_DELAY 30
 
 
 typedef struct {
@@ -52,11 +58,14 @@ typedef struct {
 	atomic_bool		h264_online;
 	us_fpsi_s		*h264_fpsi;
 
-	us_ring_s		*jpeg_ring;
+	us_frame_pool_s	*frames; // Encoded frames shared with the HTTP server and the sinks
+	us_ring_s		*jpeg_ring; // References to the shared frames
+	int				jpeg_ring_fd; // Eventfd, signalled on every frame put into the ring
 	atomic_bool		has_clients;
 	atomic_uint		snapshot_requested;
 	atomic_ullong	last_request_ts; // Seconds
 	us_fpsi_s		*captured_fpsi;
+	us_metrics_s	*metrics;
 } us_stream_http_s;
 
 typedef struct {
@@ -70,6 +79,9 @@ typedef struct {
 
 	us_blank_s			*blank;
 
+	ldf					idle_ts; // For the low memory mode
+	bool				idle_trimmed;
+
 	atomic_bool			stop;
 } us_stream_runtime_s;
 
@@ -80,6 +92,7 @@ typedef struct {
 	bool			slowdown;
 	uint			error_delay;
 	uint			exit_on_no_clients;
+	bool			low_memory;
 
 	us_memsink_s	*jpeg_sink;
 	us_memsink_s	*raw_sink;